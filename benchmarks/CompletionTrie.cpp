@@ -0,0 +1,180 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Micro benchmark for the trie behind the completers.
+//
+// Usage: nheko-bench-completion [members]
+//
+// Indexes the full emoji table and a synthetic member list the same way CompletionProxyModel
+// does, then reports the time to build each index and the average time of a prefix and of a
+// misspelled query.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <QString>
+#include <QStringList>
+
+#include "CompletionProxyModel.h"
+#include "emoji/Provider.h"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+using Trie  = trie<uint, int>;
+
+//! Same limits as the completers use.
+constexpr int LARGE_MODEL_ROWS   = 10000;
+constexpr int MAX_KEY_LENGTH     = 16;
+constexpr size_t MAX_MISTAKES    = 2;
+constexpr size_t MAX_COMPLETIONS = 7;
+constexpr int REPETITIONS        = 200;
+
+struct Entry
+{
+    QString search;
+    QString search2;
+};
+
+double
+millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+void
+insert(Trie &t, const QString &s, int row, bool truncate)
+{
+    auto key = s.toUcs4();
+    if (truncate && key.size() > MAX_KEY_LENGTH)
+        key.resize(MAX_KEY_LENGTH);
+    t.insert(key, row);
+}
+
+//! Mirrors CompletionProxyModel::indexNextRows: full texts first, then the single words. Keys
+//! are only cut off for large models.
+Trie
+buildIndex(const std::vector<Entry> &entries)
+{
+    const bool truncate = (int)entries.size() > LARGE_MODEL_ROWS;
+
+    Trie t;
+    for (int i = 0; i < (int)entries.size(); i++) {
+        if (!entries[i].search.isEmpty())
+            insert(t, entries[i].search, i, truncate);
+        if (!entries[i].search2.isEmpty())
+            insert(t, entries[i].search2, i, truncate);
+    }
+
+    for (int i = 0; i < (int)entries.size(); i++) {
+        for (const auto &s : {entries[i].search, entries[i].search2}) {
+            for (const auto &e : s.splitRef(' ')) {
+                if (!e.isEmpty())
+                    insert(t, e.toString(), i, truncate);
+            }
+        }
+    }
+    return t;
+}
+
+std::vector<Entry>
+emojiEntries()
+{
+    std::vector<Entry> entries;
+    for (const auto &e : emoji::Provider::emoji)
+        entries.push_back({e.shortName.toLower(), e.unicode});
+    return entries;
+}
+
+//! Display names are made up from syllables, so that they share prefixes like real names do.
+std::vector<Entry>
+memberEntries(int count)
+{
+    static const char *syllables[] = {"an", "ba", "el", "ka", "lo", "mi", "ne", "ri",
+                                      "su", "ta", "vo", "ze", "jo", "ha", "ul", "qu"};
+    constexpr auto syllableCount   = sizeof(syllables) / sizeof(syllables[0]);
+
+    std::mt19937 rng(42);
+    auto word = [&rng](int length) {
+        QString w;
+        for (int i = 0; i < length; i++)
+            w += syllables[rng() % syllableCount];
+        return w;
+    };
+
+    std::vector<Entry> entries;
+    entries.reserve(count);
+    for (int i = 0; i < count; i++) {
+        auto name = word(2 + rng() % 3);
+        if (rng() % 2)
+            name += " " + word(1 + rng() % 3);
+        entries.push_back({name, QStringLiteral("@user%1:example.org").arg(i)});
+    }
+    return entries;
+}
+
+//! Average time of one search in microseconds.
+double
+searchTime(const Trie &t, const QStringList &queries)
+{
+    std::vector<QVector<uint>> keys;
+    for (const auto &q : queries)
+        keys.push_back(q.toUcs4());
+
+    size_t found = 0;
+    auto start   = Clock::now();
+    for (int i = 0; i < REPETITIONS; i++) {
+        for (const auto &k : keys)
+            found += t.search(k, MAX_COMPLETIONS, MAX_MISTAKES).size();
+    }
+    auto elapsed = millisecondsSince(start);
+
+    // Keep the searches from being optimized away.
+    if (found == 0)
+        std::fprintf(stderr, "no results\n");
+
+    return elapsed * 1000 / (REPETITIONS * keys.size());
+}
+
+void
+run(const char *name,
+    const std::vector<Entry> &entries,
+    const QStringList &prefixes,
+    const QStringList &typos)
+{
+    auto start   = Clock::now();
+    auto t       = buildIndex(entries);
+    auto buildMs = millisecondsSince(start);
+
+    std::printf("%-10s %8zu %10.2f %12.2f %12.2f\n",
+                name,
+                entries.size(),
+                buildMs,
+                searchTime(t, prefixes),
+                searchTime(t, typos));
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+    const int members = argc > 1 ? std::atoi(argv[1]) : 50000;
+
+    std::printf(
+      "%-10s %8s %10s %12s %12s\n", "index", "entries", "build ms", "prefix us", "typo us");
+
+    run("emoji",
+        emojiEntries(),
+        {"s", "sm", "smil", "face", "thumbs", "heart", "flag", "cat"},
+        {"smlie", "hreat", "thubms", "fcae", "flga", "cta", "rcoket", "pizaz"});
+
+    run("members",
+        memberEntries(members),
+        {"k", "ka", "kalo", "mine", "sutari", "user1", "user42", "zeta"},
+        {"lkao", "mnie", "sutrai", "usre1", "zeat", "bnae", "qiuha", "elnaa"});
+
+    return 0;
+}
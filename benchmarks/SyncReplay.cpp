@@ -0,0 +1,290 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Headless benchmark, that replays recorded /sync responses through the cache.
+//
+// Usage: nheko-bench [--keep] initial.json [incremental.json...]
+//
+// The fixtures are plain /sync response bodies. They are applied in the order given, the first
+// one usually being an initial sync. Like in the client, a fixture applied to a cache without a
+// sync token is stored with Cache::saveInitialState on the writer thread, the others with
+// Cache::saveState. For every fixture the time spent storing it, in
+// olm::handle_to_device_messages and in Cache::getRoomInfo is reported, together with the
+// number of pages LMDB wrote and the peak resident set size of the process.
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#define NHEKO_BENCH_HAVE_RUSAGE 1
+#endif
+
+#include <mtx/responses/sync.hpp>
+#include <nlohmann/json.hpp>
+
+#include "Cache.h"
+#include "Cache_p.h"
+#include "Logging.h"
+#include "MatrixClient.h"
+#include "UserSettingsPage.h"
+#include "encryption/Olm.h"
+
+namespace {
+constexpr auto BENCH_USER_ID   = "@nheko-bench:localhost";
+constexpr auto BENCH_DEVICE_ID = "NHEKOBENCH";
+
+using Clock = std::chrono::steady_clock;
+
+struct PhaseTimes
+{
+    double parse       = 0;
+    double saveState   = 0;
+    double toDevice    = 0;
+    double getRoomInfo = 0;
+};
+
+double
+millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+//! Peak resident set size in KiB, 0 if the platform does not report it.
+long
+peakRss()
+{
+#ifdef NHEKO_BENCH_HAVE_RUSAGE
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+//! Bytes this process passed to write(2) so far, 0 if unavailable. LMDB writes every dirty page
+//! of a committed transaction with pwrite, so the delta divided by the page size is a good
+//! estimate of the pages written.
+unsigned long long
+bytesWritten()
+{
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    unsigned long long value = 0;
+    while (io >> key >> value) {
+        if (key == "wchar:")
+            return value;
+    }
+    return 0;
+}
+
+std::optional<mtx::responses::Sync>
+loadFixture(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        std::cerr << "failed to open fixture " << path.toStdString() << "\n";
+        return std::nullopt;
+    }
+
+    try {
+        return nlohmann::json::parse(file.readAll().toStdString()).get<mtx::responses::Sync>();
+    } catch (const std::exception &e) {
+        std::cerr << "failed to parse fixture " << path.toStdString() << ": " << e.what()
+                  << "\n";
+        return std::nullopt;
+    }
+}
+
+//! Verification and key request messages are dispatched to the ChatPage, which does not exist in
+//! the benchmark. Only the olm encrypted messages are replayed.
+std::vector<mtx::events::collections::DeviceEvents>
+replayableToDeviceMessages(const std::vector<mtx::events::collections::DeviceEvents> &msgs)
+{
+    std::vector<mtx::events::collections::DeviceEvents> replayable;
+    for (const auto &msg : msgs) {
+        if (std::visit([](const auto &e) { return e.type; }, msg) ==
+            mtx::events::EventType::RoomEncrypted)
+            replayable.push_back(msg);
+    }
+    return replayable;
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+    QCoreApplication::setApplicationName("nheko-bench");
+    QCoreApplication::setOrganizationName("nheko");
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays recorded /sync responses through the nheko cache.");
+    parser.addHelpOption();
+    QCommandLineOption keepOption("keep", "Keep the benchmark database after the run.");
+    parser.addOption(keepOption);
+    parser.addPositionalArgument("fixtures", "Recorded /sync responses, applied in order.");
+    parser.process(app);
+
+    const auto fixtures = parser.positionalArguments();
+    if (fixtures.isEmpty())
+        parser.showHelp(1);
+
+    auto dataDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dataDir);
+
+    try {
+        nhlog::init((dataDir + "/nheko-bench.log").toStdString());
+    } catch (const spdlog::spdlog_ex &ex) {
+        std::cerr << "Log initialization failed: " << ex.what() << "\n";
+        return 1;
+    }
+    // Logging would otherwise dominate both the timings and the written bytes.
+    for (const auto &logger : {nhlog::ui(), nhlog::net(), nhlog::db(), nhlog::crypto()})
+        logger->set_level(spdlog::level::err);
+
+    UserSettings::initialize(std::nullopt);
+
+    http::init();
+    http::client()->set_user(mtx::identifiers::parse<mtx::identifiers::User>(BENCH_USER_ID));
+    http::client()->set_device_id(BENCH_DEVICE_ID);
+    olm::client()->set_user_id(BENCH_USER_ID);
+    olm::client()->set_device_id(BENCH_DEVICE_ID);
+
+    cache::init(BENCH_USER_ID);
+
+    if (!cache::client()->isDatabaseReady()) {
+        QEventLoop loop;
+        QObject::connect(cache::client(), &Cache::databaseReady, &loop, &QEventLoop::quit);
+        loop.exec();
+    }
+
+    if (!cache::isInitialized()) {
+        cache::setCurrentFormat();
+        olm::client()->create_new_account();
+        cache::saveOlmAccount(olm::client()->save(cache::client()->pickleSecret()));
+    } else {
+        olm::client()->load(cache::restoreOlmAccount(), cache::client()->pickleSecret());
+    }
+
+    const auto pageSize  = cache::client()->environmentStat().ms_psize;
+    const auto startPgno = cache::client()->environmentInfo().me_last_pgno;
+
+    std::printf("%-40s %8s %10s %10s %10s %10s %10s %10s\n",
+                "fixture",
+                "rooms",
+                "parse ms",
+                "save ms",
+                "todev ms",
+                "info ms",
+                "pages",
+                "rss KiB");
+
+    PhaseTimes total;
+    unsigned long long totalPages = 0;
+
+    for (const auto &path : fixtures) {
+        PhaseTimes times;
+
+        auto start = Clock::now();
+        auto res   = loadFixture(path);
+        times.parse = millisecondsSince(start);
+        if (!res)
+            return 1;
+
+        const auto written = bytesWritten();
+
+        const bool initial = cache::nextBatchToken().empty();
+
+        start = Clock::now();
+        std::optional<std::string> error;
+        if (initial) {
+            cache::client()->runOnWriterThread(
+              [&res, &error]() {
+                  try {
+                      cache::client()->saveInitialState(*res);
+                  } catch (const lmdb::error &e) {
+                      error = e.what();
+                  }
+              },
+              true);
+        } else {
+            try {
+                cache::saveState(*res);
+            } catch (const lmdb::error &e) {
+                error = e.what();
+            }
+        }
+        if (error) {
+            std::cerr << (initial ? "saveInitialState" : "saveState") << " failed for "
+                      << path.toStdString() << ": " << *error << "\n";
+            return 1;
+        }
+        times.saveState = millisecondsSince(start);
+
+        const auto pages = (bytesWritten() - written) / pageSize;
+
+        start = Clock::now();
+        olm::handle_to_device_messages(replayableToDeviceMessages(res->to_device.events));
+        times.toDevice = millisecondsSince(start);
+
+        start = Clock::now();
+        auto updates      = cache::getRoomInfo(cache::client()->roomsWithStateUpdates(*res));
+        times.getRoomInfo = millisecondsSince(start);
+
+        // Deliver the signals emitted by the cache, like a real sync would.
+        QCoreApplication::processEvents();
+
+        std::printf("%-40s %8zu %10.1f %10.1f %10.1f %10.1f %10llu %10ld\n",
+                    QFileInfo(path).fileName().left(40).toStdString().c_str(),
+                    updates.size(),
+                    times.parse,
+                    times.saveState,
+                    times.toDevice,
+                    times.getRoomInfo,
+                    pages,
+                    peakRss());
+
+        total.parse += times.parse;
+        total.saveState += times.saveState;
+        total.toDevice += times.toDevice;
+        total.getRoomInfo += times.getRoomInfo;
+        totalPages += pages;
+    }
+
+    std::printf("%-40s %8s %10.1f %10.1f %10.1f %10.1f %10llu %10ld\n",
+                "total",
+                "",
+                total.parse,
+                total.saveState,
+                total.toDevice,
+                total.getRoomInfo,
+                totalPages,
+                peakRss());
+    std::printf("map grew by %zu pages of %u bytes\n",
+                cache::client()->environmentInfo().me_last_pgno - startPgno,
+                pageSize);
+
+    if (!parser.isSet(keepOption))
+        cache::deleteData();
+
+    return 0;
+}
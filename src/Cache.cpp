@@ -3,8 +3,12 @@
 //
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <limits>
 #include <stdexcept>
+#include <tuple>
 #include <variant>
 
 #include <QByteArray>
@@ -15,6 +19,7 @@
 #include <QMap>
 #include <QMessageBox>
 #include <QStandardPaths>
+#include <QtConcurrent>
 
 #if __has_include(<keychain.h>)
 #include <keychain.h>
@@ -36,7 +41,7 @@
 
 //! Should be changed when a breaking change occurs in the cache format.
 //! This will reset client's data.
-static const std::string CURRENT_CACHE_FORMAT_VERSION("2021.08.31");
+static const std::string CURRENT_CACHE_FORMAT_VERSION("2021.11.04");
 
 //! Keys used for the DB
 static const std::string_view NEXT_BATCH_KEY("next_batch");
@@ -44,11 +49,39 @@ static const std::string_view OLM_ACCOUNT_KEY("olm_account");
 static const std::string_view CACHE_FORMAT_VERSION_KEY("cache_format_version");
 static const std::string_view CURRENT_ONLINE_BACKUP_VERSION("current_online_backup_version");
 
+//! Events kept per room, unless the retention policy of the room says otherwise.
 constexpr size_t MAX_RESTORED_MESSAGES = 30'000;
+//! Time between two runs of the history pruning, see Cache::pruneNextRooms().
+constexpr int PRUNE_INTERVAL_MS = 60'000;
+//! Time a run of the history pruning may take, before it yields to the syncs.
+constexpr int PRUNE_SLICE_MS = 50;
+//! Pause between two runs, while rooms are left to prune.
+constexpr int PRUNE_PAUSE_MS = 1'000;
+//! Events deleted per write transaction, so that the writer is never blocked for long.
+constexpr std::size_t PRUNE_BATCH_SIZE = 500;
 
 constexpr auto DB_SIZE    = 32ULL * 1024ULL * 1024ULL * 1024ULL; // 32 GB
+//! The map is grown by at least this much, once the data file uses 80% of it.
+constexpr auto MAP_GROWTH = 4ULL * 1024ULL * 1024ULL * 1024ULL; // 4 GB
+//! Smaller data files are never compacted.
+constexpr auto COMPACTION_MIN_SIZE = 512ULL * 1024ULL * 1024ULL; // 512 MB
+constexpr unsigned int ENV_FLAGS   = MDB_NOMETASYNC | MDB_NOSYNC;
 constexpr auto MAX_DBS    = 32384UL;
 constexpr auto BATCH_SIZE = 100;
+//! Joined rooms committed per write transaction during the initial sync.
+constexpr std::size_t INITIAL_SYNC_BATCH_SIZE = 50;
+//! Rooms, whose members are kept in memory at the same time.
+constexpr std::size_t MAX_MEMBER_DIRECTORIES = 64;
+//! Unpickled inbound megolm sessions kept in memory.
+constexpr std::size_t MAX_CACHED_INBOUND_SESSIONS = 256;
+//! Longer words are cut off in the search index.
+constexpr int MAX_SEARCH_TOKEN_LENGTH = 32;
+//! Postings of the rarest word of a query, that are checked per room.
+constexpr std::size_t MAX_SEARCH_CANDIDATES = 50000;
+//! Words the last word of a query is completed to.
+constexpr std::size_t MAX_SEARCH_PREFIX_EXPANSION = 16;
+//! Characters of the body kept in the stored last message of a room.
+constexpr int LAST_MESSAGE_BODY_LENGTH = 256;
 
 //! Cache databases and their format.
 //!
@@ -62,9 +95,17 @@ constexpr auto SPACES_PARENTS_DB("space_parents");
 constexpr auto SPACES_CHILDREN_DB("space_children");
 //! Information that  must be kept between sync requests.
 constexpr auto SYNC_STATE_DB("sync_state");
-//! Read receipts per room/event.
+//! compositeKey({room_id, user_id}) -> the latest read receipt of the user in the room.
 constexpr auto READ_RECEIPTS_DB("read_receipts");
+//! compositeKey({room_id, event_id}) -> the users, whose latest read receipt is for the event.
+constexpr auto RECEIPTS_BY_EVENT_DB("read_receipts_by_event");
 constexpr auto NOTIFICATIONS_DB("sent_notifications");
+//! room_id -> LastMessage, the message shown in the room list.
+constexpr auto LAST_MESSAGES_DB("last_messages");
+//! room_id \0 event_id -> decrypted event, encrypted with a key derived from the pickle secret.
+constexpr auto DECRYPTED_EVENTS_DB("decrypted_events");
+//! room_id -> RetentionPolicy, rooms without an entry use the default policy.
+constexpr auto RETENTION_POLICIES_DB("retention_policies");
 
 //! Encryption related databases.
 
@@ -95,6 +136,333 @@ namespace {
 std::unique_ptr<Cache> instance_ = nullptr;
 }
 
+namespace {
+struct RoomDbSpec
+{
+    const char *suffix;
+    unsigned int flags;
+};
+
+//! Name suffix and flags of the per room databases, in the order of Cache::RoomDb.
+constexpr std::array<RoomDbSpec, 13> ROOM_DB_SPECS = {{
+  {"/events", MDB_CREATE},
+  {"/event_order", MDB_CREATE | MDB_INTEGERKEY},
+  {"/event2order", MDB_CREATE},
+  {"/msg2order", MDB_CREATE},
+  {"/order2msg", MDB_CREATE | MDB_INTEGERKEY},
+  {"/pending", MDB_CREATE | MDB_INTEGERKEY},
+  {"/related", MDB_CREATE | MDB_DUPSORT},
+  {"/state", MDB_CREATE},
+  {"/state_by_key", MDB_CREATE | MDB_DUPSORT},
+  {"/account_data", MDB_CREATE},
+  {"/members", MDB_CREATE},
+  {"/mentions", MDB_CREATE},
+  {"/search", MDB_CREATE | MDB_DUPSORT},
+}};
+
+//! Handles opened in the write transaction started with Cache::beginWriteTxn on this thread.
+//! LMDB only shares them with other transactions, once that transaction committed.
+struct StagedRoomDbs
+{
+    MDB_txn *txn       = nullptr;
+    std::uint64_t epoch = 0;
+    std::vector<std::tuple<std::string, std::size_t, MDB_dbi>> handles;
+};
+thread_local StagedRoomDbs stagedRoomDbs;
+
+//! Member changes of the write transaction started with Cache::beginWriteTxn on this thread.
+struct StagedMembers
+{
+    struct Update
+    {
+        std::string room_id;
+        std::string user_id;
+        std::optional<MemberInfo> info;
+    };
+
+    MDB_txn *txn = nullptr;
+    std::vector<Update> updates;
+};
+thread_local StagedMembers stagedMembers;
+
+//! Key of a decrypted event. Room ids can't contain a 0 byte, so the events of a room are
+//! stored next to each other.
+std::string
+decryptedEventKey(const std::string &room_id, std::string_view event_id)
+{
+    std::string key = room_id;
+    key.push_back('\0');
+    key.append(event_id);
+    return key;
+}
+
+//! The event shown in the room list, without formatting and with a shortened body.
+json
+lastMessageEvent(const mtx::events::collections::TimelineEvents &event)
+{
+    auto j = mtx::accessors::serialize_event(event);
+    if (auto content = j.find("content"); content != j.end()) {
+        content->erase("formatted_body");
+        content->erase("format");
+        if (auto body = content->find("body"); body != content->end() && body->is_string()) {
+            auto text = QString::fromStdString(body->get<std::string>());
+            if (text.size() > LAST_MESSAGE_BODY_LENGTH)
+                *body = text.left(LAST_MESSAGE_BODY_LENGTH).toStdString();
+        }
+    }
+    return j;
+}
+
+//! The latest read receipt of a user. Stored as the timestamp, a 64 bit little endian integer,
+//! followed by the event id.
+struct StoredReceipt
+{
+    std::string_view event_id;
+    uint64_t ts = 0;
+};
+
+std::string
+encodeReceipt(std::string_view event_id, uint64_t ts)
+{
+    std::string value(sizeof(ts), '\0');
+    for (std::size_t i = 0; i < sizeof(ts); i++)
+        value[i] = static_cast<char>(ts >> (8 * i));
+    value.append(event_id);
+    return value;
+}
+
+std::optional<StoredReceipt>
+decodeReceipt(std::string_view value)
+{
+    StoredReceipt receipt;
+    if (value.size() < sizeof(receipt.ts))
+        return std::nullopt;
+
+    for (std::size_t i = 0; i < sizeof(receipt.ts); i++)
+        receipt.ts |= static_cast<uint64_t>(static_cast<unsigned char>(value[i])) << (8 * i);
+    receipt.event_id = value.substr(sizeof(receipt.ts));
+    return receipt;
+}
+
+//! Splits a text into the words, that are searched for: Unicode normalized, case folded and
+//! without diacritics. Han characters are single words, since they are not separated by spaces.
+std::vector<std::string>
+searchTokens(const QString &text)
+{
+    std::vector<std::string> tokens;
+    QVector<uint> token;
+    auto flush = [&tokens, &token] {
+        if (!token.isEmpty()) {
+            token.resize(std::min(token.size(), MAX_SEARCH_TOKEN_LENGTH));
+            tokens.push_back(QString::fromUcs4(token.data(), token.size()).toStdString());
+            token.clear();
+        }
+    };
+
+    for (uint c : text.normalized(QString::NormalizationForm_KD).toCaseFolded().toUcs4()) {
+        if (QChar::category(c) == QChar::Mark_NonSpacing)
+            continue;
+
+        if (QChar::script(c) == QChar::Script_Han) {
+            flush();
+            token.push_back(c);
+            flush();
+        } else if (QChar::isLetterOrNumber(c)) {
+            token.push_back(c);
+        } else {
+            flush();
+        }
+    }
+    flush();
+
+    return tokens;
+}
+
+//! Words of decrypted messages are only stored hashed. Plain words never start with '#'.
+std::string
+hashedSearchToken(const mtx::crypto::BinaryBuf &key, const std::string &token)
+{
+    auto hash = mtx::crypto::HMAC_SHA256(key, mtx::crypto::to_binary_buf(token));
+    return "#" + mtx::crypto::bin2base64_unpadded(std::string(hash.begin(), hash.begin() + 16));
+}
+
+//! Postings are sorted by the big endian timestamp in front of the event id, newest last.
+std::string
+searchPosting(uint64_t timestamp, std::string_view event_id)
+{
+    std::string posting(sizeof(timestamp), '\0');
+    for (std::size_t i = 0; i < sizeof(timestamp); i++)
+        posting[i] = static_cast<char>(timestamp >> (8 * (sizeof(timestamp) - 1 - i)));
+    posting.append(event_id);
+    return posting;
+}
+
+uint64_t
+searchPostingTimestamp(std::string_view posting)
+{
+    uint64_t timestamp = 0;
+    for (std::size_t i = 0; i < sizeof(timestamp) && i < posting.size(); i++)
+        timestamp = (timestamp << 8) | static_cast<unsigned char>(posting[i]);
+    return timestamp;
+}
+
+//! The keys of the words of a message in the search index. Empty, if it has no text.
+std::vector<std::string>
+searchKeys(const mtx::events::collections::TimelineEvents &event,
+           const std::optional<mtx::crypto::BinaryBuf> &hashKey)
+{
+    auto body = mtx::accessors::body(event);
+    if (body.empty())
+        return {};
+
+    auto tokens = searchTokens(QString::fromStdString(body));
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+    if (hashKey)
+        for (auto &token : tokens)
+            token = hashedSearchToken(*hashKey, token);
+    return tokens;
+}
+
+std::string
+searchPosting(const mtx::events::collections::TimelineEvents &event)
+{
+    return searchPosting(mtx::accessors::origin_server_ts(event).toMSecsSinceEpoch(),
+                         mtx::accessors::event_id(event));
+}
+
+//! Size of the pages used by a database.
+uint64_t
+databaseBytes(lmdb::txn &txn, const lmdb::dbi &db)
+{
+    const auto stat = db.stat(txn);
+    return static_cast<uint64_t>(stat.ms_branch_pages + stat.ms_leaf_pages +
+                                 stat.ms_overflow_pages) *
+           stat.ms_psize;
+}
+
+//! Pages in the free list, same as mdb_stat -f: each value starts with the number of pages in it.
+uint64_t
+freePages(lmdb::txn &txn)
+{
+    uint64_t pages = 0;
+    auto cursor    = lmdb::cursor::open(txn, 0);
+    std::string_view key, value;
+    while (cursor.get(key, value, MDB_NEXT)) {
+        std::size_t count = 0;
+        std::memcpy(&count, value.data(), std::min(sizeof(count), value.size()));
+        pages += count;
+    }
+    return pages;
+}
+
+//! Directory of the cache of a user in the current profile.
+QString
+cacheDirectoryOf(const QString &userId)
+{
+    return QString("%1/%2%3")
+      .arg(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation))
+      .arg(QString::fromUtf8(userId.toUtf8().toHex()))
+      .arg(QString::fromUtf8(UserSettings::instance()->profile().toUtf8().toHex()));
+}
+
+//! The room of a database and what it stores, used to group them in Cache::statistics(). The
+//! room is empty for the shared databases.
+std::pair<std::string_view, std::string>
+classifyDatabase(std::string_view name)
+{
+    static const std::map<std::string_view, std::string_view> kinds = {
+      {"events", "events"},
+      {"event_order", "events"},
+      {"event2order", "events"},
+      {"msg2order", "events"},
+      {"order2msg", "events"},
+      {"pending", "events"},
+      {"related", "events"},
+      {"state", "state"},
+      {"state_by_key", "state"},
+      {"account_data", "state"},
+      {"invite_state", "state"},
+      {"members", "members"},
+      {"invite_members", "members"},
+      {READ_RECEIPTS_DB, "receipts"},
+      {RECEIPTS_BY_EVENT_DB, "receipts"},
+      {"pending_receipts", "receipts"},
+      {INBOUND_MEGOLM_SESSIONS_DB, "megolm"},
+      {OUTBOUND_MEGOLM_SESSIONS_DB, "megolm"},
+      {MEGOLM_SESSIONS_DATA_DB, "megolm"},
+      {DEVICES_DB, "devices"},
+      {DEVICE_KEYS_DB, "devices"},
+      {"user_key", "devices"},
+      {"verified", "devices"},
+    };
+
+    const auto kind = [](std::string_view name) {
+        auto it = kinds.find(name);
+        return std::string(it != kinds.end() ? it->second : name);
+    };
+
+    // One database per device we have olm sessions with, named after its curve25519 key.
+    if (name.substr(0, sizeof("olm_sessions") - 1) == "olm_sessions")
+        return {{}, "olm"};
+
+    if (!name.empty() && name.front() == '!') {
+        static const auto roomSuffixes = [] {
+            std::vector<std::string_view> suffixes;
+            for (const auto &spec : ROOM_DB_SPECS)
+                suffixes.emplace_back(spec.suffix);
+            suffixes.emplace_back("/invite_state");
+            suffixes.emplace_back("/invite_members");
+            return suffixes;
+        }();
+
+        for (auto suffix : roomSuffixes)
+            if (name.size() > suffix.size() &&
+                name.substr(name.size() - suffix.size()) == suffix)
+                return {name.substr(0, name.size() - suffix.size()), kind(suffix.substr(1))};
+
+        return {{}, "other"};
+    }
+
+    return {{}, kind(name)};
+}
+}
+
+namespace {
+std::shared_mutex transactionMtx;
+thread_local int heldTransactions = 0;
+}
+
+TransactionGuard::TransactionGuard()
+{
+    if (heldTransactions++ == 0)
+        transactionMtx.lock_shared();
+}
+
+TransactionGuard::TransactionGuard(const TransactionGuard &)
+  : TransactionGuard()
+{}
+
+TransactionGuard::~TransactionGuard()
+{
+    if (--heldTransactions == 0)
+        transactionMtx.unlock_shared();
+}
+
+bool
+TransactionGuard::tryExclusive(const std::function<void()> &fn)
+{
+    // Waiting would deadlock with a transaction of this thread or with threads, that start a
+    // nested transaction, so this gives up instead.
+    if (heldTransactions > 0 || !transactionMtx.try_lock())
+        return false;
+
+    std::lock_guard lock(transactionMtx, std::adopt_lock);
+    fn();
+    return true;
+}
+
 struct RO_txn
 {
     ~RO_txn() { txn.reset(); }
@@ -102,11 +470,14 @@ struct RO_txn
     operator lmdb::txn &() noexcept { return txn; }
 
     lmdb::txn &txn;
+    TransactionGuard guard;
 };
 
 RO_txn
 ro_txn(lmdb::env &env)
 {
+    TransactionGuard guard;
+
     thread_local lmdb::txn txn     = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
     thread_local int reuse_counter = 0;
 
@@ -125,7 +496,7 @@ ro_txn(lmdb::env &env)
     }
     reuse_counter++;
 
-    return RO_txn{txn};
+    return RO_txn{txn, guard};
 }
 
 template<class T>
@@ -211,9 +582,36 @@ Cache::Cache(const QString &userId, QObject *parent)
           }
       },
       Qt::QueuedConnection);
+
+    writerThread_.setObjectName("nheko-db-writer");
+    writer_ = new QObject;
+    writer_->moveToThread(&writerThread_);
+    connect(&writerThread_, &QThread::finished, writer_, &QObject::deleteLater);
+    writerThread_.start();
+
+    connect(&pruneTimer_, &QTimer::timeout, this, &Cache::pruneNextRooms);
+    pruneTimer_.start(PRUNE_INTERVAL_MS);
+
     setup();
 }
 
+Cache::~Cache()
+{
+    writerThread_.quit();
+    writerThread_.wait();
+}
+
+void
+Cache::runOnWriterThread(std::function<void()> fn, bool blocking)
+{
+    if (!blocking)
+        QMetaObject::invokeMethod(writer_, std::move(fn), Qt::QueuedConnection);
+    else if (QThread::currentThread() == &writerThread_)
+        fn();
+    else
+        QMetaObject::invokeMethod(writer_, std::move(fn), Qt::BlockingQueuedConnection);
+}
+
 void
 Cache::setup()
 {
@@ -227,10 +625,7 @@ Cache::setup()
                       .arg(QString::fromUtf8(localUserId_.toUtf8().toHex()))
                       .arg(QString::fromUtf8(settings->profile().toUtf8().toHex()));
 
-    cacheDirectory_ = QString("%1/%2%3")
-                        .arg(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation))
-                        .arg(QString::fromUtf8(localUserId_.toUtf8().toHex()))
-                        .arg(QString::fromUtf8(settings->profile().toUtf8().toHex()));
+    cacheDirectory_ = cacheDirectoryOf(localUserId_);
 
     bool isInitial = !QFile::exists(cacheDirectory_);
 
@@ -262,11 +657,19 @@ Cache::setup()
         }
     }
 
+    // The old data file is only moved away during a compaction, until the compacted one replaced
+    // it, see compactIfFragmented().
+    if (!QFile::exists(cacheDirectory_ + "/data.mdb") &&
+        QFile::exists(cacheDirectory_ + "/data.mdb.old")) {
+        nhlog::db()->warn("restoring the data file of an interrupted compaction");
+        QFile::rename(cacheDirectory_ + "/data.mdb.old", cacheDirectory_ + "/data.mdb");
+    }
+
     try {
         // NOTE(Nico): We may want to use (MDB_MAPASYNC | MDB_WRITEMAP) in the future, but
         // it can really mess up our database, so we shouldn't. For now, hopefully
         // NOMETASYNC is fast enough.
-        env_.open(cacheDirectory_.toStdString().c_str(), MDB_NOMETASYNC | MDB_NOSYNC);
+        env_.open(cacheDirectory_.toStdString().c_str(), ENV_FLAGS);
     } catch (const lmdb::error &e) {
         if (e.code() != MDB_VERSION_MISMATCH && e.code() != MDB_INVALID) {
             throw std::runtime_error("LMDB initialization failed" + std::string(e.what()));
@@ -283,7 +686,10 @@ Cache::setup()
         env_.open(cacheDirectory_.toStdString().c_str());
     }
 
-    auto txn          = lmdb::txn::begin(env_);
+    compactIfFragmented();
+    growMap(false);
+
+    auto txn          = GuardedTxn(env_);
     syncStateDb_      = lmdb::dbi::open(txn, SYNC_STATE_DB, MDB_CREATE);
     roomsDb_          = lmdb::dbi::open(txn, ROOMS_DB, MDB_CREATE);
     spacesChildrenDb_ = lmdb::dbi::open(txn, SPACES_CHILDREN_DB, MDB_CREATE | MDB_DUPSORT);
@@ -291,6 +697,11 @@ Cache::setup()
     invitesDb_        = lmdb::dbi::open(txn, INVITES_DB, MDB_CREATE);
     readReceiptsDb_   = lmdb::dbi::open(txn, READ_RECEIPTS_DB, MDB_CREATE);
     notificationsDb_  = lmdb::dbi::open(txn, NOTIFICATIONS_DB, MDB_CREATE);
+    lastMessagesDb_   = lmdb::dbi::open(txn, LAST_MESSAGES_DB, MDB_CREATE);
+
+    decryptedEventsDb_   = lmdb::dbi::open(txn, DECRYPTED_EVENTS_DB, MDB_CREATE);
+    retentionPoliciesDb_ = lmdb::dbi::open(txn, RETENTION_POLICIES_DB, MDB_CREATE);
+    receiptsByEventDb_   = lmdb::dbi::open(txn, RECEIPTS_BY_EVENT_DB, MDB_CREATE | MDB_DUPSORT);
 
     // Device management
     devicesDb_    = lmdb::dbi::open(txn, DEVICES_DB, MDB_CREATE);
@@ -515,7 +926,7 @@ Cache::roomEncryptionSettings(const std::string &room_id)
 
         if (res) {
             try {
-                StateEvent<Encryption> msg = json::parse(event);
+                StateEvent<Encryption> msg = cache::parseRecord(event);
 
                 return msg.content;
             } catch (const json::exception &e) {
@@ -542,20 +953,18 @@ Cache::exportSessionKeys()
     std::string_view key, value;
     while (cursor.get(key, value, MDB_NEXT)) {
         ExportedSession exported;
-        MegolmSessionIndex index;
-
-        auto saved_session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
 
-        try {
-            index = nlohmann::json::parse(key).get<MegolmSessionIndex>();
-        } catch (const nlohmann::json::exception &e) {
-            nhlog::db()->critical("failed to export megolm session: {}", e.what());
+        auto index = megolmSessionIndexFromKey(key);
+        if (!index) {
+            nhlog::db()->critical("failed to export megolm session: malformed key");
             continue;
         }
 
-        exported.room_id     = index.room_id;
-        exported.sender_key  = index.sender_key;
-        exported.session_id  = index.session_id;
+        auto saved_session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+
+        exported.room_id     = index->room_id;
+        exported.sender_key  = index->sender_key;
+        exported.session_id  = index->session_id;
         exported.session_key = export_session(saved_session.get(), -1);
 
         keys.sessions.push_back(exported);
@@ -597,10 +1006,10 @@ Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
                                 const GroupSessionData &data)
 {
     using namespace mtx::crypto;
-    const auto key     = json(index).dump();
+    const auto key     = megolmSessionKey(index);
     const auto pickled = pickle<InboundSessionObject>(session.get(), pickle_secret_);
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
 
     std::string_view value;
     if (inboundMegolmSessionDb_.get(txn, key, value)) {
@@ -613,8 +1022,10 @@ Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
     }
 
     inboundMegolmSessionDb_.put(txn, key, pickled);
-    megolmSessionDataDb_.put(txn, key, json(data).dump());
+    megolmSessionDataDb_.put(txn, key, cache::dumpRecord(json(data)));
     txn.commit();
+
+    forgetInboundMegolmSession(key);
 }
 
 mtx::crypto::InboundGroupSessionPtr
@@ -624,7 +1035,7 @@ Cache::getInboundMegolmSession(const MegolmSessionIndex &index)
 
     try {
         auto txn        = ro_txn(env_);
-        std::string key = json(index).dump();
+        std::string key = megolmSessionKey(index);
         std::string_view value;
 
         if (inboundMegolmSessionDb_.get(txn, key, value)) {
@@ -645,7 +1056,7 @@ Cache::inboundMegolmSessionExists(const MegolmSessionIndex &index)
 
     try {
         auto txn        = ro_txn(env_);
-        std::string key = json(index).dump();
+        std::string key = megolmSessionKey(index);
         std::string_view value;
 
         return inboundMegolmSessionDb_.get(txn, key, value);
@@ -677,10 +1088,12 @@ Cache::updateOutboundMegolmSession(const std::string &room_id,
     json j;
     j["session"] = pickle<OutboundSessionObject>(ptr.get(), pickle_secret_);
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     outboundMegolmSessionDb_.put(txn, room_id, j.dump());
-    megolmSessionDataDb_.put(txn, json(index).dump(), json(data).dump());
+    megolmSessionDataDb_.put(txn, megolmSessionKey(index), cache::dumpRecord(json(data)));
     txn.commit();
+
+    forgetInboundMegolmSession(megolmSessionKey(index));
 }
 
 void
@@ -692,7 +1105,7 @@ Cache::dropOutboundMegolmSession(const std::string &room_id)
         return;
 
     {
-        auto txn = lmdb::txn::begin(env_);
+        auto txn = GuardedTxn(env_);
         outboundMegolmSessionDb_.del(txn, room_id);
         // don't delete session data, so that we can still share the session.
         txn.commit();
@@ -717,10 +1130,12 @@ Cache::saveOutboundMegolmSession(const std::string &room_id,
     json j;
     j["session"] = pickled;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     outboundMegolmSessionDb_.put(txn, room_id, j.dump());
-    megolmSessionDataDb_.put(txn, json(index).dump(), json(data).dump());
+    megolmSessionDataDb_.put(txn, megolmSessionKey(index), cache::dumpRecord(json(data)));
     txn.commit();
+
+    forgetInboundMegolmSession(megolmSessionKey(index));
 }
 
 bool
@@ -755,8 +1170,8 @@ Cache::getOutboundMegolmSession(const std::string &room_id)
         index.sender_key = olm::client()->identity_keys().ed25519;
         index.session_id = mtx::crypto::session_id(ref.session.get());
 
-        if (megolmSessionDataDb_.get(txn, json(index).dump(), value)) {
-            ref.data = nlohmann::json::parse(value).get<GroupSessionData>();
+        if (megolmSessionDataDb_.get(txn, megolmSessionKey(index), value)) {
+            ref.data = cache::parseRecord(value).get<GroupSessionData>();
         }
 
         return ref;
@@ -766,6 +1181,114 @@ Cache::getOutboundMegolmSession(const std::string &room_id)
     }
 }
 
+std::shared_ptr<InboundGroupSessionDataRef>
+Cache::cachedInboundMegolmSession(const MegolmSessionIndex &index)
+{
+    using namespace mtx::crypto;
+
+    const auto key = megolmSessionKey(index);
+
+    std::uint64_t generation;
+    {
+        std::lock_guard lock(inboundSessionsMtx_);
+        if (auto it = inboundSessions_.find(key); it != inboundSessions_.end())
+            return it->second;
+        generation = inboundSessionsGeneration_;
+    }
+
+    auto session = std::make_shared<InboundGroupSessionDataRef>();
+    try {
+        auto txn = ro_txn(env_);
+        std::string_view value;
+        if (!inboundMegolmSessionDb_.get(txn, key, value))
+            return nullptr;
+        session->session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+
+        if (megolmSessionDataDb_.get(txn, key, value))
+            session->data = cache::parseRecord(value).get<GroupSessionData>();
+    } catch (const olm_exception &e) {
+        nhlog::db()->error("Failed to unpickle inbound megolm session {}", e.what());
+        return nullptr;
+    } catch (const json::exception &e) {
+        nhlog::db()->error("Failed to parse megolm session data {}", e.what());
+        return nullptr;
+    }
+
+    std::lock_guard lock(inboundSessionsMtx_);
+    // The session was replaced while loading it.
+    if (generation != inboundSessionsGeneration_)
+        return session;
+
+    if (auto [it, inserted] = inboundSessions_.try_emplace(key, session); !inserted)
+        return it->second;
+
+    inboundSessionOrder_.push_back(key);
+    while (inboundSessionOrder_.size() > MAX_CACHED_INBOUND_SESSIONS) {
+        inboundSessions_.erase(inboundSessionOrder_.front());
+        inboundSessionOrder_.pop_front();
+    }
+    return session;
+}
+
+void
+Cache::inboundMegolmSessionChanged(const MegolmSessionIndex &index,
+                                   std::shared_ptr<InboundGroupSessionDataRef> session)
+{
+    bool firstChange;
+    {
+        std::lock_guard lock(inboundSessionsMtx_);
+        firstChange = changedInboundSessions_.empty();
+        changedInboundSessions_.insert_or_assign(megolmSessionKey(index), std::move(session));
+    }
+
+    // A sync or a page of messages is decrypted in one go, save after it.
+    if (firstChange)
+        QMetaObject::invokeMethod(
+          this, [this]() { saveChangedMegolmSessionData(); }, Qt::QueuedConnection);
+}
+
+void
+Cache::saveChangedMegolmSessionData()
+{
+    std::map<std::string, std::shared_ptr<InboundGroupSessionDataRef>> changed;
+    {
+        std::lock_guard lock(inboundSessionsMtx_);
+        std::swap(changed, changedInboundSessions_);
+    }
+
+    if (changed.empty())
+        return;
+
+    try {
+        auto txn = GuardedTxn(env_);
+        for (const auto &[key, session] : changed) {
+            // Only add the indices, the rest of the data may have been updated in the mean time.
+            GroupSessionData data;
+            std::string_view value;
+            if (megolmSessionDataDb_.get(txn, key, value))
+                data = cache::parseRecord(value).get<GroupSessionData>();
+
+            {
+                std::lock_guard lock(session->mtx);
+                data.indices.insert(session->data.indices.begin(), session->data.indices.end());
+            }
+
+            megolmSessionDataDb_.put(txn, key, cache::dumpRecord(json(data)));
+        }
+        txn.commit();
+    } catch (const std::exception &e) {
+        nhlog::db()->error("Failed to save megolm session data {}", e.what());
+    }
+}
+
+void
+Cache::forgetInboundMegolmSession(const std::string &key)
+{
+    std::lock_guard lock(inboundSessionsMtx_);
+    inboundSessionsGeneration_++;
+    inboundSessions_.erase(key);
+}
+
 std::optional<GroupSessionData>
 Cache::getMegolmSessionData(const MegolmSessionIndex &index)
 {
@@ -775,8 +1298,8 @@ Cache::getMegolmSessionData(const MegolmSessionIndex &index)
         auto txn = ro_txn(env_);
 
         std::string_view value;
-        if (megolmSessionDataDb_.get(txn, json(index).dump(), value)) {
-            return nlohmann::json::parse(value).get<GroupSessionData>();
+        if (megolmSessionDataDb_.get(txn, megolmSessionKey(index), value)) {
+            return cache::parseRecord(value).get<GroupSessionData>();
         }
 
         return std::nullopt;
@@ -796,7 +1319,7 @@ Cache::saveOlmSession(const std::string &curve25519,
 {
     using namespace mtx::crypto;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getOlmSessionsDb(txn, curve25519);
 
     const auto pickled    = pickle<SessionObject>(session.get(), pickle_secret_);
@@ -816,7 +1339,7 @@ Cache::getOlmSession(const std::string &curve25519, const std::string &session_i
 {
     using namespace mtx::crypto;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getOlmSessionsDb(txn, curve25519);
 
     std::string_view pickled;
@@ -837,7 +1360,7 @@ Cache::getLatestOlmSession(const std::string &curve25519)
 {
     using namespace mtx::crypto;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getOlmSessionsDb(txn, curve25519);
 
     std::string_view session_id, pickled_session;
@@ -864,7 +1387,7 @@ Cache::getOlmSessions(const std::string &curve25519)
 {
     using namespace mtx::crypto;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getOlmSessionsDb(txn, curve25519);
 
     std::string_view session_id, unused;
@@ -883,7 +1406,7 @@ Cache::getOlmSessions(const std::string &curve25519)
 void
 Cache::saveOlmAccount(const std::string &data)
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     syncStateDb_.put(txn, OLM_ACCOUNT_KEY, data);
     txn.commit();
 }
@@ -902,7 +1425,7 @@ Cache::restoreOlmAccount()
 void
 Cache::saveBackupVersion(const OnlineBackupVersion &data)
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     syncStateDb_.put(txn, CURRENT_ONLINE_BACKUP_VERSION, nlohmann::json(data).dump());
     txn.commit();
 }
@@ -910,7 +1433,7 @@ Cache::saveBackupVersion(const OnlineBackupVersion &data)
 void
 Cache::deleteBackupVersion()
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     syncStateDb_.del(txn, CURRENT_ONLINE_BACKUP_VERSION);
     txn.commit();
 }
@@ -940,26 +1463,177 @@ Cache::removeInvite(lmdb::txn &txn, const std::string &room_id)
 void
 Cache::removeInvite(const std::string &room_id)
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     removeInvite(txn, room_id);
     txn.commit();
+    writeGeneration_++;
 }
 
 void
 Cache::removeRoom(lmdb::txn &txn, const std::string &roomid)
 {
     roomsDb_.del(txn, roomid);
-    getStatesDb(txn, roomid).drop(txn, true);
-    getAccountDataDb(txn, roomid).drop(txn, true);
-    getMembersDb(txn, roomid).drop(txn, true);
+    lastMessagesDb_.del(txn, roomid);
+    retentionPoliciesDb_.del(txn, roomid);
+    deleteDecryptedEvents(txn, roomid);
+    deleteReadReceipts(txn, roomid);
+    forgetPruneMark(roomid);
+    stageMemberUpdate(txn, roomid, "", std::nullopt);
+
+    // The handles are opened before they are forgotten, so that none is staged again and
+    // published after it was closed by the drop. LMDB reuses the slots of closed handles.
+    auto statesDb      = getStatesDb(txn, roomid);
+    auto accountDataDb = getAccountDataDb(txn, roomid);
+    auto membersDb     = getMembersDb(txn, roomid);
+    forgetRoomDbs(roomid);
+    statesDb.drop(txn, true);
+    accountDataDb.drop(txn, true);
+    membersDb.drop(txn, true);
 }
 
 void
 Cache::removeRoom(const std::string &roomid)
 {
-    auto txn = lmdb::txn::begin(env_, nullptr, 0);
+    auto txn = GuardedTxn(env_);
     roomsDb_.del(txn, roomid);
+    lastMessagesDb_.del(txn, roomid);
+    retentionPoliciesDb_.del(txn, roomid);
+    deleteDecryptedEvents(txn, roomid);
+    deleteReadReceipts(txn, roomid);
+    txn.commit();
+    forgetPruneMark(roomid);
+    writeGeneration_++;
+}
+
+lmdb::dbi
+Cache::getRoomDb(lmdb::txn &txn, const std::string &room_id, RoomDb kind)
+{
+    const auto idx = static_cast<std::size_t>(kind);
+
+    {
+        std::shared_lock lock(roomDbsMtx_);
+        if (auto it = roomDbs_.find(room_id); it != roomDbs_.end() && it->second[idx] != 0)
+            return lmdb::dbi(it->second[idx]);
+    }
+
+    // mdb_dbi_open must not be called concurrently.
+    std::unique_lock lock(roomDbsMtx_);
+
+    const auto &spec = ROOM_DB_SPECS[idx];
+    auto db          = lmdb::dbi::open(txn, (room_id + spec.suffix).c_str(), spec.flags);
+    if (kind == RoomDb::StatesKey)
+        lmdb::dbi_set_dupsort(txn, db, compare_state_key);
+
+    if (stagedRoomDbs.txn == txn.handle())
+        stagedRoomDbs.handles.emplace_back(room_id, idx, db.handle());
+
+    return db;
+}
+
+void
+Cache::forgetRoomDbs(const std::string &room_id, std::optional<RoomDb> kind)
+{
+    std::unique_lock lock(roomDbsMtx_);
+
+    if (auto it = roomDbs_.find(room_id); it != roomDbs_.end()) {
+        if (kind)
+            it->second[static_cast<std::size_t>(*kind)] = 0;
+        else
+            roomDbs_.erase(it);
+    }
+
+    // Handles staged by other threads may already be closed now, so they are not published.
+    // The write transaction of this thread is the only one running, so its own staged handles
+    // stay valid, once the forgotten ones are removed.
+    auto &staged = stagedRoomDbs.handles;
+    staged.erase(std::remove_if(staged.begin(),
+                                staged.end(),
+                                [&room_id, &kind](const auto &handle) {
+                                    return std::get<0>(handle) == room_id &&
+                                           (!kind || std::get<1>(handle) ==
+                                                       static_cast<std::size_t>(*kind));
+                                }),
+                 staged.end());
+
+    const bool stagedIsCurrent = stagedRoomDbs.epoch == roomDbsEpoch_;
+    roomDbsEpoch_++;
+    if (stagedIsCurrent)
+        stagedRoomDbs.epoch = roomDbsEpoch_;
+}
+
+void
+Cache::forgetAllRoomDbs()
+{
+    std::unique_lock lock(roomDbsMtx_);
+    roomDbs_.clear();
+    roomDbsEpoch_++;
+
+    stagedRoomDbs.txn = nullptr;
+    stagedRoomDbs.handles.clear();
+}
+
+GuardedTxn
+Cache::beginWriteTxn()
+{
+    growMap(false);
+
+    auto txn = GuardedTxn(env_);
+
+    std::shared_lock lock(roomDbsMtx_);
+    stagedRoomDbs.txn   = txn.handle();
+    stagedRoomDbs.epoch = roomDbsEpoch_;
+    stagedRoomDbs.handles.clear();
+
+    stagedMembers.txn = txn.handle();
+    stagedMembers.updates.clear();
+
+    return txn;
+}
+
+void
+Cache::commitWriteTxn(lmdb::txn &txn)
+{
+    MDB_txn *handle = txn.handle();
     txn.commit();
+    writeGeneration_++;
+
+    if (stagedMembers.txn == handle)
+        publishMemberUpdates();
+
+    if (stagedRoomDbs.txn != handle)
+        return;
+
+    {
+        std::unique_lock lock(roomDbsMtx_);
+        // Skip publishing, if databases were dropped in the mean time.
+        if (stagedRoomDbs.epoch == roomDbsEpoch_)
+            for (const auto &[room_id, idx, dbi] : stagedRoomDbs.handles)
+                roomDbs_[room_id][idx] = dbi;
+    }
+
+    stagedRoomDbs.txn = nullptr;
+    stagedRoomDbs.handles.clear();
+}
+
+void
+Cache::openRoomDbs(lmdb::txn &txn, const std::string &room_id)
+{
+    for (std::size_t idx = 0; idx < ROOM_DB_SPECS.size(); idx++)
+        getRoomDb(txn, room_id, static_cast<RoomDb>(idx));
+}
+
+void
+Cache::preloadRoomDbs()
+{
+    auto txn = beginWriteTxn();
+
+    std::string_view room_id, unused;
+    auto roomsCursor = lmdb::cursor::open(txn, roomsDb_);
+    while (roomsCursor.get(room_id, unused, MDB_NEXT))
+        openRoomDbs(txn, std::string(room_id));
+    roomsCursor.close();
+
+    commitWriteTxn(txn);
 }
 
 void
@@ -1004,12 +1678,39 @@ Cache::deleteData()
 {
     if (this->databaseReady_) {
         this->databaseReady_ = false;
+
+        // Let the writes already queued finish, before the environment goes away.
+        if (QThread::currentThread() != &writerThread_)
+            QMetaObject::invokeMethod(
+              writer_, []() {}, Qt::BlockingQueuedConnection);
+
+        forgetAllRoomDbs();
+        forgetAllMemberDirectories();
+        writeGeneration_++;
+
+        saveChangedMegolmSessionData();
+        {
+            std::lock_guard lock(pruneMtx_);
+            pruneMarks_.clear();
+            pruneCursor_.clear();
+        }
+        {
+            std::lock_guard lock(inboundSessionsMtx_);
+            inboundSessionsGeneration_++;
+            inboundSessions_.clear();
+            inboundSessionOrder_.clear();
+        }
+
         // TODO: We need to remove the env_ while not accepting new requests.
         lmdb::dbi_close(env_, syncStateDb_);
         lmdb::dbi_close(env_, roomsDb_);
         lmdb::dbi_close(env_, invitesDb_);
         lmdb::dbi_close(env_, readReceiptsDb_);
+        lmdb::dbi_close(env_, receiptsByEventDb_);
         lmdb::dbi_close(env_, notificationsDb_);
+        lmdb::dbi_close(env_, lastMessagesDb_);
+        lmdb::dbi_close(env_, decryptedEventsDb_);
+        lmdb::dbi_close(env_, retentionPoliciesDb_);
 
         lmdb::dbi_close(env_, devicesDb_);
         lmdb::dbi_close(env_, deviceKeysDb_);
@@ -1035,20 +1736,236 @@ Cache::deleteData()
     }
 }
 
-//! migrates db to the current format
+MDB_stat
+Cache::environmentStat()
+{
+    MDB_stat stat{};
+    if (const int rc = mdb_env_stat(env_.handle(), &stat))
+        lmdb::error::raise("mdb_env_stat", rc);
+    return stat;
+}
+
+MDB_envinfo
+Cache::environmentInfo()
+{
+    MDB_envinfo info{};
+    if (const int rc = mdb_env_info(env_.handle(), &info))
+        lmdb::error::raise("mdb_env_info", rc);
+    return info;
+}
+
 bool
-Cache::runMigrations()
+Cache::growMap(bool force, QDeadlineTimer wait)
 {
-    std::string stored_version;
-    {
-        auto txn = ro_txn(env_);
+    if (!env_.handle())
+        return false;
 
-        std::string_view current_version;
-        bool res = syncStateDb_.get(txn, CACHE_FORMAT_VERSION_KEY, current_version);
+    const auto info = environmentInfo();
+    const auto used = static_cast<uint64_t>(info.me_last_pgno + 1) * environmentStat().ms_psize;
+    if (!force && used * 5 < static_cast<uint64_t>(info.me_mapsize) * 4)
+        return false;
 
-        if (!res)
+    const auto mapsize =
+      static_cast<uint64_t>(info.me_mapsize) + std::max<uint64_t>(info.me_mapsize / 2, MAP_GROWTH);
+    // Read transactions are short, so they usually end soon, if we are asked to wait.
+    while (!TransactionGuard::tryExclusive([this, mapsize]() { env_.set_mapsize(mapsize); })) {
+        if (wait.hasExpired()) {
+            nhlog::db()->debug("not growing the map, while transactions are running");
             return false;
-
+        }
+        QThread::msleep(5);
+    }
+
+    nhlog::db()->info("grew the map from {} to {} bytes, {} bytes are used",
+                      info.me_mapsize,
+                      mapsize,
+                      used);
+    return true;
+}
+
+namespace {
+//! Reads the statistics of every database of env, see Cache::statistics(). Handles are opened
+//! under handleMtx, if the environment is shared with a Cache.
+CacheStatistics
+collectStatistics(lmdb::env &env, std::size_t heaviestRooms, std::shared_mutex *handleMtx)
+{
+    CacheStatistics stats;
+
+    MDB_stat envStat{};
+    MDB_envinfo info{};
+    if (const int rc = mdb_env_stat(env.handle(), &envStat))
+        lmdb::error::raise("mdb_env_stat", rc);
+    if (const int rc = mdb_env_info(env.handle(), &info))
+        lmdb::error::raise("mdb_env_info", rc);
+    stats.pageSize = envStat.ms_psize;
+    stats.mapSize  = info.me_mapsize;
+    stats.fileSize = static_cast<uint64_t>(info.me_last_pgno + 1) * stats.pageSize;
+
+    // The names of all databases are the keys of the main database.
+    std::vector<std::string> names;
+    {
+        auto txn       = GuardedTxn(env, MDB_RDONLY);
+        stats.freeSize = freePages(txn) * stats.pageSize;
+
+        auto cursor = lmdb::cursor::open(txn, lmdb::dbi::open(txn, nullptr));
+        std::string_view name, value;
+        while (cursor.get(name, value, MDB_NEXT))
+            if (name.find('\0') == std::string_view::npos)
+                names.emplace_back(name);
+    }
+
+    std::map<std::string, RoomStatistics> rooms;
+
+    // Handles opened in a read only transaction are closed again, when it ends. There is only
+    // room for MAX_DBS of them, so the databases are read in batches. Opening a handle must
+    // not happen concurrently, which is why getRoomDb() is blocked meanwhile.
+    constexpr std::size_t batchSize = 1024;
+    for (std::size_t first = 0; first < names.size(); first += batchSize) {
+        std::unique_lock<std::shared_mutex> lock;
+        if (handleMtx)
+            lock = std::unique_lock(*handleMtx);
+        auto txn = GuardedTxn(env, MDB_RDONLY);
+
+        for (std::size_t i = first; i < std::min(first + batchSize, names.size()); i++) {
+            const auto &name = names[i];
+
+            DatabaseStatistics db;
+            try {
+                const auto stat  = lmdb::dbi::open(txn, name.c_str()).stat(txn);
+                db.databases     = 1;
+                db.entries       = stat.ms_entries;
+                db.depth         = stat.ms_depth;
+                db.branchPages   = stat.ms_branch_pages;
+                db.leafPages     = stat.ms_leaf_pages;
+                db.overflowPages = stat.ms_overflow_pages;
+                db.bytes = (db.branchPages + db.leafPages + db.overflowPages) * stats.pageSize;
+            } catch (const lmdb::error &e) {
+                nhlog::db()->warn("failed to read the statistics of {}: {}", name, e.what());
+                continue;
+            }
+            stats.databases[name] = db;
+
+            const auto [room_id, kind] = classifyDatabase(name);
+            stats.kinds[kind] += db;
+            if (room_id.empty())
+                continue;
+
+            auto &room = rooms[std::string(room_id)];
+            room.kinds[kind] += db;
+            room.total += db;
+        }
+    }
+
+    for (auto &[room_id, room] : rooms) {
+        room.room_id = room_id;
+        stats.heaviestRooms.push_back(std::move(room));
+    }
+    const auto count = std::min(heaviestRooms, stats.heaviestRooms.size());
+    std::partial_sort(stats.heaviestRooms.begin(),
+                      stats.heaviestRooms.begin() + count,
+                      stats.heaviestRooms.end(),
+                      [](const RoomStatistics &a, const RoomStatistics &b) {
+                          return a.total.bytes > b.total.bytes;
+                      });
+    stats.heaviestRooms.resize(count);
+
+    return stats;
+}
+}
+
+CacheStatistics
+Cache::statistics(std::size_t heaviestRooms)
+{
+    auto stats    = collectStatistics(env_, heaviestRooms, &roomDbsMtx_);
+    stats.pruning = pruneStatistics();
+    return stats;
+}
+
+CacheStatistics
+Cache::readStatistics(const QString &userId, std::size_t heaviestRooms)
+{
+    const auto directory = cacheDirectoryOf(userId);
+    if (!QFile::exists(directory + "/data.mdb"))
+        throw std::runtime_error("There is no cache in " + directory.toStdString());
+
+    // Opened read only, so nothing is migrated, compacted, grown or pruned.
+    auto env = lmdb::env::create();
+    env.set_max_dbs(MAX_DBS);
+    env.open(directory.toStdString().c_str(), MDB_RDONLY);
+    return collectStatistics(env, heaviestRooms, nullptr);
+}
+
+void
+Cache::compactIfFragmented()
+{
+    const auto psize     = environmentStat().ms_psize;
+    const auto fileBytes = static_cast<uint64_t>(environmentInfo().me_last_pgno + 1) * psize;
+    if (fileBytes < COMPACTION_MIN_SIZE)
+        return;
+
+    uint64_t freeBytes = 0;
+    {
+        auto txn  = GuardedTxn(env_, MDB_RDONLY);
+        freeBytes = freePages(txn) * psize;
+    }
+    if (freeBytes * 2 < fileBytes)
+        return;
+
+    nhlog::db()->info("compacting the cache, {} of {} bytes are free", freeBytes, fileBytes);
+
+    const auto compactDir = cacheDirectory_ + "/compact";
+    const auto dataFile   = cacheDirectory_ + "/data.mdb";
+    QDir(compactDir).removeRecursively();
+    if (!QDir().mkpath(compactDir)) {
+        nhlog::db()->warn("failed to create {}", compactDir.toStdString());
+        return;
+    }
+
+    if (const int rc =
+          mdb_env_copy2(env_.handle(), compactDir.toStdString().c_str(), MDB_CP_COMPACT)) {
+        nhlog::db()->warn("failed to compact the cache: {}", mdb_strerror(rc));
+        QDir(compactDir).removeRecursively();
+        return;
+    }
+
+    const auto mapsize = environmentInfo().me_mapsize;
+    env_.close();
+
+    // The old file is only deleted, once the compacted one is in place. setup() restores it, if
+    // this is interrupted in between.
+    QFile::remove(dataFile + ".old");
+    if (QFile::rename(dataFile, dataFile + ".old")) {
+        if (QFile::rename(compactDir + "/data.mdb", dataFile))
+            QFile::remove(dataFile + ".old");
+        else
+            QFile::rename(dataFile + ".old", dataFile);
+    }
+    QDir(compactDir).removeRecursively();
+
+    env_ = lmdb::env::create();
+    env_.set_mapsize(mapsize);
+    env_.set_max_dbs(MAX_DBS);
+    env_.open(cacheDirectory_.toStdString().c_str(), ENV_FLAGS);
+
+    nhlog::db()->info("compacted the cache from {} to {} bytes",
+                      fileBytes,
+                      static_cast<uint64_t>(environmentInfo().me_last_pgno + 1) * psize);
+}
+
+//! migrates db to the current format
+bool
+Cache::runMigrations()
+{
+    std::string stored_version;
+    {
+        auto txn = ro_txn(env_);
+
+        std::string_view current_version;
+        bool res = syncStateDb_.get(txn, CACHE_FORMAT_VERSION_KEY, current_version);
+
+        if (!res)
+            return false;
+
         stored_version = std::string(current_version);
     }
 
@@ -1056,7 +1973,7 @@ Cache::runMigrations()
       {"2020.05.01",
        [this]() {
            try {
-               auto txn              = lmdb::txn::begin(env_, nullptr);
+               auto txn              = GuardedTxn(env_);
                auto pending_receipts = lmdb::dbi::open(txn, "pending_receipts", MDB_CREATE);
                lmdb::dbi_drop(txn, pending_receipts, true);
                txn.commit();
@@ -1071,7 +1988,7 @@ Cache::runMigrations()
       {"2020.07.05",
        [this]() {
            try {
-               auto txn      = lmdb::txn::begin(env_, nullptr);
+               auto txn      = GuardedTxn(env_);
                auto room_ids = getRoomIds(txn);
 
                for (const auto &room_id : room_ids) {
@@ -1130,7 +2047,7 @@ Cache::runMigrations()
            try {
                using namespace mtx::crypto;
 
-               auto txn = lmdb::txn::begin(env_);
+               auto txn = GuardedTxn(env_);
 
                auto mainDb = lmdb::dbi::open(txn, nullptr);
 
@@ -1198,7 +2115,7 @@ Cache::runMigrations()
       {"2021.08.22",
        [this]() {
            try {
-               auto txn      = lmdb::txn::begin(env_, nullptr);
+               auto txn      = GuardedTxn(env_);
                auto try_drop = [&txn](const std::string &dbName) {
                    try {
                        auto db = lmdb::dbi::open(txn, dbName.c_str());
@@ -1243,8 +2160,200 @@ Cache::runMigrations()
            storeSecret("pickle_secret", "secret", true);
            return true;
        }},
+      {"2021.11.01",
+       [this]() {
+           try {
+               auto txn = GuardedTxn(env_);
+
+               // Rewrites the JSON values of a database in the binary record format.
+               auto convert = [&txn](lmdb::dbi &db, const auto &encode) {
+                   auto cursor = lmdb::cursor::open(txn, db);
+                   std::string_view key, value;
+                   while (cursor.get(key, value, MDB_NEXT)) {
+                       if (value.empty() || value.front() != '{')
+                           continue;
+
+                       try {
+                           auto record = encode(json::parse(value));
+                           cursor.put(std::string(key), record, MDB_CURRENT);
+                       } catch (const json::exception &e) {
+                           nhlog::db()->warn("Failed to convert record '{}': {}", key, e.what());
+                       }
+                   }
+                   cursor.close();
+               };
+               auto try_convert = [&txn, &convert](const std::string &dbName,
+                                                   const auto &encode) {
+                   try {
+                       auto db = lmdb::dbi::open(txn, dbName.c_str());
+                       convert(db, encode);
+                   } catch (const lmdb::error &e) {
+                       nhlog::db()->warn("Failed to convert '{}': {}", dbName, e.what());
+                   }
+               };
+
+               const auto toRecord = [](const json &j) { return cache::dumpRecord(j); };
+               const auto toMember = [](const json &j) {
+                   return encodeMemberInfo(j.get<MemberInfo>());
+               };
+
+               convert(roomsDb_, toRecord);
+               convert(invitesDb_, toRecord);
+               convert(readReceiptsDb_, toRecord);
+               convert(megolmSessionDataDb_, toRecord);
+
+               for (const auto &room : getRoomIds(txn)) {
+                   try_convert(room + "/state", toRecord);
+                   try_convert(room + "/members", toMember);
+               }
+
+               std::vector<std::string> invite_ids;
+               {
+                   auto cursor = lmdb::cursor::open(txn, invitesDb_);
+                   std::string_view room_id, unused;
+                   while (cursor.get(room_id, unused, MDB_NEXT))
+                       invite_ids.emplace_back(room_id);
+                   cursor.close();
+               }
+               for (const auto &room : invite_ids) {
+                   try_convert(room + "/invite_state", toRecord);
+                   try_convert(room + "/invite_members", toMember);
+               }
+
+               // Events and the event order are converted, when they are written the next time.
+               txn.commit();
+           } catch (const lmdb::error &) {
+               nhlog::db()->critical("Failed to convert the cache to the binary record format!");
+               return false;
+           }
+
+           nhlog::db()->info("Successfully converted the cache to the binary record format.");
+           return true;
+       }},
+      {"2021.11.02",
+       [this]() {
+           try {
+               auto txn = GuardedTxn(env_);
+
+               // Replaces the JSON keys of a database with binary ones.
+               auto rekey = [&txn](lmdb::dbi &db, const auto &encode) {
+                   std::vector<std::pair<std::string, std::string>> records;
+
+                   auto cursor = lmdb::cursor::open(txn, db);
+                   std::string_view key, value;
+                   while (cursor.get(key, value, MDB_NEXT)) {
+                       if (key.empty() || key.front() != '{')
+                           continue;
+
+                       try {
+                           records.emplace_back(encode(json::parse(key)), value);
+                           lmdb::cursor_del(cursor);
+                       } catch (const json::exception &e) {
+                           nhlog::db()->warn("Failed to convert key '{}': {}", key, e.what());
+                       }
+                   }
+                   cursor.close();
+
+                   for (const auto &[key, value] : records)
+                       db.put(txn, key, value);
+               };
+
+               rekey(readReceiptsDb_, [](const json &j) {
+                   auto key = j.get<ReadReceiptKey>();
+                   return cache::compositeKey({key.room_id, key.event_id});
+               });
+               const auto toSessionKey = [](const json &j) {
+                   return megolmSessionKey(j.get<MegolmSessionIndex>());
+               };
+               rekey(inboundMegolmSessionDb_, toSessionKey);
+               rekey(megolmSessionDataDb_, toSessionKey);
+
+               txn.commit();
+           } catch (const lmdb::error &) {
+               nhlog::db()->critical("Failed to convert the receipt and megolm session keys!");
+               return false;
+           }
+
+           nhlog::db()->info("Successfully converted the receipt and megolm session keys.");
+           return true;
+       }},
+      {"2021.11.03",
+       [this]() {
+           try {
+               auto txn = GuardedTxn(env_);
+
+               // Only the latest receipt per room and user is kept from the receipt lists of
+               // every event.
+               std::map<std::string, std::pair<std::string, uint64_t>> latest;
+               {
+                   auto cursor = lmdb::cursor::open(txn, readReceiptsDb_);
+                   std::string_view key, value;
+                   while (cursor.get(key, value, MDB_NEXT)) {
+                       auto parts = cache::splitCompositeKey(key);
+                       if (!parts || parts->size() != 2)
+                           continue;
+
+                       try {
+                           const auto &room_id  = parts->at(0);
+                           const auto &event_id = parts->at(1);
+                           const auto users =
+                             cache::parseRecord(value).get<std::map<std::string, uint64_t>>();
+                           for (const auto &[user_id, ts] : users) {
+                               auto &receipt = latest[cache::compositeKey({room_id, user_id})];
+                               if (receipt.first.empty() || ts > receipt.second)
+                                   receipt = {std::string(event_id), ts};
+                           }
+                       } catch (const json::exception &e) {
+                           nhlog::db()->warn("Failed to convert receipts '{}': {}", key, e.what());
+                       }
+                   }
+                   cursor.close();
+               }
+
+               readReceiptsDb_.drop(txn, false);
+               receiptsByEventDb_.drop(txn, false);
+               for (const auto &[key, receipt] : latest) {
+                   const auto parts = cache::splitCompositeKey(key);
+                   readReceiptsDb_.put(txn, key, encodeReceipt(receipt.first, receipt.second));
+                   receiptsByEventDb_.put(
+                     txn, cache::compositeKey({parts->at(0), receipt.first}), parts->at(1));
+               }
+
+               txn.commit();
+           } catch (const lmdb::error &) {
+               nhlog::db()->critical("Failed to convert the read receipts!");
+               return false;
+           }
+
+           nhlog::db()->info("Successfully converted the read receipts.");
+           return true;
+       }},
+      {"2021.11.04",
+       [this]() {
+           try {
+               auto txn = GuardedTxn(env_);
+
+               // Words of decrypted messages were hashed with the key of the decrypted events.
+               // They are indexed again, when the events are decrypted and stored again.
+               for (const auto &room_id : getRoomIds(txn))
+                   deleteHashedSearchPostings(txn, room_id);
+               decryptedEventsDb_.drop(txn, false);
+
+               txn.commit();
+           } catch (const lmdb::error &) {
+               nhlog::db()->critical("Failed to clear the decrypted events!");
+               return false;
+           }
+
+           nhlog::db()->info("Successfully cleared the decrypted events.");
+           return true;
+       }},
     };
 
+    // Migrations drop and recreate per room databases.
+    forgetAllRoomDbs();
+    forgetAllMemberDirectories();
+
     nhlog::db()->info("Running migrations, this may take a while!");
     for (const auto &[target_version, migration] : migrations) {
         if (target_version > stored_version)
@@ -1283,7 +2392,7 @@ Cache::formatVersion()
 void
 Cache::setCurrentFormat()
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
 
     syncStateDb_.put(txn, CACHE_FORMAT_VERSION_KEY, CURRENT_CACHE_FORMAT_VERSION);
 
@@ -1295,26 +2404,28 @@ Cache::readReceipts(const QString &event_id, const QString &room_id)
 {
     CachedReceipts receipts;
 
-    ReadReceiptKey receipt_key{event_id.toStdString(), room_id.toStdString()};
-    nlohmann::json json_key = receipt_key;
-
     try {
-        auto txn = ro_txn(env_);
-        auto key = json_key.dump();
-
-        std::string_view value;
-
-        bool res = readReceiptsDb_.get(txn, key, value);
-
-        if (res) {
-            auto json_response = json::parse(std::string_view(value.data(), value.size()));
-            auto values        = json_response.get<std::map<std::string, uint64_t>>();
+        auto txn           = ro_txn(env_);
+        const auto room    = room_id.toStdString();
+        const auto eventId = event_id.toStdString();
+
+        auto cursor        = lmdb::cursor::open(txn, receiptsByEventDb_);
+        const auto key     = cache::compositeKey({room, eventId});
+        std::string_view k = key, user_id;
+        bool first         = true;
+        if (cursor.get(k, user_id, MDB_SET)) {
+            while (cursor.get(k, user_id, first ? MDB_FIRST_DUP : MDB_NEXT_DUP)) {
+                first = false;
 
-            for (const auto &v : values)
-                // timestamp, user_id
-                receipts.emplace(v.second, v.first);
+                std::string_view value;
+                if (!readReceiptsDb_.get(txn, cache::compositeKey({room, user_id}), value))
+                    continue;
+                if (auto receipt = decodeReceipt(value))
+                    // timestamp, user_id
+                    receipts.emplace(receipt->ts, user_id);
+            }
         }
-
+        cursor.close();
     } catch (const lmdb::error &e) {
         nhlog::db()->critical("readReceipts: {}", e.what());
     }
@@ -1326,49 +2437,52 @@ void
 Cache::updateReadReceipt(lmdb::txn &txn, const std::string &room_id, const Receipts &receipts)
 {
     auto user_id = this->localUserId_.toStdString();
-    for (const auto &receipt : receipts) {
-        const auto event_id = receipt.first;
-        auto event_receipts = receipt.second;
-
-        ReadReceiptKey receipt_key{event_id, room_id};
-        nlohmann::json json_key = receipt_key;
-
-        try {
-            const auto key = json_key.dump();
-
-            std::string_view prev_value;
-
-            bool exists = readReceiptsDb_.get(txn, key, prev_value);
-
-            std::map<std::string, uint64_t> saved_receipts;
+    for (const auto &[event_id, event_receipts] : receipts) {
+        for (const auto &[read_by, timestamp] : event_receipts) {
+            if (read_by == user_id) {
+                emit removeNotification(QString::fromStdString(room_id),
+                                        QString::fromStdString(event_id));
+            }
 
-            // If an entry for the event id already exists, we would
-            // merge the existing receipts with the new ones.
-            if (exists) {
-                auto json_value =
-                  json::parse(std::string_view(prev_value.data(), prev_value.size()));
+            try {
+                const auto key = cache::compositeKey({room_id, read_by});
 
-                // Retrieve the saved receipts.
-                saved_receipts = json_value.get<std::map<std::string, uint64_t>>();
-            }
+                // Only the latest receipt of a user is kept, it implies the older ones.
+                std::string_view prev_value;
+                if (readReceiptsDb_.get(txn, key, prev_value)) {
+                    if (auto prev = decodeReceipt(prev_value)) {
+                        if (prev->event_id == event_id || prev->ts > timestamp)
+                            continue;
 
-            // Append the new ones.
-            for (const auto &[read_by, timestamp] : event_receipts) {
-                if (read_by == user_id) {
-                    emit removeNotification(QString::fromStdString(room_id),
-                                            QString::fromStdString(event_id));
+                        receiptsByEventDb_.del(
+                          txn, cache::compositeKey({room_id, prev->event_id}), read_by);
+                    }
                 }
-                saved_receipts.emplace(read_by, timestamp);
-            }
-
-            // Save back the merged (or only the new) receipts.
-            nlohmann::json json_updated_value = saved_receipts;
-            std::string merged_receipts       = json_updated_value.dump();
 
-            readReceiptsDb_.put(txn, key, merged_receipts);
+                readReceiptsDb_.put(txn, key, encodeReceipt(event_id, timestamp));
+                receiptsByEventDb_.put(txn, cache::compositeKey({room_id, event_id}), read_by);
+            } catch (const lmdb::error &e) {
+                nhlog::db()->critical("updateReadReceipts: {}", e.what());
+            }
+        }
+    }
+}
 
-        } catch (const lmdb::error &e) {
-            nhlog::db()->critical("updateReadReceipts: {}", e.what());
+void
+Cache::deleteReadReceipts(lmdb::txn &txn, const std::string &room_id)
+{
+    // Both databases are keyed by the room id first.
+    const auto prefix = cache::compositeKey({room_id});
+
+    for (auto db : {readReceiptsDb_.handle(), receiptsByEventDb_.handle()}) {
+        auto cursor          = lmdb::cursor::open(txn, db);
+        std::string_view key = prefix, value;
+        bool first           = true;
+        // After a deletion MDB_NEXT returns the entry following the deleted one.
+        while (cursor.get(key, value, first ? MDB_SET_RANGE : MDB_NEXT) &&
+               key.substr(0, prefix.size()) == prefix) {
+            first = false;
+            cursor.del();
         }
     }
 }
@@ -1428,20 +2542,16 @@ Cache::saveState(const mtx::responses::Sync &res)
 
     auto currentBatchToken = nextBatchToken();
 
-    auto txn = lmdb::txn::begin(env_);
+    std::vector<const mtx::responses::JoinedRoom *> joined;
+    for (const auto &room : res.rooms.join)
+        joined.push_back(&room.second);
+    auto prepared = prepareJoinedRooms(std::move(joined));
+
+    auto txn = beginWriteTxn();
 
     setNextBatchToken(txn, res.next_batch);
 
-    if (!res.account_data.events.empty()) {
-        auto accountDataDb = getAccountDataDb(txn, "");
-        for (const auto &ev : res.account_data.events)
-            std::visit(
-              [&txn, &accountDataDb](const auto &event) {
-                  auto j = json(event);
-                  accountDataDb.put(txn, j["type"].get<std::string>(), j.dump());
-              },
-              ev);
-    }
+    saveGlobalAccountData(txn, res);
 
     auto userKeyCacheDb = getUserKeysDb(txn);
 
@@ -1449,124 +2559,14 @@ Cache::saveState(const mtx::responses::Sync &res)
     std::set<std::string> rooms_with_space_updates;
 
     // Save joined rooms
-    for (const auto &room : res.rooms.join) {
-        auto statesdb    = getStatesDb(txn, room.first);
-        auto stateskeydb = getStatesKeyDb(txn, room.first);
-        auto membersdb   = getMembersDb(txn, room.first);
-        auto eventsDb    = getEventsDb(txn, room.first);
-
-        saveStateEvents(
-          txn, statesdb, stateskeydb, membersdb, eventsDb, room.first, room.second.state.events);
-        saveStateEvents(
-          txn, statesdb, stateskeydb, membersdb, eventsDb, room.first, room.second.timeline.events);
-
-        saveTimelineMessages(txn, eventsDb, room.first, room.second.timeline);
-
-        RoomInfo updatedInfo;
-        updatedInfo.name       = getRoomName(txn, statesdb, membersdb).toStdString();
-        updatedInfo.topic      = getRoomTopic(txn, statesdb).toStdString();
-        updatedInfo.avatar_url = getRoomAvatarUrl(txn, statesdb, membersdb).toStdString();
-        updatedInfo.version    = getRoomVersion(txn, statesdb).toStdString();
-        updatedInfo.is_space   = getRoomIsSpace(txn, statesdb);
-
-        if (updatedInfo.is_space) {
-            bool space_updates = false;
-            for (const auto &e : room.second.state.events)
-                if (std::holds_alternative<StateEvent<state::space::Child>>(e) ||
-                    std::holds_alternative<StateEvent<state::PowerLevels>>(e))
-                    space_updates = true;
-            for (const auto &e : room.second.timeline.events)
-                if (std::holds_alternative<StateEvent<state::space::Child>>(e) ||
-                    std::holds_alternative<StateEvent<state::PowerLevels>>(e))
-                    space_updates = true;
-
-            if (space_updates)
-                spaces_with_updates.insert(room.first);
-        }
-
-        {
-            bool room_has_space_update = false;
-            for (const auto &e : room.second.state.events) {
-                if (auto se = std::get_if<StateEvent<state::space::Parent>>(&e)) {
-                    spaces_with_updates.insert(se->state_key);
-                    room_has_space_update = true;
-                }
-            }
-            for (const auto &e : room.second.timeline.events) {
-                if (auto se = std::get_if<StateEvent<state::space::Parent>>(&e)) {
-                    spaces_with_updates.insert(se->state_key);
-                    room_has_space_update = true;
-                }
-            }
-
-            if (room_has_space_update)
-                rooms_with_space_updates.insert(room.first);
-        }
-
-        bool has_new_tags = false;
-        // Process the account_data associated with this room
-        if (!room.second.account_data.events.empty()) {
-            auto accountDataDb = getAccountDataDb(txn, room.first);
-
-            for (const auto &evt : room.second.account_data.events) {
-                std::visit(
-                  [&txn, &accountDataDb](const auto &event) {
-                      auto j = json(event);
-                      accountDataDb.put(txn, j["type"].get<std::string>(), j.dump());
-                  },
-                  evt);
-
-                // for tag events
-                if (std::holds_alternative<AccountDataEvent<account_data::Tags>>(evt)) {
-                    auto tags_evt = std::get<AccountDataEvent<account_data::Tags>>(evt);
-                    has_new_tags  = true;
-                    for (const auto &tag : tags_evt.content.tags) {
-                        updatedInfo.tags.push_back(tag.first);
-                    }
-                }
-                if (auto fr = std::get_if<
-                      mtx::events::AccountDataEvent<mtx::events::account_data::FullyRead>>(&evt)) {
-                    nhlog::db()->debug("Fully read: {}", fr->content.event_id);
-                    emit removeNotification(QString::fromStdString(room.first),
-                                            QString::fromStdString(fr->content.event_id));
-                }
-            }
-        }
-        if (!has_new_tags) {
-            // retrieve the old tags, they haven't changed
-            std::string_view data;
-            if (roomsDb_.get(txn, room.first, data)) {
-                try {
-                    RoomInfo tmp     = json::parse(std::string_view(data.data(), data.size()));
-                    updatedInfo.tags = tmp.tags;
-                } catch (const json::exception &e) {
-                    nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                      room.first,
-                                      std::string(data.data(), data.size()),
-                                      e.what());
-                }
-            }
-        }
-
-        roomsDb_.put(txn, room.first, json(updatedInfo).dump());
-
-        for (const auto &e : room.second.ephemeral.events) {
-            if (auto receiptsEv =
-                  std::get_if<mtx::events::EphemeralEvent<mtx::events::ephemeral::Receipt>>(&e)) {
-                Receipts receipts;
-
-                for (const auto &[event_id, userReceipts] : receiptsEv->content.receipts) {
-                    for (const auto &[user_id, receipt] : userReceipts.users) {
-                        receipts[event_id][user_id] = receipt.ts;
-                    }
-                }
-                updateReadReceipt(txn, room.first, receipts);
-            }
-        }
-
-        // Clean up non-valid invites.
-        removeInvite(txn, room.first);
-    }
+    std::size_t i = 0;
+    for (const auto &room : res.rooms.join)
+        saveJoinedRoom(txn,
+                       room.first,
+                       room.second,
+                       spaces_with_updates,
+                       rooms_with_space_updates,
+                       &prepared[i++]);
 
     saveInvites(txn, res.rooms.invite);
 
@@ -1578,7 +2578,7 @@ Cache::saveState(const mtx::responses::Sync &res)
 
     updateSpaces(txn, spaces_with_updates, std::move(rooms_with_space_updates));
 
-    txn.commit();
+    commitWriteTxn(txn);
 
     std::map<QString, bool> readStatus;
 
@@ -1609,26 +2609,273 @@ Cache::saveState(const mtx::responses::Sync &res)
 }
 
 void
-Cache::saveInvites(lmdb::txn &txn, const std::map<std::string, mtx::responses::InvitedRoom> &rooms)
+Cache::saveInitialState(const mtx::responses::Sync &res)
 {
-    for (const auto &room : rooms) {
-        auto statesdb  = getInviteStatesDb(txn, room.first);
-        auto membersdb = getInviteMembersDb(txn, room.first);
+    auto currentBatchToken = nextBatchToken();
 
-        saveInvite(txn, statesdb, membersdb, room.second);
+    // Global account data decides, which events are hidden, so it has to be stored first.
+    {
+        auto txn = beginWriteTxn();
+        saveGlobalAccountData(txn, res);
+        commitWriteTxn(txn);
+    }
 
-        RoomInfo updatedInfo;
-        updatedInfo.name       = getInviteRoomName(txn, statesdb, membersdb).toStdString();
-        updatedInfo.topic      = getInviteRoomTopic(txn, statesdb).toStdString();
-        updatedInfo.avatar_url = getInviteRoomAvatarUrl(txn, statesdb, membersdb).toStdString();
-        updatedInfo.is_space   = getInviteRoomIsSpace(txn, statesdb);
-        updatedInfo.is_invite  = true;
+    std::set<std::string> spaces_with_updates;
+    std::set<std::string> rooms_with_space_updates;
 
-        invitesDb_.put(txn, room.first, json(updatedInfo).dump());
-    }
-}
+    // LMDB keeps all dirty pages of a write transaction in memory until it commits, so the
+    // joined rooms are committed in batches to not scale the memory usage with the account.
+    auto room = res.rooms.join.begin();
+    while (room != res.rooms.join.end()) {
+        auto batchEnd = room;
+        std::vector<const mtx::responses::JoinedRoom *> joined;
+        for (; joined.size() < INITIAL_SYNC_BATCH_SIZE && batchEnd != res.rooms.join.end();
+             ++batchEnd)
+            joined.push_back(&batchEnd->second);
+        auto prepared = prepareJoinedRooms(std::move(joined));
+
+        auto txn = beginWriteTxn();
+        for (std::size_t i = 0; room != batchEnd; ++i, ++room)
+            saveJoinedRoom(txn,
+                           room->first,
+                           room->second,
+                           spaces_with_updates,
+                           rooms_with_space_updates,
+                           &prepared[i]);
+        commitWriteTxn(txn);
+    }
+
+    // The sync token is stored last, an interrupted initial sync is then started over.
+    auto txn            = beginWriteTxn();
+    auto userKeyCacheDb = getUserKeysDb(txn);
 
-void
+    setNextBatchToken(txn, res.next_batch);
+    saveInvites(txn, res.rooms.invite);
+    savePresence(txn, res.presence);
+    markUserKeysOutOfDate(txn, userKeyCacheDb, res.device_lists.changed, currentBatchToken);
+    removeLeftRooms(txn, res.rooms.leave);
+    updateSpaces(txn, spaces_with_updates, std::move(rooms_with_space_updates));
+
+    commitWriteTxn(txn);
+}
+
+void
+Cache::saveGlobalAccountData(lmdb::txn &txn, const mtx::responses::Sync &res)
+{
+    if (res.account_data.events.empty())
+        return;
+
+    auto accountDataDb = getAccountDataDb(txn, "");
+    for (const auto &ev : res.account_data.events)
+        std::visit(
+          [&txn, &accountDataDb](const auto &event) {
+              auto j = json(event);
+              accountDataDb.put(txn, j["type"].get<std::string>(), j.dump());
+          },
+          ev);
+}
+
+std::vector<Cache::PreparedRoom>
+Cache::prepareJoinedRooms(std::vector<const mtx::responses::JoinedRoom *> rooms)
+{
+    std::vector<PreparedRoom> prepared(rooms.size());
+    for (std::size_t i = 0; i < rooms.size(); i++)
+        prepared[i].room = rooms[i];
+
+    // Most syncs only touch a room or two, which isn't worth waking up the thread pool.
+    if (prepared.size() > 1)
+        QtConcurrent::blockingMap(prepared, &Cache::prepareJoinedRoom);
+    else
+        std::for_each(prepared.begin(), prepared.end(), &Cache::prepareJoinedRoom);
+
+    return prepared;
+}
+
+void
+Cache::prepareJoinedRoom(PreparedRoom &prepared)
+{
+    using namespace mtx::events;
+
+    const auto &room = *prepared.room;
+
+    prepared.state.reserve(room.state.events.size());
+    for (const auto &e : room.state.events) {
+        // Only stored in the members database or as a flag, see saveStateEvent().
+        if (std::holds_alternative<StateEvent<state::Member>>(e) ||
+            std::holds_alternative<StateEvent<state::Encryption>>(e))
+            prepared.state.emplace_back();
+        else
+            prepared.state.push_back(
+              std::visit([](const auto &ev) { return cache::dumpRecord(json(ev)); }, e));
+    }
+
+    prepared.timeline.reserve(room.timeline.events.size());
+    for (const auto &e : room.timeline.events)
+        prepared.timeline.push_back(cache::dumpRecord(mtx::accessors::serialize_event(e)));
+}
+
+void
+Cache::saveJoinedRoom(lmdb::txn &txn,
+                      const std::string &room_id,
+                      const mtx::responses::JoinedRoom &room,
+                      std::set<std::string> &spaces_with_updates,
+                      std::set<std::string> &rooms_with_space_updates,
+                      const PreparedRoom *prepared)
+{
+    using namespace mtx::events;
+
+    // Published on commit, so that readers of a new room don't need to open them.
+    openRoomDbs(txn, room_id);
+
+    auto statesdb    = getStatesDb(txn, room_id);
+    auto stateskeydb = getStatesKeyDb(txn, room_id);
+    auto membersdb   = getMembersDb(txn, room_id);
+    auto eventsDb    = getEventsDb(txn, room_id);
+
+    saveStateEvents(txn,
+                    statesdb,
+                    stateskeydb,
+                    membersdb,
+                    eventsDb,
+                    room_id,
+                    room.state.events,
+                    prepared ? &prepared->state : nullptr);
+    saveStateEvents(txn,
+                    statesdb,
+                    stateskeydb,
+                    membersdb,
+                    eventsDb,
+                    room_id,
+                    room.timeline.events,
+                    prepared ? &prepared->timeline : nullptr);
+
+    saveTimelineMessages(
+      txn, eventsDb, room_id, room.timeline, prepared ? &prepared->timeline : nullptr);
+
+    RoomInfo updatedInfo;
+    updatedInfo.name       = getRoomName(txn, statesdb, membersdb).toStdString();
+    updatedInfo.topic      = getRoomTopic(txn, statesdb).toStdString();
+    updatedInfo.avatar_url = getRoomAvatarUrl(txn, statesdb, membersdb).toStdString();
+    updatedInfo.version    = getRoomVersion(txn, statesdb).toStdString();
+    updatedInfo.is_space   = getRoomIsSpace(txn, statesdb);
+
+    if (updatedInfo.is_space) {
+        bool space_updates = false;
+        for (const auto &e : room.state.events)
+            if (std::holds_alternative<StateEvent<state::space::Child>>(e) ||
+                std::holds_alternative<StateEvent<state::PowerLevels>>(e))
+                space_updates = true;
+        for (const auto &e : room.timeline.events)
+            if (std::holds_alternative<StateEvent<state::space::Child>>(e) ||
+                std::holds_alternative<StateEvent<state::PowerLevels>>(e))
+                space_updates = true;
+
+        if (space_updates)
+            spaces_with_updates.insert(room_id);
+    }
+
+    {
+        bool room_has_space_update = false;
+        for (const auto &e : room.state.events) {
+            if (auto se = std::get_if<StateEvent<state::space::Parent>>(&e)) {
+                spaces_with_updates.insert(se->state_key);
+                room_has_space_update = true;
+            }
+        }
+        for (const auto &e : room.timeline.events) {
+            if (auto se = std::get_if<StateEvent<state::space::Parent>>(&e)) {
+                spaces_with_updates.insert(se->state_key);
+                room_has_space_update = true;
+            }
+        }
+
+        if (room_has_space_update)
+            rooms_with_space_updates.insert(room_id);
+    }
+
+    bool has_new_tags = false;
+    // Process the account_data associated with this room
+    if (!room.account_data.events.empty()) {
+        auto accountDataDb = getAccountDataDb(txn, room_id);
+
+        for (const auto &evt : room.account_data.events) {
+            std::visit(
+              [&txn, &accountDataDb](const auto &event) {
+                  auto j = json(event);
+                  accountDataDb.put(txn, j["type"].get<std::string>(), j.dump());
+              },
+              evt);
+
+            // for tag events
+            if (std::holds_alternative<AccountDataEvent<account_data::Tags>>(evt)) {
+                auto tags_evt = std::get<AccountDataEvent<account_data::Tags>>(evt);
+                has_new_tags  = true;
+                for (const auto &tag : tags_evt.content.tags) {
+                    updatedInfo.tags.push_back(tag.first);
+                }
+            }
+            if (auto fr = std::get_if<
+                  mtx::events::AccountDataEvent<mtx::events::account_data::FullyRead>>(&evt)) {
+                nhlog::db()->debug("Fully read: {}", fr->content.event_id);
+                emit removeNotification(QString::fromStdString(room_id),
+                                        QString::fromStdString(fr->content.event_id));
+            }
+        }
+    }
+    if (!has_new_tags) {
+        // retrieve the old tags, they haven't changed
+        std::string_view data;
+        if (roomsDb_.get(txn, room_id, data)) {
+            try {
+                RoomInfo tmp     = cache::parseRecord(data);
+                updatedInfo.tags = tmp.tags;
+            } catch (const json::exception &e) {
+                nhlog::db()->warn("failed to parse room info: room_id ({}): {}", room_id, e.what());
+            }
+        }
+    }
+
+    roomsDb_.put(txn, room_id, cache::dumpRecord(updatedInfo));
+
+    for (const auto &e : room.ephemeral.events) {
+        if (auto receiptsEv =
+              std::get_if<mtx::events::EphemeralEvent<mtx::events::ephemeral::Receipt>>(&e)) {
+            Receipts receipts;
+
+            for (const auto &[event_id, userReceipts] : receiptsEv->content.receipts) {
+                for (const auto &[user_id, receipt] : userReceipts.users) {
+                    receipts[event_id][user_id] = receipt.ts;
+                }
+            }
+            updateReadReceipt(txn, room_id, receipts);
+        }
+    }
+
+    // Clean up non-valid invites.
+    removeInvite(txn, room_id);
+}
+
+void
+Cache::saveInvites(lmdb::txn &txn, const std::map<std::string, mtx::responses::InvitedRoom> &rooms)
+{
+    for (const auto &room : rooms) {
+        auto statesdb  = getInviteStatesDb(txn, room.first);
+        auto membersdb = getInviteMembersDb(txn, room.first);
+
+        saveInvite(txn, statesdb, membersdb, room.second);
+
+        RoomInfo updatedInfo;
+        updatedInfo.name       = getInviteRoomName(txn, statesdb, membersdb).toStdString();
+        updatedInfo.topic      = getInviteRoomTopic(txn, statesdb).toStdString();
+        updatedInfo.avatar_url = getInviteRoomAvatarUrl(txn, statesdb, membersdb).toStdString();
+        updatedInfo.is_space   = getInviteRoomIsSpace(txn, statesdb);
+        updatedInfo.is_invite  = true;
+
+        invitesDb_.put(txn, room.first, cache::dumpRecord(updatedInfo));
+    }
+}
+
+void
 Cache::saveInvite(lmdb::txn &txn,
                   lmdb::dbi &statesdb,
                   lmdb::dbi &membersdb,
@@ -1644,12 +2891,12 @@ Cache::saveInvite(lmdb::txn &txn,
 
             MemberInfo tmp{display_name, msg->content.avatar_url, msg->content.is_direct};
 
-            membersdb.put(txn, msg->state_key, json(tmp).dump());
+            membersdb.put(txn, msg->state_key, encodeMemberInfo(tmp));
         } else {
             std::visit(
               [&txn, &statesdb](auto msg) {
                   auto j   = json(msg);
-                  bool res = statesdb.put(txn, j["type"].get<std::string>(), j.dump());
+                  bool res = statesdb.put(txn, j["type"].get<std::string>(), cache::dumpRecord(j));
 
                   if (!res)
                       nhlog::db()->warn("couldn't save data: {}", json(msg).dump());
@@ -1720,17 +2967,14 @@ Cache::singleRoomInfo(const std::string &room_id)
         // Check if the room is joined.
         if (roomsDb_.get(txn, room_id, data)) {
             try {
-                RoomInfo tmp     = json::parse(data);
+                RoomInfo tmp     = cache::parseRecord(data);
                 tmp.member_count = getMembersDb(txn, room_id).size(txn);
                 tmp.join_rule    = getRoomJoinRule(txn, statesdb);
                 tmp.guest_access = getRoomGuestAccess(txn, statesdb);
 
                 return tmp;
             } catch (const json::exception &e) {
-                nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                  room_id,
-                                  std::string(data.data(), data.size()),
-                                  e.what());
+                nhlog::db()->warn("failed to parse room info: room_id ({}): {}", room_id, e.what());
             }
         }
     } catch (const lmdb::error &e) {
@@ -1745,49 +2989,44 @@ Cache::getRoomInfo(const std::vector<std::string> &rooms)
 {
     std::map<QString, RoomInfo> room_info;
 
-    // TODO This should be read only.
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = ro_txn(env_);
 
     for (const auto &room : rooms) {
         std::string_view data;
-        auto statesdb = getStatesDb(txn, room);
 
-        // Check if the room is joined.
-        if (roomsDb_.get(txn, room, data)) {
-            try {
-                RoomInfo tmp     = json::parse(data);
-                tmp.member_count = getMembersDb(txn, room).size(txn);
-                tmp.join_rule    = getRoomJoinRule(txn, statesdb);
-                tmp.guest_access = getRoomGuestAccess(txn, statesdb);
+        try {
+            // Check if the room is joined.
+            if (roomsDb_.get(txn, room, data)) {
+                try {
+                    auto statesdb    = getStatesDb(txn, room);
+                    RoomInfo tmp     = cache::parseRecord(data);
+                    tmp.member_count = getMembersDb(txn, room).size(txn);
+                    tmp.join_rule    = getRoomJoinRule(txn, statesdb);
+                    tmp.guest_access = getRoomGuestAccess(txn, statesdb);
 
-                room_info.emplace(QString::fromStdString(room), std::move(tmp));
-            } catch (const json::exception &e) {
-                nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                  room,
-                                  std::string(data.data(), data.size()),
-                                  e.what());
-            }
-        } else {
-            // Check if the room is an invite.
-            if (invitesDb_.get(txn, room, data)) {
+                    room_info.emplace(QString::fromStdString(room), std::move(tmp));
+                } catch (const json::exception &e) {
+                    nhlog::db()->warn(
+                      "failed to parse room info: room_id ({}): {}", room, e.what());
+                }
+            } else if (invitesDb_.get(txn, room, data)) {
+                // Check if the room is an invite.
                 try {
-                    RoomInfo tmp     = json::parse(std::string_view(data));
+                    RoomInfo tmp     = cache::parseRecord(data);
                     tmp.member_count = getInviteMembersDb(txn, room).size(txn);
 
                     room_info.emplace(QString::fromStdString(room), std::move(tmp));
                 } catch (const json::exception &e) {
-                    nhlog::db()->warn("failed to parse room info for invite: "
-                                      "room_id ({}), {}: {}",
-                                      room,
-                                      std::string(data.data(), data.size()),
-                                      e.what());
+                    nhlog::db()->warn(
+                      "failed to parse room info for invite: room_id ({}): {}", room, e.what());
                 }
             }
+        } catch (const lmdb::error &e) {
+            // Databases can't be created in a read only transaction.
+            nhlog::db()->warn("failed to read room info: room_id ({}): {}", room, e.what());
         }
     }
 
-    txn.commit();
-
     return room_info;
 }
 
@@ -1813,7 +3052,7 @@ Cache::getTimelineMentions()
 {
     // TODO: Should be read-only, but getMentionsDb will attempt to create a DB
     // if it doesn't exist, throwing an error.
-    auto txn = lmdb::txn::begin(env_, nullptr);
+    auto txn = GuardedTxn(env_);
 
     QMap<QString, mtx::responses::Notifications> notifs;
 
@@ -1832,7 +3071,7 @@ Cache::getTimelineMentions()
 std::string
 Cache::previousBatchToken(const std::string &room_id)
 {
-    auto txn     = lmdb::txn::begin(env_, nullptr);
+    auto txn     = GuardedTxn(env_);
     auto orderDb = getEventOrderDb(txn, room_id);
 
     auto cursor = lmdb::cursor::open(txn, orderDb);
@@ -1841,7 +3080,7 @@ Cache::previousBatchToken(const std::string &room_id)
         return "";
     }
 
-    auto j = json::parse(val);
+    auto j = cache::parseRecord(val);
 
     return j.value("prev_batch", "");
 }
@@ -1885,7 +3124,7 @@ Cache::getTimelineMessages(lmdb::txn &txn, const std::string &room_id, uint64_t
 
         mtx::events::collections::TimelineEvent te;
         try {
-            mtx::events::collections::from_json(json::parse(event), te);
+            mtx::events::collections::from_json(cache::parseRecord(event), te);
         } catch (std::exception &e) {
             nhlog::db()->error("Failed to parse message from cache {}", e.what());
             continue;
@@ -1915,7 +3154,7 @@ Cache::getEvent(const std::string &room_id, const std::string &event_id)
 
     mtx::events::collections::TimelineEvent te;
     try {
-        mtx::events::collections::from_json(json::parse(event), te);
+        mtx::events::collections::from_json(cache::parseRecord(event), te);
     } catch (std::exception &e) {
         nhlog::db()->error("Failed to parse message from cache {}", e.what());
         return std::nullopt;
@@ -1928,10 +3167,10 @@ Cache::storeEvent(const std::string &room_id,
                   const std::string &event_id,
                   const mtx::events::collections::TimelineEvent &event)
 {
-    auto txn        = lmdb::txn::begin(env_);
+    auto txn        = GuardedTxn(env_);
     auto eventsDb   = getEventsDb(txn, room_id);
     auto event_json = mtx::accessors::serialize_event(event.data);
-    eventsDb.put(txn, event_id, event_json.dump());
+    eventsDb.put(txn, event_id, cache::dumpRecord(event_json));
     txn.commit();
 }
 
@@ -1940,10 +3179,10 @@ Cache::replaceEvent(const std::string &room_id,
                     const std::string &event_id,
                     const mtx::events::collections::TimelineEvent &event)
 {
-    auto txn         = lmdb::txn::begin(env_);
+    auto txn         = GuardedTxn(env_);
     auto eventsDb    = getEventsDb(txn, room_id);
     auto relationsDb = getRelationsDb(txn, room_id);
-    auto event_json  = mtx::accessors::serialize_event(event.data).dump();
+    auto event_json  = cache::dumpRecord(mtx::accessors::serialize_event(event.data));
 
     {
         eventsDb.del(txn, event_id);
@@ -1997,34 +3236,75 @@ Cache::memberCount(const std::string &room_id)
 QMap<QString, RoomInfo>
 Cache::roomInfo(bool withInvites)
 {
+    auto summaries = roomSummaries();
+    if (withInvites)
+        return summaries->infos;
+
     QMap<QString, RoomInfo> result;
+    for (auto it = summaries->infos.constBegin(); it != summaries->infos.constEnd(); ++it) {
+        if (!it->is_invite)
+            result.insert(it.key(), it.value());
+    }
+    return result;
+}
 
-    auto txn = ro_txn(env_);
+std::shared_ptr<const RoomSummaries>
+Cache::roomSummaries()
+{
+    const auto generation = writeGeneration_.load();
+    {
+        std::lock_guard lock(roomSummariesMtx_);
+        if (roomSummaries_ && roomSummariesGeneration_ == generation)
+            return roomSummaries_;
+    }
 
-    std::string_view room_id;
-    std::string_view room_data;
+    auto summaries = std::make_shared<RoomSummaries>();
 
-    // Gather info about the joined rooms.
-    auto roomsCursor = lmdb::cursor::open(txn, roomsDb_);
-    while (roomsCursor.get(room_id, room_data, MDB_NEXT)) {
-        RoomInfo tmp     = json::parse(std::move(room_data));
-        tmp.member_count = getMembersDb(txn, std::string(room_id)).size(txn);
-        result.insert(QString::fromStdString(std::string(room_id)), std::move(tmp));
-    }
-    roomsCursor.close();
+    try {
+        auto txn = ro_txn(env_);
 
-    if (withInvites) {
-        // Gather info about the invites.
-        auto invitesCursor = lmdb::cursor::open(txn, invitesDb_);
-        while (invitesCursor.get(room_id, room_data, MDB_NEXT)) {
-            RoomInfo tmp     = json::parse(room_data);
-            tmp.member_count = getInviteMembersDb(txn, std::string(room_id)).size(txn);
-            result.insert(QString::fromStdString(std::string(room_id)), std::move(tmp));
+        std::string_view room_id, data;
+        auto readInfos = [&](lmdb::dbi &db, bool isInvite) {
+            auto cursor = lmdb::cursor::open(txn, db);
+            while (cursor.get(room_id, data, MDB_NEXT)) {
+                const std::string id(room_id);
+                try {
+                    RoomInfo info = cache::parseRecord(data);
+                    try {
+                        info.member_count = isInvite ? getInviteMembersDb(txn, id).size(txn)
+                                                     : getMembersDb(txn, id).size(txn);
+                    } catch (const lmdb::error &) {
+                        // No members stored yet.
+                    }
+                    summaries->infos.insert(QString::fromStdString(id), std::move(info));
+                } catch (const json::exception &e) {
+                    nhlog::db()->warn("failed to parse room info: room_id ({}): {}", id, e.what());
+                }
+            }
+            cursor.close();
+        };
+        readInfos(roomsDb_, false);
+        readInfos(invitesDb_, true);
+
+        // One sweep over all (room, parent) pairs.
+        auto cursor = lmdb::cursor::open(txn, spacesParentsDb_);
+        while (cursor.get(room_id, data, MDB_NEXT)) {
+            if (!data.empty())
+                summaries->parents[std::string(room_id)].emplace_back(data);
         }
-        invitesCursor.close();
+        cursor.close();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to read room summaries: {}", e.what());
+        return summaries;
     }
 
-    return result;
+    std::lock_guard lock(roomSummariesMtx_);
+    // Only share the summaries, if nothing was written in the mean time.
+    if (generation == writeGeneration_.load()) {
+        roomSummaries_           = summaries;
+        roomSummariesGeneration_ = generation;
+    }
+    return summaries;
 }
 
 std::string
@@ -2168,7 +3448,7 @@ Cache::lastInvisibleEventAfter(const std::string &room_id, std::string_view even
         auto cursor = lmdb::cursor::open(txn, eventOrderDb);
         cursor.get(indexVal, MDB_SET);
         while (cursor.get(indexVal, event_id, MDB_NEXT)) {
-            std::string evId = json::parse(event_id)["event_id"].get<std::string>();
+            std::string evId = cache::parseRecord(event_id)["event_id"].get<std::string>();
             std::string_view temp;
             if (timelineDb.get(txn, evId, temp)) {
                 return std::pair{prevIdx, std::string(prevId)};
@@ -2244,15 +3524,12 @@ Cache::invites()
 
     while (cursor.get(room_id, room_data, MDB_NEXT)) {
         try {
-            RoomInfo tmp     = json::parse(room_data);
+            RoomInfo tmp     = cache::parseRecord(room_data);
             tmp.member_count = getInviteMembersDb(txn, std::string(room_id)).size(txn);
             result.insert(QString::fromStdString(std::string(room_id)), std::move(tmp));
         } catch (const json::exception &e) {
-            nhlog::db()->warn("failed to parse room info for invite: "
-                              "room_id ({}), {}: {}",
-                              room_id,
-                              std::string(room_data),
-                              e.what());
+            nhlog::db()->warn(
+              "failed to parse room info for invite: room_id ({}): {}", room_id, e.what());
         }
     }
 
@@ -2272,15 +3549,12 @@ Cache::invite(std::string_view roomid)
 
     if (invitesDb_.get(txn, roomid, room_data)) {
         try {
-            RoomInfo tmp     = json::parse(room_data);
+            RoomInfo tmp     = cache::parseRecord(room_data);
             tmp.member_count = getInviteMembersDb(txn, std::string(roomid)).size(txn);
             result           = std::move(tmp);
         } catch (const json::exception &e) {
-            nhlog::db()->warn("failed to parse room info for invite: "
-                              "room_id ({}), {}: {}",
-                              roomid,
-                              std::string(room_data),
-                              e.what());
+            nhlog::db()->warn(
+              "failed to parse room info for invite: room_id ({}): {}", roomid, e.what());
         }
     }
 
@@ -2298,7 +3572,7 @@ Cache::getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersd
 
     if (res) {
         try {
-            StateEvent<Avatar> msg = json::parse(std::string_view(event.data(), event.size()));
+            StateEvent<Avatar> msg = cache::parseRecord(event);
 
             if (!msg.content.url.empty())
                 return QString::fromStdString(msg.content.url);
@@ -2319,7 +3593,7 @@ Cache::getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersd
     // Resolve avatar for 1-1 chats.
     while (cursor.get(user_id, member_data, MDB_NEXT)) {
         try {
-            MemberInfo m = json::parse(member_data);
+            MemberInfo m = decodeMemberInfo(member_data);
             if (user_id == localUserId_.toStdString()) {
                 fallback_url = m.avatar_url;
                 continue;
@@ -2327,7 +3601,7 @@ Cache::getRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersd
 
             cursor.close();
             return QString::fromStdString(m.avatar_url);
-        } catch (const json::exception &e) {
+        } catch (const std::exception &e) {
             nhlog::db()->warn("failed to parse member info: {}", e.what());
         }
     }
@@ -2349,7 +3623,7 @@ Cache::getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
 
     if (res) {
         try {
-            StateEvent<Name> msg = json::parse(std::string_view(event.data(), event.size()));
+            StateEvent<Name> msg = cache::parseRecord(event);
 
             if (!msg.content.name.empty())
                 return QString::fromStdString(msg.content.name);
@@ -2362,8 +3636,7 @@ Cache::getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
 
     if (res) {
         try {
-            StateEvent<CanonicalAlias> msg =
-              json::parse(std::string_view(event.data(), event.size()));
+            StateEvent<CanonicalAlias> msg = cache::parseRecord(event);
 
             if (!msg.content.alias.empty())
                 return QString::fromStdString(msg.content.alias);
@@ -2382,8 +3655,8 @@ Cache::getRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &membersdb)
 
     while (cursor.get(user_id, member_data, MDB_NEXT) && ii < 3) {
         try {
-            members.emplace(user_id, json::parse(member_data));
-        } catch (const json::exception &e) {
+            members.emplace(user_id, decodeMemberInfo(member_data));
+        } catch (const std::exception &e) {
             nhlog::db()->warn("failed to parse member info: {}", e.what());
         }
 
@@ -2423,7 +3696,7 @@ Cache::getRoomJoinRule(lmdb::txn &txn, lmdb::dbi &statesdb)
 
     if (res) {
         try {
-            StateEvent<state::JoinRules> msg = json::parse(event);
+            StateEvent<state::JoinRules> msg = cache::parseRecord(event);
             return msg.content.join_rule;
         } catch (const json::exception &e) {
             nhlog::db()->warn("failed to parse m.room.join_rule event: {}", e.what());
@@ -2443,7 +3716,7 @@ Cache::getRoomGuestAccess(lmdb::txn &txn, lmdb::dbi &statesdb)
 
     if (res) {
         try {
-            StateEvent<GuestAccess> msg = json::parse(event);
+            StateEvent<GuestAccess> msg = cache::parseRecord(event);
             return msg.content.guest_access == AccessState::CanJoin;
         } catch (const json::exception &e) {
             nhlog::db()->warn("failed to parse m.room.guest_access event: {}", e.what());
@@ -2463,7 +3736,7 @@ Cache::getRoomTopic(lmdb::txn &txn, lmdb::dbi &statesdb)
 
     if (res) {
         try {
-            StateEvent<Topic> msg = json::parse(event);
+            StateEvent<Topic> msg = cache::parseRecord(event);
 
             if (!msg.content.topic.empty())
                 return QString::fromStdString(msg.content.topic);
@@ -2486,7 +3759,7 @@ Cache::getRoomVersion(lmdb::txn &txn, lmdb::dbi &statesdb)
 
     if (res) {
         try {
-            StateEvent<Create> msg = json::parse(event);
+            StateEvent<Create> msg = cache::parseRecord(event);
 
             if (!msg.content.room_version.empty())
                 return QString::fromStdString(msg.content.room_version);
@@ -2510,7 +3783,7 @@ Cache::getRoomIsSpace(lmdb::txn &txn, lmdb::dbi &statesdb)
 
     if (res) {
         try {
-            StateEvent<Create> msg = json::parse(event);
+            StateEvent<Create> msg = cache::parseRecord(event);
 
             return msg.content.type == mtx::events::state::room_type::space;
         } catch (const json::exception &e) {
@@ -2536,7 +3809,7 @@ Cache::getRoomAliases(const std::string &roomid)
 
     if (res) {
         try {
-            StateEvent<CanonicalAlias> msg = json::parse(event);
+            StateEvent<CanonicalAlias> msg = cache::parseRecord(event);
 
             return msg.content;
         } catch (const json::exception &e) {
@@ -2558,7 +3831,7 @@ Cache::getInviteRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &members
 
     if (res) {
         try {
-            StrippedEvent<state::Name> msg = json::parse(event);
+            StrippedEvent<state::Name> msg = cache::parseRecord(event);
             return QString::fromStdString(msg.content.name);
         } catch (const json::exception &e) {
             nhlog::db()->warn("failed to parse m.room.name event: {}", e.what());
@@ -2573,11 +3846,11 @@ Cache::getInviteRoomName(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &members
             continue;
 
         try {
-            MemberInfo tmp = json::parse(member_data);
+            MemberInfo tmp = decodeMemberInfo(member_data);
             cursor.close();
 
             return QString::fromStdString(tmp.name);
-        } catch (const json::exception &e) {
+        } catch (const std::exception &e) {
             nhlog::db()->warn("failed to parse member info: {}", e.what());
         }
     }
@@ -2598,7 +3871,7 @@ Cache::getInviteRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &me
 
     if (res) {
         try {
-            StrippedEvent<state::Avatar> msg = json::parse(event);
+            StrippedEvent<state::Avatar> msg = cache::parseRecord(event);
             return QString::fromStdString(msg.content.url);
         } catch (const json::exception &e) {
             nhlog::db()->warn("failed to parse m.room.avatar event: {}", e.what());
@@ -2613,11 +3886,11 @@ Cache::getInviteRoomAvatarUrl(lmdb::txn &txn, lmdb::dbi &statesdb, lmdb::dbi &me
             continue;
 
         try {
-            MemberInfo tmp = json::parse(member_data);
+            MemberInfo tmp = decodeMemberInfo(member_data);
             cursor.close();
 
             return QString::fromStdString(tmp.avatar_url);
-        } catch (const json::exception &e) {
+        } catch (const std::exception &e) {
             nhlog::db()->warn("failed to parse member info: {}", e.what());
         }
     }
@@ -2638,7 +3911,7 @@ Cache::getInviteRoomTopic(lmdb::txn &txn, lmdb::dbi &db)
 
     if (res) {
         try {
-            StrippedEvent<Topic> msg = json::parse(event);
+            StrippedEvent<Topic> msg = cache::parseRecord(event);
             return QString::fromStdString(msg.content.topic);
         } catch (const json::exception &e) {
             nhlog::db()->warn("failed to parse m.room.topic event: {}", e.what());
@@ -2659,7 +3932,7 @@ Cache::getInviteRoomIsSpace(lmdb::txn &txn, lmdb::dbi &db)
 
     if (res) {
         try {
-            StrippedEvent<Create> msg = json::parse(event);
+            StrippedEvent<Create> msg = cache::parseRecord(event);
             return msg.content.type == mtx::events::state::room_type::space;
         } catch (const json::exception &e) {
             nhlog::db()->warn("failed to parse m.room.topic event: {}", e.what());
@@ -2694,15 +3967,12 @@ Cache::getMember(const std::string &room_id, const std::string &user_id)
         return std::nullopt;
 
     try {
-        auto txn = ro_txn(env_);
+        auto members = memberDirectory(room_id);
+        if (!members)
+            return std::nullopt;
 
-        auto membersdb = getMembersDb(txn, room_id);
-
-        std::string_view info;
-        if (membersdb.get(txn, user_id, info)) {
-            MemberInfo m = json::parse(info);
-            return m;
-        }
+        if (auto it = members->find(user_id); it != members->end())
+            return it->second;
     } catch (std::exception &e) {
         nhlog::db()->warn(
           "Failed to read member ({}) in room ({}): {}", user_id, room_id, e.what());
@@ -2710,6 +3980,167 @@ Cache::getMember(const std::string &room_id, const std::string &user_id)
     return std::nullopt;
 }
 
+Cache::MemberDirectoryPtr
+Cache::memberDirectory(const std::string &room_id)
+{
+    {
+        auto directories = std::atomic_load(&memberDirectories_);
+        if (auto it = directories->find(room_id); it != directories->end())
+            return it->second;
+    }
+
+    std::uint64_t generation;
+    {
+        std::lock_guard lock(memberDirectoriesMtx_);
+        generation = memberDirectoriesGeneration_;
+    }
+
+    auto directory       = std::make_shared<MemberDirectory>();
+    std::size_t snapshot = 0;
+    try {
+        auto txn = ro_txn(env_);
+        snapshot = mdb_txn_id(txn);
+        auto db  = getMembersDb(txn, room_id);
+        directory->reserve(db.size(txn));
+
+        auto cursor = lmdb::cursor::open(txn, db);
+        std::string_view user_id, member_data;
+        while (cursor.get(user_id, member_data, MDB_NEXT)) {
+            try {
+                directory->emplace(user_id, decodeMemberInfo(member_data));
+            } catch (const std::exception &e) {
+                nhlog::db()->warn("failed to parse member info: {}", e.what());
+            }
+        }
+        cursor.close();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to load members of {}: {}", room_id, e.what());
+        return nullptr;
+    }
+
+    std::lock_guard lock(memberDirectoriesMtx_);
+    // Members changed while loading or in a transaction, that is not committed yet. The
+    // directory might miss some of the changes.
+    if (generation != memberDirectoriesGeneration_ || snapshot < memberDirectoriesMinSnapshot_)
+        return directory;
+
+    auto directories = std::make_shared<MemberDirectories>(*std::atomic_load(&memberDirectories_));
+    if (directories->insert_or_assign(room_id, directory).second)
+        memberDirectoryOrder_.push_back(room_id);
+
+    while (memberDirectoryOrder_.size() > MAX_MEMBER_DIRECTORIES) {
+        directories->erase(memberDirectoryOrder_.front());
+        memberDirectoryOrder_.pop_front();
+    }
+
+    std::atomic_store(&memberDirectories_,
+                      std::shared_ptr<const MemberDirectories>(std::move(directories)));
+    return directory;
+}
+
+void
+Cache::stageMemberUpdate(lmdb::txn &txn,
+                         const std::string &room_id,
+                         const std::string &user_id,
+                         std::optional<MemberInfo> info)
+{
+    if (stagedMembers.txn == txn.handle()) {
+        stagedMembers.updates.push_back({room_id, user_id, std::move(info)});
+        return;
+    }
+
+    // Not a transaction we get notified about, so just stop serving the room from memory.
+    // Directories loaded from snapshots before this transaction are not published either, the
+    // transaction id is the id of the snapshot it commits.
+    std::lock_guard lock(memberDirectoriesMtx_);
+    memberDirectoriesGeneration_++;
+    memberDirectoriesMinSnapshot_ =
+      std::max(memberDirectoriesMinSnapshot_, mdb_txn_id(txn.handle()));
+
+    auto current = std::atomic_load(&memberDirectories_);
+    if (!current->count(room_id))
+        return;
+
+    auto directories = std::make_shared<MemberDirectories>(*current);
+    eraseMemberDirectory(*directories, room_id);
+    std::atomic_store(&memberDirectories_,
+                      std::shared_ptr<const MemberDirectories>(std::move(directories)));
+}
+
+void
+Cache::eraseMemberDirectory(MemberDirectories &directories, const std::string &room_id)
+{
+    if (!directories.erase(room_id))
+        return;
+
+    memberDirectoryOrder_.erase(
+      std::remove(memberDirectoryOrder_.begin(), memberDirectoryOrder_.end(), room_id),
+      memberDirectoryOrder_.end());
+}
+
+void
+Cache::publishMemberUpdates()
+{
+    auto updates = std::move(stagedMembers.updates);
+    stagedMembers.txn = nullptr;
+    stagedMembers.updates.clear();
+
+    if (updates.empty())
+        return;
+
+    std::lock_guard lock(memberDirectoriesMtx_);
+    memberDirectoriesGeneration_++;
+
+    auto current = std::atomic_load(&memberDirectories_);
+    std::shared_ptr<MemberDirectories> directories;
+    // Copies of the directories changed by this transaction.
+    std::unordered_map<std::string, std::shared_ptr<MemberDirectory>> changed;
+
+    for (auto &update : updates) {
+        if (!current->count(update.room_id))
+            continue;
+
+        if (!directories)
+            directories = std::make_shared<MemberDirectories>(*current);
+
+        if (update.user_id.empty()) {
+            eraseMemberDirectory(*directories, update.room_id);
+            changed.erase(update.room_id);
+            continue;
+        }
+
+        auto &directory = changed[update.room_id];
+        if (!directory) {
+            auto it = directories->find(update.room_id);
+            if (it == directories->end()) {
+                changed.erase(update.room_id);
+                continue;
+            }
+
+            directory  = std::make_shared<MemberDirectory>(*it->second);
+            it->second = directory;
+        }
+
+        if (update.info)
+            directory->insert_or_assign(update.user_id, std::move(*update.info));
+        else
+            directory->erase(update.user_id);
+    }
+
+    if (directories)
+        std::atomic_store(&memberDirectories_,
+                          std::shared_ptr<const MemberDirectories>(std::move(directories)));
+}
+
+void
+Cache::forgetAllMemberDirectories()
+{
+    std::lock_guard lock(memberDirectoriesMtx_);
+    memberDirectoriesGeneration_++;
+    memberDirectoryOrder_.clear();
+    std::atomic_store(&memberDirectories_, std::make_shared<const MemberDirectories>());
+}
+
 std::vector<RoomMember>
 Cache::getMembers(const std::string &room_id, std::size_t startIndex, std::size_t len)
 {
@@ -2734,10 +4165,10 @@ Cache::getMembers(const std::string &room_id, std::size_t startIndex, std::size_
             break;
 
         try {
-            MemberInfo tmp = json::parse(user_data);
+            MemberInfo tmp = decodeMemberInfo(user_data);
             members.emplace_back(RoomMember{QString::fromStdString(std::string(user_id)),
                                             QString::fromStdString(tmp.name)});
-        } catch (const json::exception &e) {
+        } catch (const std::exception &e) {
             nhlog::db()->warn("{}", e.what());
         }
 
@@ -2773,11 +4204,11 @@ Cache::getMembersFromInvite(const std::string &room_id, std::size_t startIndex,
             break;
 
         try {
-            MemberInfo tmp = json::parse(user_data);
+            MemberInfo tmp = decodeMemberInfo(user_data);
             members.emplace_back(RoomMember{QString::fromStdString(std::string(user_id)),
                                             QString::fromStdString(tmp.name),
                                             tmp.is_direct});
-        } catch (const json::exception &e) {
+        } catch (const std::exception &e) {
             nhlog::db()->warn("{}", e.what());
         }
 
@@ -2811,7 +4242,7 @@ void
 Cache::savePendingMessage(const std::string &room_id,
                           const mtx::events::collections::TimelineEvent &message)
 {
-    auto txn      = lmdb::txn::begin(env_);
+    auto txn      = GuardedTxn(env_);
     auto eventsDb = getEventsDb(txn, room_id);
 
     mtx::responses::Timeline timeline;
@@ -2829,7 +4260,7 @@ Cache::savePendingMessage(const std::string &room_id,
 std::optional<mtx::events::collections::TimelineEvent>
 Cache::firstPendingMessage(const std::string &room_id)
 {
-    auto txn     = lmdb::txn::begin(env_);
+    auto txn     = GuardedTxn(env_);
     auto pending = getPendingMessagesDb(txn, room_id);
 
     {
@@ -2845,7 +4276,7 @@ Cache::firstPendingMessage(const std::string &room_id)
 
             try {
                 mtx::events::collections::TimelineEvent te;
-                mtx::events::collections::from_json(json::parse(event), te);
+                mtx::events::collections::from_json(cache::parseRecord(event), te);
 
                 pendingCursor.close();
                 txn.commit();
@@ -2866,7 +4297,7 @@ Cache::firstPendingMessage(const std::string &room_id)
 void
 Cache::removePendingStatus(const std::string &room_id, const std::string &txn_id)
 {
-    auto txn     = lmdb::txn::begin(env_);
+    auto txn     = GuardedTxn(env_);
     auto pending = getPendingMessagesDb(txn, room_id);
 
     {
@@ -2881,11 +4312,67 @@ Cache::removePendingStatus(const std::string &room_id, const std::string &txn_id
     txn.commit();
 }
 
+namespace {
+//! Events shown as the last message of a room, same as in the TimelineModel.
+template<typename T>
+auto
+isRoomListMessage(const mtx::events::RoomEvent<T> &e, const std::string &)
+  -> std::enable_if_t<std::is_same<decltype(e.content.msgtype), std::string>::value, bool>
+{
+    return true;
+}
+
+template<typename T>
+bool
+isRoomListMessage(const mtx::events::Event<T> &, const std::string &)
+{
+    return false;
+}
+
+template<typename T>
+bool
+isRoomListMessage(const mtx::events::EncryptedEvent<T> &, const std::string &)
+{
+    return true;
+}
+
+bool
+isRoomListMessage(const mtx::events::RoomEvent<mtx::events::msg::CallInvite> &,
+                  const std::string &)
+{
+    return true;
+}
+
+bool
+isRoomListMessage(const mtx::events::RoomEvent<mtx::events::msg::CallAnswer> &,
+                  const std::string &)
+{
+    return true;
+}
+
+bool
+isRoomListMessage(const mtx::events::RoomEvent<mtx::events::msg::CallHangUp> &,
+                  const std::string &)
+{
+    return true;
+}
+
+//! Your own join is shown, so that a room you just joined is shown at the top.
+bool
+isRoomListMessage(const mtx::events::StateEvent<mtx::events::state::Member> &e,
+                  const std::string &local_user)
+{
+    return e.content.membership == mtx::events::state::Membership::Join &&
+           e.state_key == local_user;
+}
+}
+
 void
 Cache::saveTimelineMessages(lmdb::txn &txn,
                             lmdb::dbi &eventsDb,
                             const std::string &room_id,
-                            const mtx::responses::Timeline &res)
+                            const mtx::responses::Timeline &res,
+                            const std::vector<std::string> *records)
 {
     if (res.events.empty())
         return;
@@ -2897,13 +4384,18 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
     auto msg2orderDb = getMessageToOrderDb(txn, room_id);
     auto order2msgDb = getOrderToMessageDb(txn, room_id);
     auto pending     = getPendingMessagesDb(txn, room_id);
+    auto searchDb    = getSearchDb(txn, room_id);
 
     if (res.limited) {
         lmdb::dbi_drop(txn, orderDb, false);
         lmdb::dbi_drop(txn, evToOrderDb, false);
         lmdb::dbi_drop(txn, msg2orderDb, false);
         lmdb::dbi_drop(txn, order2msgDb, false);
+        forgetRoomDbs(room_id, RoomDb::Pending);
         lmdb::dbi_drop(txn, pending, true);
+        // Opened again, so that the new handle is published with this transaction.
+        pending = getPendingMessagesDb(txn, room_id);
+        forgetPruneMark(room_id);
     }
 
     using namespace mtx::events;
@@ -2922,12 +4414,22 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
         msgIndex = lmdb::from_sv<uint64_t>(indexVal);
     }
 
-    bool first = true;
-    for (const auto &e : res.events) {
-        auto event  = mtx::accessors::serialize_event(e);
-        auto txn_id = mtx::accessors::transaction_id(e);
+    uint64_t added = 0, addedBytes = 0;
+    bool first     = true;
+    for (std::size_t i = 0; i < res.events.size(); i++) {
+        const auto &e = res.events[i];
+        auto txn_id   = mtx::accessors::transaction_id(e);
+
+        std::string serialized;
+        auto record = [&]() -> std::string_view {
+            if (records)
+                return (*records)[i];
+            if (serialized.empty())
+                serialized = cache::dumpRecord(mtx::accessors::serialize_event(e));
+            return serialized;
+        };
 
-        std::string event_id_val = event.value("event_id", "");
+        std::string event_id_val = mtx::accessors::event_id(e);
         if (event_id_val.empty()) {
             nhlog::db()->error("Event without id!");
             continue;
@@ -2942,7 +4444,7 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
         std::string_view txn_order;
         if (!txn_id.empty() && evToOrderDb.get(txn, txn_id, txn_order)) {
-            eventsDb.put(txn, event_id, event.dump());
+            eventsDb.put(txn, event_id, record());
             eventsDb.del(txn, txn_id);
 
             std::string_view msg_txn_order;
@@ -2952,7 +4454,7 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                 msg2orderDb.del(txn, txn_id);
             }
 
-            orderDb.put(txn, txn_order, orderEntry.dump());
+            orderDb.put(txn, txn_order, cache::dumpRecord(orderEntry));
             evToOrderDb.put(txn, event_id, txn_order);
             evToOrderDb.del(txn, txn_id);
 
@@ -2983,9 +4485,9 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                 continue;
 
             mtx::events::collections::TimelineEvent te;
+            json event;
             try {
-                mtx::events::collections::from_json(
-                  json::parse(std::string_view(oldEvent.data(), oldEvent.size())), te);
+                mtx::events::collections::from_json(cache::parseRecord(oldEvent), te);
                 // overwrite the content and add redation data
                 std::visit(
                   [redaction](auto &ev) {
@@ -3001,8 +4503,18 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                 continue;
             }
 
-            eventsDb.put(txn, redaction->redacts, event.dump());
-            eventsDb.put(txn, redaction->event_id, json(*redaction).dump());
+            // The words of the redacted message must not be found anymore.
+            unindexStoredMessage(
+              txn, eventsDb, searchDb, room_id, redaction->redacts, decryptedEventsKey());
+
+            eventsDb.put(txn, redaction->redacts, cache::dumpRecord(event));
+            eventsDb.put(txn, redaction->event_id, cache::dumpRecord(*redaction));
+            decryptedEventsDb_.del(txn, decryptedEventKey(room_id, redaction->redacts));
+
+            // The room list searches the timeline again, if its last message was redacted.
+            if (auto last = getLastMessage(txn, room_id);
+                last && last->event_id == redaction->redacts)
+                lastMessagesDb_.del(txn, room_id);
         } else {
             first = false;
 
@@ -3015,8 +4527,10 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
                 nhlog::db()->debug("saving '{}'", orderEntry.dump());
 
-                cursor.put(lmdb::to_sv(index), orderEntry.dump(), MDB_APPEND);
+                cursor.put(lmdb::to_sv(index), cache::dumpRecord(orderEntry), MDB_APPEND);
                 evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
+                added++;
+                addedBytes += record().size();
 
                 // TODO(Nico): Allow blacklisting more event types in UI
                 if (!isHiddenEvent(txn, e, room_id)) {
@@ -3028,26 +4542,519 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
             } else {
                 nhlog::db()->warn("duplicate event '{}'", orderEntry.dump());
             }
-            eventsDb.put(txn, event_id, event.dump());
+            eventsDb.put(txn, event_id, record());
+            indexMessage(txn, searchDb, e, std::nullopt);
+
+            auto relations = mtx::accessors::relations(e);
+            if (!relations.relations.empty()) {
+                for (const auto &r : relations.relations) {
+                    if (!r.event_id.empty()) {
+                        relationsDb.put(txn, r.event_id, event_id);
+                    }
+                }
+            }
+        }
+    }
+
+    noteHistoryGrowth(room_id, added, addedBytes);
+
+    const auto local_user = localUserId_.toStdString();
+    for (auto it = res.events.rbegin(); it != res.events.rend(); ++it) {
+        if (std::visit([&local_user](const auto &e) { return isRoomListMessage(e, local_user); },
+                       *it)) {
+            saveLastMessage(
+              txn, room_id, *it, std::holds_alternative<EncryptedEvent<msg::Encrypted>>(*it));
+            break;
+        }
+    }
+}
+
+std::optional<LastMessage>
+Cache::getLastMessage(lmdb::txn &txn, const std::string &room_id)
+{
+    std::string_view data;
+    if (!lastMessagesDb_.get(txn, room_id, data))
+        return std::nullopt;
+
+    try {
+        return cache::parseRecord(data).get<LastMessage>();
+    } catch (const json::exception &e) {
+        nhlog::db()->warn("failed to parse last message of {}: {}", room_id, e.what());
+        return std::nullopt;
+    }
+}
+
+void
+Cache::saveLastMessage(lmdb::txn &txn,
+                       const std::string &room_id,
+                       const mtx::events::collections::TimelineEvents &event,
+                       bool encrypted)
+{
+    LastMessage message;
+    message.event_id  = mtx::accessors::event_id(event);
+    message.sender    = mtx::accessors::sender(event);
+    message.timestamp = mtx::accessors::origin_server_ts(event).toMSecsSinceEpoch();
+    message.encrypted = encrypted;
+
+    if (auto stored = getLastMessage(txn, room_id)) {
+        // Don't replace newer messages, i.e. when saving old messages, and don't replace a
+        // decrypted message with its encrypted version.
+        if (stored->timestamp > message.timestamp)
+            return;
+        if (stored->event_id == message.event_id &&
+            std::holds_alternative<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(
+              event))
+            return;
+    }
+
+    message.event = lastMessageEvent(event);
+    lastMessagesDb_.put(txn, room_id, cache::dumpRecord(json(message)));
+}
+
+void
+Cache::saveDecryptedLastMessage(lmdb::txn &txn,
+                                const std::string &room_id,
+                                const mtx::events::collections::TimelineEvents &event)
+{
+    auto secret = decryptedEventsKey();
+    if (!secret)
+        return;
+
+    // Only stored next to the encrypted message, which is stored when it is received.
+    auto stored = getLastMessage(txn, room_id);
+    if (!stored || stored->event_id != mtx::accessors::event_id(event))
+        return;
+
+    const auto key    = decryptedEventKey(room_id, stored->event_id);
+    stored->decrypted = json(mtx::crypto::encrypt(lastMessageEvent(event).dump(), *secret, key));
+    lastMessagesDb_.put(txn, room_id, cache::dumpRecord(json(*stored)));
+}
+
+std::optional<mtx::crypto::BinaryBuf>
+Cache::decryptedEventsKey() const
+{
+    if (pickle_secret_.empty())
+        return std::nullopt;
+
+    auto hash = mtx::crypto::sha256("decrypted_events" + pickle_secret_);
+    return mtx::crypto::BinaryBuf(hash.begin(), hash.end());
+}
+
+std::optional<mtx::crypto::BinaryBuf>
+Cache::searchTokensKey() const
+{
+    if (pickle_secret_.empty())
+        return std::nullopt;
+
+    auto hash = mtx::crypto::sha256("search_tokens" + pickle_secret_);
+    return mtx::crypto::BinaryBuf(hash.begin(), hash.end());
+}
+
+std::optional<mtx::events::collections::TimelineEvents>
+Cache::getDecryptedEvent(const std::string &room_id, const std::string &event_id)
+{
+    auto secret = decryptedEventsKey();
+    if (!secret)
+        return std::nullopt;
+
+    try {
+        auto txn = ro_txn(env_);
+        return getDecryptedEvent(txn, room_id, event_id, *secret);
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to read decrypted event {}: {}", event_id, e.what());
+    }
+    return std::nullopt;
+}
+
+std::optional<mtx::events::collections::TimelineEvents>
+Cache::getDecryptedEvent(lmdb::txn &txn,
+                         const std::string &room_id,
+                         const std::string &event_id,
+                         const mtx::crypto::BinaryBuf &secret)
+{
+    const auto key = decryptedEventKey(room_id, event_id);
+
+    std::string_view value;
+    if (!decryptedEventsDb_.get(txn, key, value))
+        return std::nullopt;
+
+    try {
+        auto encrypted =
+          cache::parseRecord(value).get<mtx::secret_storage::AesHmacSha2EncryptedData>();
+        // Empty, if the mac does not match.
+        auto plaintext = mtx::crypto::decrypt(encrypted, secret, key);
+        if (plaintext.empty())
+            return std::nullopt;
+
+        mtx::events::collections::TimelineEvent te;
+        mtx::events::collections::from_json(json::parse(plaintext), te);
+        return std::move(te.data);
+    } catch (const std::exception &e) {
+        nhlog::db()->warn("failed to parse decrypted event {}: {}", event_id, e.what());
+    }
+    return std::nullopt;
+}
+
+void
+Cache::storeDecryptedEvents(const std::string &room_id,
+                            const std::vector<mtx::events::collections::TimelineEvents> &events)
+{
+    auto secret = decryptedEventsKey();
+    if (!secret || events.empty())
+        return;
+
+    try {
+        auto txn      = GuardedTxn(env_);
+        auto searchDb = getSearchDb(txn, room_id);
+        for (const auto &event : events) {
+            const auto key = decryptedEventKey(room_id, mtx::accessors::event_id(event));
+            auto encrypted =
+              mtx::crypto::encrypt(mtx::accessors::serialize_event(event).dump(), *secret, key);
+            decryptedEventsDb_.put(txn, key, cache::dumpRecord(json(encrypted)));
+            indexMessage(txn, searchDb, event, searchTokensKey());
+        }
+        txn.commit();
+    } catch (const std::exception &e) {
+        nhlog::db()->warn("failed to store decrypted events of {}: {}", room_id, e.what());
+    }
+}
+
+void
+Cache::deleteDecryptedEvents(lmdb::txn &txn, const std::string &room_id)
+{
+    const auto prefix = decryptedEventKey(room_id, "");
+
+    auto cursor          = lmdb::cursor::open(txn, decryptedEventsDb_);
+    std::string_view key = prefix, value;
+    bool first           = true;
+    // After a deletion MDB_NEXT returns the entry following the deleted one.
+    while (cursor.get(key, value, first ? MDB_SET_RANGE : MDB_NEXT) &&
+           key.substr(0, prefix.size()) == prefix) {
+        first = false;
+        cursor.del();
+    }
+}
+
+void
+Cache::deleteHashedSearchPostings(lmdb::txn &txn, const std::string &room_id)
+{
+    auto searchDb = getSearchDb(txn, room_id);
+
+    std::vector<std::string> keys;
+    {
+        auto cursor          = lmdb::cursor::open(txn, searchDb);
+        std::string_view key = "#", value;
+        bool found           = cursor.get(key, value, MDB_SET_RANGE);
+        while (found && key.substr(0, 1) == "#") {
+            keys.emplace_back(key);
+            found = cursor.get(key, value, MDB_NEXT_NODUP);
+        }
+    }
+
+    // Deletes all postings of a word.
+    for (const auto &key : keys)
+        searchDb.del(txn, key);
+}
+
+void
+Cache::clearDecryptedEvents()
+{
+    try {
+        auto txn = GuardedTxn(env_);
+        decryptedEventsDb_.drop(txn, false);
+        for (const auto &room_id : getRoomIds(txn))
+            deleteHashedSearchPostings(txn, room_id);
+
+        // Keep only the encrypted version of the last messages.
+        std::vector<std::pair<std::string, LastMessage>> lastMessages;
+        {
+            auto cursor = lmdb::cursor::open(txn, lastMessagesDb_);
+            std::string_view room_id, value;
+            while (cursor.get(room_id, value, MDB_NEXT)) {
+                try {
+                    auto message = cache::parseRecord(value).get<LastMessage>();
+                    if (!message.decrypted.is_null())
+                        lastMessages.emplace_back(std::string(room_id), std::move(message));
+                } catch (const json::exception &e) {
+                    nhlog::db()->warn("failed to parse last message of {}: {}", room_id, e.what());
+                }
+            }
+        }
+        for (auto &[room_id, message] : lastMessages) {
+            message.decrypted = nullptr;
+            lastMessagesDb_.put(txn, room_id, cache::dumpRecord(json(message)));
+        }
+
+        txn.commit();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to clear decrypted events: {}", e.what());
+    }
+}
+
+void
+Cache::indexMessage(lmdb::txn &txn,
+                    lmdb::dbi &searchDb,
+                    const mtx::events::collections::TimelineEvents &event,
+                    const std::optional<mtx::crypto::BinaryBuf> &hashKey)
+{
+    const auto keys = searchKeys(event, hashKey);
+    if (keys.empty())
+        return;
+
+    const auto posting = searchPosting(event);
+    for (const auto &key : keys)
+        searchDb.put(txn, key, posting);
+}
+
+void
+Cache::unindexMessage(lmdb::txn &txn,
+                      lmdb::dbi &searchDb,
+                      const mtx::events::collections::TimelineEvents &event,
+                      const std::optional<mtx::crypto::BinaryBuf> &hashKey)
+{
+    const auto keys = searchKeys(event, hashKey);
+    if (keys.empty())
+        return;
+
+    const auto posting = searchPosting(event);
+    for (const auto &key : keys)
+        searchDb.del(txn, key, posting);
+}
+
+void
+Cache::unindexStoredMessage(lmdb::txn &txn,
+                            lmdb::dbi &eventsDb,
+                            lmdb::dbi &searchDb,
+                            const std::string &room_id,
+                            const std::string &event_id,
+                            const std::optional<mtx::crypto::BinaryBuf> &secret)
+{
+    std::string_view record;
+    if (!eventsDb.get(txn, event_id, record))
+        return;
+
+    try {
+        mtx::events::collections::TimelineEvent te;
+        mtx::events::collections::from_json(cache::parseRecord(record), te);
+        unindexMessage(txn, searchDb, te.data, std::nullopt);
+    } catch (const std::exception &e) {
+        nhlog::db()->warn("failed to parse event {} while unindexing: {}", event_id, e.what());
+    }
+
+    if (secret)
+        if (auto decrypted = getDecryptedEvent(txn, room_id, event_id, *secret))
+            unindexMessage(txn, searchDb, *decrypted, searchTokensKey());
+}
+
+std::vector<MessageSearchResult>
+Cache::searchMessages(const QString &query, const std::string &room_id, std::size_t limit)
+{
+    const auto tokens = searchTokens(query);
+    if (tokens.empty() || limit == 0)
+        return {};
+
+    //! A word of the query and the words in the index, it matches.
+    struct Term
+    {
+        std::string exact;
+        std::vector<std::string> keys;
+        std::size_t postings = 0;
+    };
+
+    std::vector<MessageSearchResult> results;
+
+    try {
+        auto txn      = ro_txn(env_);
+        auto hashKey  = searchTokensKey();
+        auto room_ids = room_id.empty() ? getRoomIds(txn) : std::vector<std::string>{room_id};
+
+        for (const auto &room : room_ids) {
+            std::optional<lmdb::dbi> searchDb;
+            try {
+                searchDb = getSearchDb(txn, room);
+            } catch (const lmdb::error &) {
+                // Nothing was indexed in this room yet.
+                continue;
+            }
+
+            auto cursor = lmdb::cursor::open(txn, *searchDb);
+            auto lookup = lmdb::cursor::open(txn, *searchDb);
+
+            auto postings = [&cursor](std::string_view key) -> std::size_t {
+                std::string_view value;
+                mdb_size_t count = 0;
+                if (cursor.get(key, value, MDB_SET))
+                    mdb_cursor_count(cursor.handle(), &count);
+                return count;
+            };
+            auto score = [&lookup](const Term &term, std::string_view posting) {
+                for (const auto &k : term.keys) {
+                    std::string_view key = k, value = posting;
+                    if (lookup.get(key, value, MDB_GET_BOTH))
+                        return k == term.exact ? 2 : 1;
+                }
+                return 0;
+            };
+
+            // Plain words of unencrypted messages, then hashed words of decrypted messages.
+            for (bool hashed : {false, true}) {
+                if (hashed && !hashKey)
+                    break;
+
+                std::vector<Term> terms;
+                for (std::size_t i = 0; i < tokens.size(); i++) {
+                    Term term;
+                    if (hashed) {
+                        term.exact = hashedSearchToken(*hashKey, tokens[i]);
+                        term.keys.push_back(term.exact);
+                    } else if (i + 1 < tokens.size()) {
+                        term.exact = tokens[i];
+                        term.keys.push_back(term.exact);
+                    } else {
+                        // The last word may not be typed completely yet.
+                        term.exact           = tokens[i];
+                        std::string_view key = term.exact, value;
+                        bool found           = cursor.get(key, value, MDB_SET_RANGE);
+                        while (found && key.substr(0, term.exact.size()) == term.exact &&
+                               term.keys.size() < MAX_SEARCH_PREFIX_EXPANSION) {
+                            term.keys.emplace_back(key);
+                            found = cursor.get(key, value, MDB_NEXT_NODUP);
+                        }
+                    }
+
+                    for (const auto &key : term.keys)
+                        term.postings += postings(key);
+                    if (term.postings == 0)
+                        break;
+                    terms.push_back(std::move(term));
+                }
+                if (terms.size() != tokens.size())
+                    continue;
+
+                // Walk the postings of the rarest word, newest first, and look up the others.
+                const auto &rarest = *std::min_element(
+                  terms.begin(), terms.end(), [](const Term &a, const Term &b) {
+                      return a.postings < b.postings;
+                  });
+
+                std::size_t candidates = 0;
+                for (const auto &driver : rarest.keys) {
+                    std::string_view key = driver, posting;
+                    bool found           = cursor.get(key, posting, MDB_SET) &&
+                                 cursor.get(key, posting, MDB_LAST_DUP);
+                    for (; found && candidates < MAX_SEARCH_CANDIDATES;
+                         found = cursor.get(key, posting, MDB_PREV_DUP), candidates++) {
+                        int total = 0;
+                        for (const auto &term : terms) {
+                            int s = score(term, posting);
+                            if (s == 0) {
+                                total = 0;
+                                break;
+                            }
+                            total += s;
+                        }
 
-            auto relations = mtx::accessors::relations(e);
-            if (!relations.relations.empty()) {
-                for (const auto &r : relations.relations) {
-                    if (!r.event_id.empty()) {
-                        relationsDb.put(txn, r.event_id, event_id);
+                        if (total > 0)
+                            results.push_back({room,
+                                               std::string(posting.substr(sizeof(uint64_t))),
+                                               searchPostingTimestamp(posting),
+                                               total});
                     }
                 }
             }
         }
+
+        // A message may be found through several completions of the last word or in the plain
+        // and the hashed index, keep its best match.
+        std::sort(results.begin(), results.end(), [](const auto &a, const auto &b) {
+            return std::tie(a.room_id, a.event_id, b.score) <
+                   std::tie(b.room_id, b.event_id, a.score);
+        });
+        results.erase(std::unique(results.begin(),
+                                  results.end(),
+                                  [](const auto &a, const auto &b) {
+                                      return a.room_id == b.room_id && a.event_id == b.event_id;
+                                  }),
+                      results.end());
+        std::sort(results.begin(), results.end(), [](const auto &a, const auto &b) {
+            return std::tie(a.score, a.timestamp) > std::tie(b.score, b.timestamp);
+        });
+
+        // Skip redacted messages and messages, that were removed from the cache.
+        std::vector<MessageSearchResult> found;
+        for (auto &result : results) {
+            if (found.size() >= limit)
+                break;
+
+            std::string_view value;
+            if (!getEventsDb(txn, result.room_id).get(txn, result.event_id, value))
+                continue;
+            auto event = cache::parseRecord(value);
+            if (auto unsigned_data = event.find("unsigned");
+                unsigned_data != event.end() && unsigned_data->contains("redacted_by"))
+                continue;
+
+            found.push_back(std::move(result));
+        }
+        return found;
+    } catch (const std::exception &e) {
+        nhlog::db()->warn("failed to search messages: {}", e.what());
+        return {};
+    }
+}
+
+std::optional<LastMessage>
+Cache::lastMessage(const std::string &room_id)
+{
+    auto txn     = ro_txn(env_);
+    auto message = getLastMessage(txn, room_id);
+    if (!message || message->decrypted.is_null())
+        return message;
+
+    auto secret = decryptedEventsKey();
+    if (!secret)
+        return message;
+
+    try {
+        const auto key = decryptedEventKey(room_id, message->event_id);
+        auto encrypted = message->decrypted.get<mtx::secret_storage::AesHmacSha2EncryptedData>();
+        // Empty, if the mac does not match.
+        auto plaintext = mtx::crypto::decrypt(encrypted, *secret, key);
+        if (!plaintext.empty())
+            message->event = json::parse(plaintext);
+    } catch (const std::exception &e) {
+        nhlog::db()->warn("failed to decrypt last message of {}: {}", room_id, e.what());
+    }
+    message->decrypted = nullptr;
+    return message;
+}
+
+void
+Cache::storeLastMessage(const std::string &room_id,
+                        const mtx::events::collections::TimelineEvents &event,
+                        bool encrypted)
+{
+    try {
+        auto txn = GuardedTxn(env_);
+        if (encrypted &&
+            !std::holds_alternative<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(
+              event))
+            saveDecryptedLastMessage(txn, room_id, event);
+        else
+            saveLastMessage(txn, room_id, event, encrypted);
+        txn.commit();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to store last message of {}: {}", room_id, e.what());
     }
 }
 
 uint64_t
 Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Messages &res)
 {
-    auto txn         = lmdb::txn::begin(env_);
+    auto txn         = beginWriteTxn();
     auto eventsDb    = getEventsDb(txn, room_id);
     auto relationsDb = getRelationsDb(txn, room_id);
+    auto searchDb    = getSearchDb(txn, room_id);
 
     auto orderDb     = getEventOrderDb(txn, room_id);
     auto evToOrderDb = getEventToOrderDb(txn, room_id);
@@ -3073,20 +5080,22 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
 
     if (res.chunk.empty()) {
         if (orderDb.get(txn, lmdb::to_sv(index), val)) {
-            auto orderEntry          = json::parse(val);
+            auto orderEntry          = cache::parseRecord(val);
             orderEntry["prev_batch"] = res.end;
-            orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
-            txn.commit();
+            orderDb.put(txn, lmdb::to_sv(index), cache::dumpRecord(orderEntry));
+            commitWriteTxn(txn);
         }
         return index;
     }
 
     std::string event_id_val;
+    uint64_t added = 0, addedBytes = 0;
     for (const auto &e : res.chunk) {
         if (std::holds_alternative<mtx::events::RedactionEvent<mtx::events::msg::Redaction>>(e))
             continue;
 
         auto event                = mtx::accessors::serialize_event(e);
+        auto record               = cache::dumpRecord(event);
         event_id_val              = event["event_id"].get<std::string>();
         std::string_view event_id = event_id_val;
 
@@ -3100,8 +5109,10 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
             json orderEntry        = json::object();
             orderEntry["event_id"] = event_id_val;
 
-            orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
+            orderDb.put(txn, lmdb::to_sv(index), cache::dumpRecord(orderEntry));
             evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
+            added++;
+            addedBytes += record.size();
 
             // TODO(Nico): Allow blacklisting more event types in UI
             if (!isHiddenEvent(txn, e, room_id)) {
@@ -3111,7 +5122,8 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
                 msg2orderDb.put(txn, event_id, lmdb::to_sv(msgIndex));
             }
         }
-        eventsDb.put(txn, event_id, event.dump());
+        eventsDb.put(txn, event_id, record);
+        indexMessage(txn, searchDb, e, std::nullopt);
 
         auto relations = mtx::accessors::relations(e);
         if (!relations.relations.empty()) {
@@ -3126,9 +5138,10 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
     json orderEntry          = json::object();
     orderEntry["event_id"]   = event_id_val;
     orderEntry["prev_batch"] = res.end;
-    orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
+    orderDb.put(txn, lmdb::to_sv(index), cache::dumpRecord(orderEntry));
 
-    txn.commit();
+    commitWriteTxn(txn);
+    noteHistoryGrowth(room_id, added, addedBytes);
 
     return msgIndex;
 }
@@ -3136,7 +5149,7 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
 void
 Cache::clearTimeline(const std::string &room_id)
 {
-    auto txn         = lmdb::txn::begin(env_);
+    auto txn         = GuardedTxn(env_);
     auto eventsDb    = getEventsDb(txn, room_id);
     auto relationsDb = getRelationsDb(txn, room_id);
 
@@ -3144,6 +5157,9 @@ Cache::clearTimeline(const std::string &room_id)
     auto evToOrderDb = getEventToOrderDb(txn, room_id);
     auto msg2orderDb = getMessageToOrderDb(txn, room_id);
     auto order2msgDb = getOrderToMessageDb(txn, room_id);
+    auto searchDb    = getSearchDb(txn, room_id);
+
+    const auto secret = decryptedEventsKey();
 
     std::string_view indexVal, val;
     auto cursor = lmdb::cursor::open(txn, orderDb);
@@ -3155,7 +5171,7 @@ Cache::clearTimeline(const std::string &room_id)
         json obj;
 
         try {
-            obj = json::parse(std::string_view(val.data(), val.size()));
+            obj = cache::parseRecord(val);
         } catch (std::exception &) {
             // workaround bug in the initial db format, where we sometimes didn't store
             // json...
@@ -3167,9 +5183,11 @@ Cache::clearTimeline(const std::string &room_id)
                 std::string event_id = obj["event_id"].get<std::string>();
 
                 if (!event_id.empty()) {
+                    unindexStoredMessage(txn, eventsDb, searchDb, room_id, event_id, secret);
                     evToOrderDb.del(txn, event_id);
                     eventsDb.del(txn, event_id);
                     relationsDb.del(txn, event_id);
+                    decryptedEventsDb_.del(txn, decryptedEventKey(room_id, event_id));
 
                     std::string_view order{};
                     bool exists = msg2orderDb.get(txn, event_id, order);
@@ -3199,7 +5217,7 @@ Cache::clearTimeline(const std::string &room_id)
 
             json obj;
             try {
-                obj = json::parse(std::string_view(eventId.data(), eventId.size()));
+                obj = cache::parseRecord(eventId);
             } catch (std::exception &) {
                 obj = {{"event_id", std::string(eventId.data(), eventId.size())}};
             }
@@ -3223,6 +5241,7 @@ Cache::clearTimeline(const std::string &room_id)
     cursor.close();
     msgCursor.close();
     txn.commit();
+    forgetPruneMark(room_id);
 }
 
 mtx::responses::Notifications
@@ -3269,7 +5288,7 @@ Cache::saveTimelineMentions(const mtx::responses::Notifications &res)
         notifsByRoom[notif.room_id].push_back(notif);
     }
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     // Insert the entire set of mentions for each room at a time.
     QMap<std::string, QList<mtx::responses::Notification>>::const_iterator it =
       notifsByRoom.constBegin();
@@ -3310,7 +5329,7 @@ Cache::saveTimelineMentions(lmdb::txn &txn,
 void
 Cache::markSentNotification(const std::string &event_id)
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     notificationsDb_.put(txn, event_id, "");
     txn.commit();
 }
@@ -3318,7 +5337,7 @@ Cache::markSentNotification(const std::string &event_id)
 void
 Cache::removeReadNotification(const std::string &event_id)
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
 
     notificationsDb_.del(txn, event_id);
 
@@ -3352,71 +5371,308 @@ Cache::getRoomIds(lmdb::txn &txn)
     return rooms;
 }
 
+RetentionPolicy
+Cache::retentionPolicy(const std::string &room_id)
+{
+    try {
+        auto txn = ro_txn(env_);
+        std::string_view value;
+        if (retentionPoliciesDb_.get(txn, room_id, value))
+            return cache::parseRecord(value).get<RetentionPolicy>();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to read the retention policy of {}: {}", room_id, e.what());
+    } catch (const json::exception &e) {
+        nhlog::db()->warn("failed to parse the retention policy of {}: {}", room_id, e.what());
+    }
+
+    RetentionPolicy policy;
+    policy.maxEvents = MAX_RESTORED_MESSAGES;
+    return policy;
+}
+
+void
+Cache::setRetentionPolicy(const std::string &room_id,
+                          const std::optional<RetentionPolicy> &policy)
+{
+    auto txn = GuardedTxn(env_);
+    if (policy)
+        retentionPoliciesDb_.put(txn, room_id, cache::dumpRecord(json(*policy)));
+    else
+        retentionPoliciesDb_.del(txn, room_id);
+    txn.commit();
+}
+
+PruneStatistics
+Cache::pruneStatistics()
+{
+    std::lock_guard lock(pruneMtx_);
+    return pruneStatistics_;
+}
+
+void
+Cache::noteHistoryGrowth(const std::string &room_id, uint64_t events, uint64_t bytes)
+{
+    if (events == 0)
+        return;
+
+    std::lock_guard lock(pruneMtx_);
+    if (auto it = pruneMarks_.find(room_id); it != pruneMarks_.end()) {
+        it->second.events += events;
+        it->second.bytes += bytes;
+    }
+}
+
 void
-Cache::deleteOldMessages()
+Cache::forgetPruneMark(const std::string &room_id)
 {
+    std::lock_guard lock(pruneMtx_);
+    pruneMarks_.erase(room_id);
+}
+
+Cache::PruneMark
+Cache::measureHistory(lmdb::txn &txn, const std::string &room_id)
+{
+    PruneMark mark;
+
+    auto orderDb  = getEventOrderDb(txn, room_id);
+    auto eventsDb = getEventsDb(txn, room_id);
+    auto cursor   = lmdb::cursor::open(txn, orderDb);
+
     std::string_view indexVal, val;
+    if (cursor.get(indexVal, val, MDB_LAST)) {
+        const auto last = lmdb::from_sv<uint64_t>(indexVal);
+        cursor.get(indexVal, val, MDB_FIRST);
+        mark.events = last - lmdb::from_sv<uint64_t>(indexVal) + 1;
 
-    auto txn      = lmdb::txn::begin(env_);
-    auto room_ids = getRoomIds(txn);
+        try {
+            std::string_view event;
+            auto event_id = cache::parseRecord(val).value("event_id", "");
+            if (!event_id.empty() && eventsDb.get(txn, event_id, event))
+                mark.oldestTs = cache::parseRecord(event).value("origin_server_ts", uint64_t{0});
+        } catch (const json::exception &) {
+        }
+    }
+    cursor.close();
 
-    for (const auto &room_id : room_ids) {
+    for (auto kind : {RoomDb::Events,
+                      RoomDb::EventOrder,
+                      RoomDb::EventToOrder,
+                      RoomDb::MessageToOrder,
+                      RoomDb::OrderToMessage,
+                      RoomDb::Related,
+                      RoomDb::Search})
+        mark.bytes += databaseBytes(txn, getRoomDb(txn, room_id, kind));
+
+    return mark;
+}
+
+bool
+Cache::pruneRoom(const std::string &room_id,
+                 const RetentionPolicy &policy,
+                 const QDeadlineTimer &deadline)
+{
+    const auto secret = decryptedEventsKey();
+    const uint64_t cutoff =
+      policy.maxAge ? QDateTime::currentMSecsSinceEpoch() - policy.maxAge * 1000 : 0;
+
+    for (;;) {
+        auto txn         = beginWriteTxn();
         auto orderDb     = getEventOrderDb(txn, room_id);
         auto evToOrderDb = getEventToOrderDb(txn, room_id);
         auto o2m         = getOrderToMessageDb(txn, room_id);
         auto m2o         = getMessageToOrderDb(txn, room_id);
         auto eventsDb    = getEventsDb(txn, room_id);
         auto relationsDb = getRelationsDb(txn, room_id);
-        auto cursor      = lmdb::cursor::open(txn, orderDb);
+        auto searchDb    = getSearchDb(txn, room_id);
 
-        uint64_t first, last;
-        if (cursor.get(indexVal, val, MDB_LAST)) {
-            last = lmdb::from_sv<uint64_t>(indexVal);
-        } else {
-            continue;
-        }
-        if (cursor.get(indexVal, val, MDB_FIRST)) {
-            first = lmdb::from_sv<uint64_t>(indexVal);
-        } else {
-            continue;
+        const auto before = measureHistory(txn, room_id);
+
+        // Events deleted regardless of their age, the bytes are estimated per event.
+        uint64_t excess = 0;
+        if (policy.maxEvents && before.events > policy.maxEvents)
+            excess = before.events - policy.maxEvents;
+        if (policy.maxBytes && before.bytes > policy.maxBytes && before.events > 0) {
+            const auto perEvent = std::max<uint64_t>(before.bytes / before.events, 1);
+            excess = std::max(excess, (before.bytes - policy.maxBytes + perEvent - 1) / perEvent);
         }
 
-        size_t message_count = static_cast<size_t>(last - first);
-        if (message_count < MAX_RESTORED_MESSAGES)
-            continue;
+        std::size_t deleted = 0;
+        auto cursor         = lmdb::cursor::open(txn, orderDb);
+        std::string_view indexVal, val;
+        while (deleted < PRUNE_BATCH_SIZE && cursor.get(indexVal, val, MDB_FIRST)) {
+            std::string event_id;
+            std::optional<mtx::events::collections::TimelineEvents> event;
+            try {
+                event_id = cache::parseRecord(val).value("event_id", "");
 
-        bool start = true;
-        while (cursor.get(indexVal, val, start ? MDB_FIRST : MDB_NEXT) &&
-               message_count-- > MAX_RESTORED_MESSAGES) {
-            start    = false;
-            auto obj = json::parse(std::string_view(val.data(), val.size()));
+                std::string_view record;
+                if (!event_id.empty() && eventsDb.get(txn, event_id, record)) {
+                    mtx::events::collections::TimelineEvent te;
+                    mtx::events::collections::from_json(cache::parseRecord(record), te);
+                    event = std::move(te.data);
+                }
+            } catch (const std::exception &e) {
+                nhlog::db()->warn("failed to parse event {} while pruning: {}", event_id, e.what());
+            }
+
+            if (deleted >= excess &&
+                (!cutoff || (event && static_cast<uint64_t>(
+                                        mtx::accessors::origin_server_ts(*event)
+                                          .toMSecsSinceEpoch()) >= cutoff)))
+                break;
+
+            if (!event_id.empty()) {
+                if (event) {
+                    unindexMessage(txn, searchDb, *event, std::nullopt);
+                    if (secret)
+                        if (auto decrypted = getDecryptedEvent(txn, room_id, event_id, *secret))
+                            unindexMessage(txn, searchDb, *decrypted, searchTokensKey());
+                }
 
-            if (obj.count("event_id") != 0) {
-                std::string event_id = obj["event_id"].get<std::string>();
                 evToOrderDb.del(txn, event_id);
                 eventsDb.del(txn, event_id);
-
+                decryptedEventsDb_.del(txn, decryptedEventKey(room_id, event_id));
                 relationsDb.del(txn, event_id);
 
                 std::string_view order{};
-                bool exists = m2o.get(txn, event_id, order);
-                if (exists) {
+                if (m2o.get(txn, event_id, order)) {
                     o2m.del(txn, order);
                     m2o.del(txn, event_id);
                 }
             }
             cursor.del();
+            ++deleted;
         }
         cursor.close();
+
+        const auto after = measureHistory(txn, room_id);
+        commitWriteTxn(txn);
+
+        {
+            std::lock_guard lock(pruneMtx_);
+            pruneMarks_[room_id] = after;
+            if (deleted > 0) {
+                pruneStatistics_.eventsDeleted += deleted;
+                if (before.bytes > after.bytes)
+                    pruneStatistics_.bytesReclaimed += before.bytes - after.bytes;
+            }
+        }
+
+        if (deleted < PRUNE_BATCH_SIZE)
+            return true;
+        if (deadline.hasExpired())
+            return false;
     }
-    txn.commit();
+}
+
+bool
+Cache::pruneHistory(QDeadlineTimer deadline, bool toLimit)
+{
+    if (!databaseReady_)
+        return false;
+
+    std::vector<std::string> room_ids;
+    {
+        auto txn = ro_txn(env_);
+        room_ids = getRoomIds(txn);
+    }
+    if (room_ids.empty())
+        return false;
+
+    // Continue with the room the last run stopped at, so that every room gets its turn.
+    std::size_t start = 0;
+    {
+        std::lock_guard lock(pruneMtx_);
+        start = std::lower_bound(room_ids.begin(), room_ids.end(), pruneCursor_) -
+                room_ids.begin();
+    }
+
+    const auto now = static_cast<uint64_t>(QDateTime::currentMSecsSinceEpoch());
+    for (std::size_t i = 0; i < room_ids.size(); i++) {
+        const auto &room_id = room_ids[(start + i) % room_ids.size()];
+
+        if (deadline.hasExpired()) {
+            std::lock_guard lock(pruneMtx_);
+            pruneCursor_ = room_id;
+            return true;
+        }
+
+        const auto policy = retentionPolicy(room_id);
+        if (!policy.maxEvents && !policy.maxAge && !policy.maxBytes)
+            continue;
+
+        std::optional<PruneMark> mark;
+        {
+            std::lock_guard lock(pruneMtx_);
+            if (auto it = pruneMarks_.find(room_id); it != pruneMarks_.end())
+                mark = it->second;
+        }
+        if (!mark) {
+            // A write transaction, since databases of the room may not exist yet.
+            auto txn = beginWriteTxn();
+            mark     = measureHistory(txn, room_id);
+            commitWriteTxn(txn);
+
+            std::lock_guard lock(pruneMtx_);
+            pruneMarks_[room_id] = *mark;
+        }
+
+        // Rooms are only pruned, once they exceed a limit by a tenth, so that rooms at their
+        // limit are not pruned by a few events on every run.
+        const auto slack    = [toLimit](uint64_t limit) { return toLimit ? 0 : limit / 10; };
+        const bool exceeded =
+          (policy.maxEvents && mark->events > policy.maxEvents + slack(policy.maxEvents)) ||
+          (policy.maxBytes && mark->bytes > policy.maxBytes + slack(policy.maxBytes)) ||
+          (policy.maxAge && mark->oldestTs &&
+           mark->oldestTs + (policy.maxAge + slack(policy.maxAge)) * 1000 < now);
+        if (!exceeded)
+            continue;
+
+        if (!pruneRoom(room_id, policy, deadline)) {
+            std::lock_guard lock(pruneMtx_);
+            pruneCursor_ = room_id;
+            return true;
+        }
+
+        std::lock_guard lock(pruneMtx_);
+        pruneStatistics_.roomsPruned++;
+    }
+
+    return false;
+}
+
+void
+Cache::pruneNextRooms()
+{
+    if (pruning_ || !isDatabaseReady())
+        return;
+
+    pruning_ = true;
+    runOnWriterThread([this]() {
+        bool remaining = false;
+        try {
+            remaining = pruneHistory(QDeadlineTimer(PRUNE_SLICE_MS));
+        } catch (const lmdb::error &e) {
+            nhlog::db()->error("failed to delete old messages: {}", e.what());
+        }
+
+        QMetaObject::invokeMethod(
+          this,
+          [this, remaining]() {
+              pruning_ = false;
+              // Syncs queued in the mean time are written, before the next rooms are pruned.
+              if (remaining)
+                  QTimer::singleShot(PRUNE_PAUSE_MS, this, &Cache::pruneNextRooms);
+          },
+          Qt::QueuedConnection);
+    });
 }
 
 void
 Cache::deleteOldData() noexcept
 {
     try {
-        deleteOldMessages();
+        pruneHistory(QDeadlineTimer(QDeadlineTimer::Forever), true);
     } catch (const lmdb::error &e) {
         nhlog::db()->error("failed to delete old messages: {}", e.what());
     }
@@ -3510,7 +5766,7 @@ Cache::spaces()
             if (!space_child.empty()) {
                 std::string_view room_data;
                 if (roomsDb_.get(txn, space_id, room_data)) {
-                    RoomInfo tmp = json::parse(std::move(room_data));
+                    RoomInfo tmp = cache::parseRecord(room_data);
                     ret.insert(QString::fromUtf8(space_id.data(), space_id.size()), tmp);
                 } else {
                     ret.insert(QString::fromUtf8(space_id.data(), space_id.size()), std::nullopt);
@@ -3676,7 +5932,7 @@ Cache::hasEnoughPowerLevel(const std::vector<mtx::events::EventType> &eventTypes
     using namespace mtx::events;
     using namespace mtx::events::state;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getStatesDb(txn, room_id);
 
     int64_t min_event_level = std::numeric_limits<int64_t>::max();
@@ -3687,7 +5943,7 @@ Cache::hasEnoughPowerLevel(const std::vector<mtx::events::EventType> &eventTypes
 
     if (res) {
         try {
-            StateEvent<PowerLevels> msg = json::parse(std::string_view(event.data(), event.size()));
+            StateEvent<PowerLevels> msg = cache::parseRecord(event);
 
             user_level = msg.content.user_level(user_id);
 
@@ -3727,7 +5983,7 @@ Cache::roomVerificationStatus(const std::string &room_id)
     crypto::Trust trust = crypto::Verified;
 
     try {
-        auto txn = lmdb::txn::begin(env_);
+        auto txn = GuardedTxn(env_);
 
         auto db     = getMembersDb(txn, room_id);
         auto keysDb = getUserKeysDb(txn);
@@ -3868,7 +6124,7 @@ Cache::presenceState(const std::string &user_id)
 
     std::string_view presenceVal;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getPresenceDb(txn);
     auto res = db.get(txn, user_id, presenceVal);
 
@@ -3893,7 +6149,7 @@ Cache::statusMessage(const std::string &user_id)
 
     std::string_view presenceVal;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getPresenceDb(txn);
     auto res = db.get(txn, user_id, presenceVal);
 
@@ -3967,7 +6223,7 @@ Cache::userKeys_(const std::string &user_id, lmdb::txn &txn)
 void
 Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::QueryKeys &keyQuery)
 {
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getUserKeysDb(txn);
 
     std::map<std::string, UserKeyCache> updates;
@@ -4117,7 +6373,7 @@ void
 Cache::markUserKeysOutOfDate(const std::vector<std::string> &user_ids)
 {
     auto currentBatchToken = nextBatchToken();
-    auto txn               = lmdb::txn::begin(env_);
+    auto txn               = GuardedTxn(env_);
     auto db                = getUserKeysDb(txn);
     markUserKeysOutOfDate(txn, db, user_ids, currentBatchToken);
     txn.commit();
@@ -4226,6 +6482,83 @@ Cache::query_keys(const std::string &user_id,
       });
 }
 
+void
+Cache::query_keys(
+  const std::vector<std::string> &user_ids,
+  std::function<void(const std::string &, const UserKeyCache &, mtx::http::RequestErr)> cb)
+{
+    std::vector<std::pair<std::string, UserKeyCache>> upToDate;
+    // Users are queried together, if their keys were marked outdated by the same sync.
+    std::map<std::string, mtx::requests::QueryKeys> requests;
+    {
+        auto txn = ro_txn(env_);
+        for (const auto &user_id : user_ids) {
+            auto cache_ = userKeys_(user_id, txn);
+            if (cache_ && cache_->updated_at == cache_->last_changed) {
+                upToDate.emplace_back(user_id, std::move(*cache_));
+                continue;
+            }
+
+            auto last_changed        = cache_ ? cache_->last_changed : std::string();
+            auto &req                = requests[last_changed];
+            req.token                = last_changed;
+            req.device_keys[user_id] = {};
+        }
+    }
+
+    for (const auto &[user_id, keys] : upToDate)
+        cb(user_id, keys, {});
+
+    for (auto &[last_changed, req] : requests) {
+        nhlog::db()->info("Querying keys of {} users", req.device_keys.size());
+
+        auto pending = std::make_shared<std::set<std::string>>();
+        for (const auto &[user_id, devices] : req.device_keys) {
+            (void)devices;
+            pending->insert(user_id);
+        }
+
+        // use context object so that we can disconnect again
+        QObject *context{new QObject(this)};
+        QObject::connect(
+          this,
+          &Cache::verificationStatusChanged,
+          context,
+          [cb, pending, context_ = context, this](std::string updated_user) {
+              if (pending->erase(updated_user) == 0)
+                  return;
+
+              auto txn  = ro_txn(env_);
+              auto keys = this->userKeys_(updated_user, txn);
+              cb(updated_user, keys.value_or(UserKeyCache{}), {});
+
+              if (pending->empty())
+                  context_->deleteLater();
+          },
+          Qt::QueuedConnection);
+
+        http::client()->query_keys(
+          req,
+          [cb, pending, context, last_changed = last_changed, this](
+            const mtx::responses::QueryKeys &res, mtx::http::RequestErr err) {
+              if (err) {
+                  nhlog::net()->warn("failed to query device keys: {},{}",
+                                     mtx::errors::to_string(err->matrix_error.errcode),
+                                     static_cast<int>(err->status_code));
+                  QMetaObject::invokeMethod(context, [cb, pending, context, err]() {
+                      for (const auto &user_id : *pending)
+                          cb(user_id, {}, err);
+                      pending->clear();
+                      context->deleteLater();
+                  });
+                  return;
+              }
+
+              emit userKeysUpdate(last_changed, res);
+          });
+    }
+}
+
 void
 to_json(json &j, const VerificationCache &info)
 {
@@ -4281,7 +6614,7 @@ Cache::markDeviceVerified(const std::string &user_id, const std::string &key)
     {
         std::string_view val;
 
-        auto txn = lmdb::txn::begin(env_);
+        auto txn = GuardedTxn(env_);
         auto db  = getVerificationDb(txn);
 
         try {
@@ -4328,7 +6661,7 @@ Cache::markDeviceUnverified(const std::string &user_id, const std::string &key)
 {
     std::string_view val;
 
-    auto txn = lmdb::txn::begin(env_);
+    auto txn = GuardedTxn(env_);
     auto db  = getVerificationDb(txn);
 
     try {
@@ -4557,6 +6890,58 @@ from_json(const json &j, ReadReceiptKey &key)
     key.room_id  = j.at("room_id").get<std::string>();
 }
 
+void
+to_json(json &j, const LastMessage &message)
+{
+    j["event_id"]  = message.event_id;
+    j["sender"]    = message.sender;
+    j["ts"]        = message.timestamp;
+    j["encrypted"] = message.encrypted;
+    j["event"]     = message.event;
+    if (!message.decrypted.is_null())
+        j["decrypted"] = message.decrypted;
+}
+
+void
+from_json(const json &j, LastMessage &message)
+{
+    message.event_id  = j.at("event_id").get<std::string>();
+    message.sender    = j.at("sender").get<std::string>();
+    message.timestamp = j.at("ts").get<uint64_t>();
+    message.encrypted = j.value("encrypted", false);
+    message.event     = j.at("event");
+    message.decrypted = j.value("decrypted", json());
+}
+
+DatabaseStatistics &
+DatabaseStatistics::operator+=(const DatabaseStatistics &other)
+{
+    databases += other.databases;
+    entries += other.entries;
+    depth = std::max(depth, other.depth);
+    branchPages += other.branchPages;
+    leafPages += other.leafPages;
+    overflowPages += other.overflowPages;
+    bytes += other.bytes;
+    return *this;
+}
+
+void
+to_json(json &j, const RetentionPolicy &policy)
+{
+    j["max_events"] = policy.maxEvents;
+    j["max_age"]    = policy.maxAge;
+    j["max_bytes"]  = policy.maxBytes;
+}
+
+void
+from_json(const json &j, RetentionPolicy &policy)
+{
+    policy.maxEvents = j.value("max_events", uint64_t{0});
+    policy.maxAge    = j.value("max_age", uint64_t{0});
+    policy.maxBytes  = j.value("max_bytes", uint64_t{0});
+}
+
 void
 to_json(json &j, const MemberInfo &info)
 {
@@ -4574,6 +6959,113 @@ from_json(const json &j, MemberInfo &info)
     info.is_direct  = j.value("is_direct", false);
 }
 
+namespace {
+constexpr char MEMBER_RECORD_VERSION            = 1;
+constexpr std::size_t MEMBER_RECORD_HEADER_SIZE = 6;
+}
+
+std::string
+encodeMemberInfo(const MemberInfo &info)
+{
+    const auto nameSize = static_cast<std::uint32_t>(info.name.size());
+
+    std::string record;
+    record.reserve(MEMBER_RECORD_HEADER_SIZE + info.name.size() + info.avatar_url.size());
+    record.push_back(MEMBER_RECORD_VERSION);
+    record.push_back(info.is_direct ? 1 : 0);
+    for (int i = 0; i < 4; i++)
+        record.push_back(static_cast<char>((nameSize >> (8 * i)) & 0xff));
+    record += info.name;
+    record += info.avatar_url;
+
+    return record;
+}
+
+MemberInfo
+decodeMemberInfo(std::string_view data)
+{
+    if (!data.empty() && data.front() == '{')
+        return json::parse(data).get<MemberInfo>();
+
+    if (data.size() < MEMBER_RECORD_HEADER_SIZE || data[0] != MEMBER_RECORD_VERSION)
+        throw std::runtime_error("malformed member record");
+
+    std::uint32_t nameSize = 0;
+    for (int i = 0; i < 4; i++)
+        nameSize |= std::uint32_t{static_cast<unsigned char>(data[2 + i])} << (8 * i);
+
+    if (data.size() - MEMBER_RECORD_HEADER_SIZE < nameSize)
+        throw std::runtime_error("truncated member record");
+
+    MemberInfo info;
+    info.is_direct  = data[1] & 1;
+    info.name       = data.substr(MEMBER_RECORD_HEADER_SIZE, nameSize);
+    info.avatar_url = data.substr(MEMBER_RECORD_HEADER_SIZE + nameSize);
+
+    return info;
+}
+
+namespace cache {
+json
+parseRecord(std::string_view data)
+{
+    // JSON records are objects, while CBOR encodes maps starting at 0xa0.
+    if (!data.empty() && data.front() == '{')
+        return json::parse(data);
+
+    return json::from_cbor(data.data(), data.data() + data.size());
+}
+
+std::string
+dumpRecord(const json &j)
+{
+    std::string record;
+    json::to_cbor(j, record);
+    return record;
+}
+
+std::string
+compositeKey(std::initializer_list<std::string_view> parts)
+{
+    std::size_t size = 0;
+    for (const auto &part : parts)
+        size += 2 + part.size();
+
+    std::string key;
+    key.reserve(size);
+    for (const auto &part : parts) {
+        if (part.size() > std::numeric_limits<std::uint16_t>::max())
+            throw std::length_error("key part too long");
+
+        key.push_back(static_cast<char>(part.size() >> 8));
+        key.push_back(static_cast<char>(part.size() & 0xff));
+        key += part;
+    }
+
+    return key;
+}
+
+std::optional<std::vector<std::string_view>>
+splitCompositeKey(std::string_view key)
+{
+    std::vector<std::string_view> parts;
+    while (!key.empty()) {
+        if (key.size() < 2)
+            return std::nullopt;
+
+        const auto size = std::size_t{static_cast<unsigned char>(key[0])} << 8 |
+                          static_cast<unsigned char>(key[1]);
+        if (key.size() - 2 < size)
+            return std::nullopt;
+
+        parts.push_back(key.substr(2, size));
+        key.remove_prefix(2 + size);
+    }
+
+    return parts;
+}
+}
+
 void
 to_json(nlohmann::json &obj, const DeviceKeysToMsgIndex &msg)
 {
@@ -4659,6 +7151,26 @@ from_json(const nlohmann::json &obj, MegolmSessionIndex &msg)
     msg.sender_key = obj.at("sender_key");
 }
 
+std::string
+megolmSessionKey(const MegolmSessionIndex &index)
+{
+    return cache::compositeKey({index.room_id, index.sender_key, index.session_id});
+}
+
+std::optional<MegolmSessionIndex>
+megolmSessionIndexFromKey(std::string_view key)
+{
+    auto parts = cache::splitCompositeKey(key);
+    if (!parts || parts->size() != 3)
+        return std::nullopt;
+
+    MegolmSessionIndex index;
+    index.room_id    = (*parts)[0];
+    index.sender_key = (*parts)[1];
+    index.session_id = (*parts)[2];
+    return index;
+}
+
 void
 to_json(nlohmann::json &obj, const StoredOlmSession &msg)
 {
@@ -4765,6 +7277,11 @@ roomInfo(bool withInvites)
 {
     return instance_->roomInfo(withInvites);
 }
+std::shared_ptr<const RoomSummaries>
+roomSummaries()
+{
+    return instance_->roomSummaries();
+}
 QHash<QString, RoomInfo>
 invites()
 {
@@ -4989,12 +7506,7 @@ saveTimelineMentions(const mtx::responses::Notifications &res)
     instance_->saveTimelineMentions(res);
 }
 
-//! Remove old unused data.
-void
-deleteOldMessages()
-{
-    instance_->deleteOldMessages();
-}
+//! Prune the history of all rooms, see Cache::pruneHistory().
 void
 deleteOldData() noexcept
 {
@@ -5070,6 +7582,12 @@ exportSessionKeys()
     return instance_->exportSessionKeys();
 }
 
+void
+clearDecryptedEvents()
+{
+    instance_->clearDecryptedEvents();
+}
+
 //
 // Inbound Megolm Sessions
 //
@@ -62,6 +62,8 @@ joinedRooms();
 
 QMap<QString, RoomInfo>
 roomInfo(bool withInvites = true);
+std::shared_ptr<const RoomSummaries>
+roomSummaries();
 QHash<QString, RoomInfo>
 invites();
 
@@ -179,9 +181,7 @@ isNotificationSent(const std::string &event_id);
 void
 saveTimelineMentions(const mtx::responses::Notifications &res);
 
-//! Remove old unused data.
-void
-deleteOldMessages();
+//! Prune the history of all rooms, see Cache::pruneHistory().
 void
 deleteOldData() noexcept;
 //! Retrieve all saved room ids.
@@ -221,6 +221,10 @@ importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
 mtx::crypto::ExportedSessionKeys
 exportSessionKeys();
 
+//! Deletes the decrypted events stored on disk.
+void
+clearDecryptedEvents();
+
 //
 // Inbound Megolm Sessions
 //
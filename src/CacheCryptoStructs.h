@@ -8,7 +8,9 @@
 
 #include <map>
 #include <mutex>
+#include <optional>
 #include <set>
+#include <string_view>
 
 #include <mtx/events/encrypted.hpp>
 #include <mtx/responses/crypto.hpp>
@@ -74,6 +76,15 @@ struct OutboundGroupSessionDataRef
     GroupSessionData data;
 };
 
+//! An unpickled inbound session kept in memory by the cache. Lock mtx while using the session or
+//! the data.
+struct InboundGroupSessionDataRef
+{
+    std::mutex mtx;
+    mtx::crypto::InboundGroupSessionPtr session;
+    GroupSessionData data;
+};
+
 struct DevicePublicKeys
 {
     std::string ed25519;
@@ -108,6 +119,12 @@ to_json(nlohmann::json &obj, const MegolmSessionIndex &msg);
 void
 from_json(const nlohmann::json &obj, MegolmSessionIndex &msg);
 
+//! Key of a megolm session in the session tables.
+std::string
+megolmSessionKey(const MegolmSessionIndex &index);
+std::optional<MegolmSessionIndex>
+megolmSessionIndexFromKey(std::string_view key);
+
 struct StoredOlmSession
 {
     std::uint64_t last_message_ts = 0;
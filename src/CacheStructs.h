@@ -6,9 +6,15 @@
 
 #include <QDateTime>
 #include <QImage>
+#include <QMap>
 #include <QString>
 
+#include <initializer_list>
+#include <map>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <mtx/events/join_rules.hpp>
 #include <mtx/events/mscs/image_packs.hpp>
@@ -20,6 +26,21 @@ enum class CacheVersion : int
     Current = 0,
     Newer   = 1,
 };
+
+//! Values in the cache databases are stored as CBOR. Caches written by older versions contain
+//! JSON text, which is still accepted when reading.
+nlohmann::json
+parseRecord(std::string_view data);
+std::string
+dumpRecord(const nlohmann::json &j);
+
+//! Builds a deterministic binary database key. Every part is prefixed with its length as a 16 bit
+//! big endian integer, so keys sharing their leading parts are stored next to each other.
+std::string
+compositeKey(std::initializer_list<std::string_view> parts);
+//! Splits a key built by compositeKey, std::nullopt if the key is malformed.
+std::optional<std::vector<std::string_view>>
+splitCompositeKey(std::string_view key);
 }
 
 struct RoomMember
@@ -29,7 +50,8 @@ struct RoomMember
     bool is_direct = false;
 };
 
-//! Used to uniquely identify a list of read receipts.
+//! Used to uniquely identify a list of read receipts. Only used to migrate the JSON keys of older
+//! caches, the database key is cache::compositeKey({room_id, event_id}).
 struct ReadReceiptKey
 {
     std::string event_id;
@@ -65,6 +87,101 @@ operator!=(const DescInfo &a, const DescInfo &b)
            std::tie(b.timestamp, b.event_id, b.userid, b.body, b.descriptiveTime);
 }
 
+//! A message found by Cache::searchMessages().
+struct MessageSearchResult
+{
+    std::string room_id, event_id;
+    uint64_t timestamp = 0;
+    //! Messages matching the words exactly score higher than those matching only a prefix.
+    int score = 0;
+};
+
+//! How much history of a room is kept in the cache. Once a limit is exceeded, the oldest events
+//! are deleted, see Cache::pruneHistory(). 0 disables a limit.
+struct RetentionPolicy
+{
+    uint64_t maxEvents = 0;
+    //! Maximum age of an event in seconds.
+    uint64_t maxAge = 0;
+    //! Maximum size of the timeline databases of the room.
+    uint64_t maxBytes = 0;
+};
+
+void
+to_json(nlohmann::json &j, const RetentionPolicy &policy);
+void
+from_json(const nlohmann::json &j, RetentionPolicy &policy);
+
+//! Work done by Cache::pruneHistory() since the start.
+struct PruneStatistics
+{
+    uint64_t roomsPruned    = 0;
+    uint64_t eventsDeleted  = 0;
+    uint64_t bytesReclaimed = 0;
+};
+
+//! Size of one or more LMDB databases, as reported by mdb_stat.
+struct DatabaseStatistics
+{
+    uint64_t databases = 0;
+    uint64_t entries   = 0;
+    //! Maximum depth of the B-trees.
+    uint64_t depth         = 0;
+    uint64_t branchPages   = 0;
+    uint64_t leafPages     = 0;
+    uint64_t overflowPages = 0;
+    uint64_t bytes         = 0;
+
+    DatabaseStatistics &operator+=(const DatabaseStatistics &other);
+};
+
+struct RoomStatistics
+{
+    std::string room_id;
+    //! The databases of the room by kind, see CacheStatistics::kinds.
+    std::map<std::string, DatabaseStatistics> kinds;
+    DatabaseStatistics total;
+};
+
+//! What the cache contains, see Cache::statistics().
+struct CacheStatistics
+{
+    uint64_t pageSize = 0;
+    uint64_t mapSize  = 0;
+    //! Size of the data file, including the free pages.
+    uint64_t fileSize = 0;
+    uint64_t freeSize = 0;
+    //! Every database by name.
+    std::map<std::string, DatabaseStatistics> databases;
+    //! The databases of all rooms added up by kind, like "events", "state" or "members", and
+    //! the shared databases by what they store, like "receipts" or "megolm".
+    std::map<std::string, DatabaseStatistics> kinds;
+    //! The rooms using the most space, the largest first.
+    std::vector<RoomStatistics> heaviestRooms;
+    PruneStatistics pruning;
+};
+
+//! The last message of a room, that is shown in the room list. Stored when the timeline is
+//! saved, so that the room list does not need to search or decrypt the timeline on startup.
+struct LastMessage
+{
+    std::string event_id;
+    std::string sender;
+    uint64_t timestamp = 0;
+    //! Whether the message was sent encrypted.
+    bool encrypted = false;
+    //! The event with a shortened body, as it was sent.
+    nlohmann::json event;
+    //! The decrypted event with a shortened body, encrypted like the stored decrypted events.
+    //! Only set if decrypted messages are stored.
+    nlohmann::json decrypted;
+};
+
+void
+to_json(nlohmann::json &j, const LastMessage &message);
+void
+from_json(const nlohmann::json &j, LastMessage &message);
+
 //! UI info associated with a room.
 struct RoomInfo
 {
@@ -94,6 +211,23 @@ to_json(nlohmann::json &j, const RoomInfo &info);
 void
 from_json(const nlohmann::json &j, RoomInfo &info);
 
+//! The rooms as shown in the room list and the communities sidebar, read in a single read only
+//! transaction. Shared by all consumers, until the next write to the cache.
+struct RoomSummaries
+{
+    //! Joined rooms and invites. Join rules and guest access are not read.
+    QMap<QString, RoomInfo> infos;
+    //! The parent spaces of all rooms, that have any.
+    std::map<std::string, std::vector<std::string>, std::less<>> parents;
+
+    const std::vector<std::string> &parentSpaces(std::string_view room_id) const
+    {
+        static const std::vector<std::string> none;
+        auto it = parents.find(room_id);
+        return it != parents.end() ? it->second : none;
+    }
+};
+
 //! Basic information per member.
 struct MemberInfo
 {
@@ -107,6 +241,15 @@ to_json(nlohmann::json &j, const MemberInfo &info);
 void
 from_json(const nlohmann::json &j, MemberInfo &info);
 
+//! Members are the most frequently read records, so they use a flat format, that is decoded
+//! directly from the database memory: a version byte, a flags byte, the length of the name as
+//! 32 bit little endian integer, the name and the avatar url.
+std::string
+encodeMemberInfo(const MemberInfo &info);
+//! Throws std::runtime_error on a malformed record. Accepts the JSON of older caches.
+MemberInfo
+decodeMemberInfo(std::string_view data);
+
 struct RoomSearchResult
 {
     std::string room_id;
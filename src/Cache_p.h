@@ -6,13 +6,25 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <unordered_map>
 
 #include <QDateTime>
+#include <QDeadlineTimer>
 #include <QDir>
 #include <QImage>
 #include <QString>
+#include <QThread>
+#include <QTimer>
 
 #if __has_include(<lmdbxx/lmdb++.h>)
 #include <lmdbxx/lmdb++.h>
@@ -31,12 +43,43 @@
 #include "CacheStructs.h"
 #include "Logging.h"
 
+//! Held by every transaction of the cache while it runs, since the map of the environment may
+//! only be resized, while no transaction is running. A thread can hold it several times.
+class TransactionGuard
+{
+public:
+    TransactionGuard();
+    TransactionGuard(const TransactionGuard &);
+    ~TransactionGuard();
+    TransactionGuard &operator=(const TransactionGuard &) = delete;
+
+    //! Runs fn, if no transaction is running in any thread. Returns false otherwise.
+    static bool tryExclusive(const std::function<void()> &fn);
+};
+
+//! A transaction, during which the map of the environment is not resized.
+class GuardedTxn
+  : private TransactionGuard
+  , public lmdb::txn
+{
+public:
+    explicit GuardedTxn(lmdb::env &env, unsigned int flags = 0)
+      : TransactionGuard()
+      , lmdb::txn(lmdb::txn::begin(env, nullptr, flags))
+    {}
+};
+
 class Cache : public QObject
 {
     Q_OBJECT
 
 public:
     Cache(const QString &userId, QObject *parent = nullptr);
+    ~Cache() override;
+
+    //! Queues fn on the database writer thread. Functions run there one after another, in the
+    //! order they were queued. If blocking is set, this waits until fn has run.
+    void runOnWriterThread(std::function<void()> fn, bool blocking = false);
 
     std::string displayName(const std::string &room_id, const std::string &user_id);
     QString displayName(const QString &room_id, const QString &user_id);
@@ -57,6 +100,11 @@ public:
                                const std::string &sync_token);
     void query_keys(const std::string &user_id,
                     std::function<void(const UserKeyCache &, mtx::http::RequestErr)> cb);
+    //! Same as above for several users. Outdated keys are fetched with one request per sync
+    //! token they were marked outdated at, cb is called once per user.
+    void query_keys(
+      const std::vector<std::string> &user_ids,
+      std::function<void(const std::string &, const UserKeyCache &, mtx::http::RequestErr)> cb);
 
     // device & user verification cache
     std::optional<UserKeyCache> userKeys(const std::string &user_id);
@@ -68,6 +116,8 @@ public:
     std::vector<std::string> joinedRooms();
 
     QMap<QString, RoomInfo> roomInfo(bool withInvites = true);
+    //! All rooms and their parent spaces, only read again after the cache was written to.
+    std::shared_ptr<const RoomSummaries> roomSummaries();
     std::optional<mtx::events::state::CanonicalAlias> getRoomAliases(const std::string &roomid);
     QHash<QString, RoomInfo> invites();
     std::optional<RoomInfo> invite(std::string_view roomid);
@@ -92,13 +142,13 @@ public:
     std::optional<mtx::events::StateEvent<T>>
     getStateEvent(const std::string &room_id, std::string_view state_key = "")
     {
-        auto txn = lmdb::txn::begin(env_, nullptr, MDB_RDONLY);
+        auto txn = GuardedTxn(env_, MDB_RDONLY);
         return getStateEvent<T>(txn, room_id, state_key);
     }
     template<typename T>
     std::vector<mtx::events::StateEvent<T>> getStateEventsWithType(const std::string &room_id)
     {
-        auto txn = lmdb::txn::begin(env_, nullptr, MDB_RDONLY);
+        auto txn = GuardedTxn(env_, MDB_RDONLY);
         return getStateEventsWithType<T>(txn, room_id);
     }
 
@@ -117,8 +167,26 @@ public:
     size_t memberCount(const std::string &room_id);
 
     void saveState(const mtx::responses::Sync &res);
+    //! Saves the response of the initial sync. Joined rooms are committed in batches.
+    void saveInitialState(const mtx::responses::Sync &res);
     bool isInitialized();
     bool isDatabaseReady() { return databaseReady_ && isInitialized(); }
+    //! Resolves the handles of all per room databases of every joined room, so that read
+    //! transactions find them cached and don't need to open them exclusively.
+    void preloadRoomDbs();
+
+    //! Raw LMDB environment statistics, used for diagnostics and benchmarks.
+    MDB_stat environmentStat();
+    MDB_envinfo environmentInfo();
+    //! Grows the map of the environment, if the data file uses most of it, or always with force.
+    //! Needs to be called without a transaction on this thread. Waits until wait expired for
+    //! running transactions to end. Returns false, if the map was not grown.
+    bool growMap(bool force, QDeadlineTimer wait = QDeadlineTimer(0));
+    //! Size of every database, added up per room and per kind, for diagnostics.
+    CacheStatistics statistics(std::size_t heaviestRooms);
+    //! Same as statistics(), for the cache of a user, that is not opened by a Cache. The cache
+    //! is opened read only. Throws std::runtime_error, if it can't be read.
+    static CacheStatistics readStatistics(const QString &userId, std::size_t heaviestRooms);
 
     std::string nextBatchToken();
 
@@ -204,6 +272,23 @@ public:
         uint64_t first, last;
     };
     std::optional<TimelineRange> getTimelineRange(const std::string &room_id);
+    //! The message shown in the room list, std::nullopt if none was stored yet.
+    std::optional<LastMessage> lastMessage(const std::string &room_id);
+    //! Stores the last message of a room, i.e. after it was decrypted.
+    void storeLastMessage(const std::string &room_id,
+                          const mtx::events::collections::TimelineEvents &event,
+                          bool encrypted);
+    //! Decrypted events stored by storeDecryptedEvents(), so that they don't need to be
+    //! decrypted again after a restart.
+    std::optional<mtx::events::collections::TimelineEvents>
+    getDecryptedEvent(const std::string &room_id, const std::string &event_id);
+    void storeDecryptedEvents(const std::string &room_id,
+                              const std::vector<mtx::events::collections::TimelineEvents> &events);
+    void clearDecryptedEvents();
+    //! Messages containing all words of the query, the last word may be incomplete. Searches
+    //! all joined rooms, if room_id is empty. Ranked by score, then newest first.
+    std::vector<MessageSearchResult>
+    searchMessages(const QString &query, const std::string &room_id, std::size_t limit);
     std::optional<uint64_t> getTimelineIndex(const std::string &room_id, std::string_view event_id);
     std::optional<uint64_t> getEventIndex(const std::string &room_id, std::string_view event_id);
     std::optional<std::pair<uint64_t, std::string>>
@@ -222,9 +307,18 @@ public:
     //! clear timeline keeping only the latest batch
     void clearTimeline(const std::string &room_id);
 
-    //! Remove old unused data.
-    void deleteOldMessages();
+    //! Deletes the oldest events of the rooms exceeding their retention policy. Rooms are
+    //! pruned round robin in small write transactions, until the deadline passes. Unless
+    //! toLimit is set, rooms are only pruned once they exceed a limit by a tenth. Returns true,
+    //! if rooms are left to prune.
+    bool pruneHistory(QDeadlineTimer deadline, bool toLimit = false);
+    //! Prunes all rooms down to their limits at once, used when the database ran full.
     void deleteOldData() noexcept;
+    RetentionPolicy retentionPolicy(const std::string &room_id);
+    //! Overrides the default policy of a room, std::nullopt restores the default.
+    void setRetentionPolicy(const std::string &room_id,
+                            const std::optional<RetentionPolicy> &policy);
+    PruneStatistics pruneStatistics();
     //! Retrieve all saved room ids.
     std::vector<std::string> getRoomIds(lmdb::txn &txn);
     std::vector<std::string> getParentRoomIds(const std::string &room_id);
@@ -267,6 +361,14 @@ public:
     mtx::crypto::InboundGroupSessionPtr getInboundMegolmSession(const MegolmSessionIndex &index);
     bool inboundMegolmSessionExists(const MegolmSessionIndex &index);
     std::optional<GroupSessionData> getMegolmSessionData(const MegolmSessionIndex &index);
+    //! The session from memory, unpickled on first use. nullptr if there is no such session.
+    std::shared_ptr<InboundGroupSessionDataRef>
+    cachedInboundMegolmSession(const MegolmSessionIndex &index);
+    //! Schedules saving the message indices of a cached session. All sessions changed until
+    //! control returns to the event loop are saved in one transaction.
+    void inboundMegolmSessionChanged(const MegolmSessionIndex &index,
+                                     std::shared_ptr<InboundGroupSessionDataRef> session);
+    void saveChangedMegolmSessionData();
 
     //
     // Olm Sessions
@@ -343,11 +445,93 @@ private:
 
     std::optional<MemberInfo> getMember(const std::string &room_id, const std::string &user_id);
 
+    //! Members of a room by user id, kept in memory for the rooms that were accessed recently.
+    using MemberDirectory    = std::unordered_map<std::string, MemberInfo>;
+    using MemberDirectoryPtr = std::shared_ptr<const MemberDirectory>;
+    using MemberDirectories  = std::unordered_map<std::string, MemberDirectoryPtr>;
+
+    //! Snapshot of the members of a room, loaded from the database on first access. Readers
+    //! don't lock, the snapshots are replaced as a whole after member changes were committed.
+    MemberDirectoryPtr memberDirectory(const std::string &room_id);
+    //! Records a member change of a write transaction started with beginWriteTxn(), that is
+    //! applied to the member directories once the transaction committed. An empty user_id
+    //! removes all members of the room.
+    void stageMemberUpdate(lmdb::txn &txn,
+                           const std::string &room_id,
+                           const std::string &user_id,
+                           std::optional<MemberInfo> info);
+    void publishMemberUpdates();
+    //! Removes the directory of a room and its place in the eviction order. Needs
+    //! memberDirectoriesMtx_.
+    void eraseMemberDirectory(MemberDirectories &directories, const std::string &room_id);
+    void forgetAllMemberDirectories();
+
     std::string getLastEventId(lmdb::txn &txn, const std::string &room_id);
     void saveTimelineMessages(lmdb::txn &txn,
                               lmdb::dbi &eventsDb,
                               const std::string &room_id,
-                              const mtx::responses::Timeline &res);
+                              const mtx::responses::Timeline &res,
+                              const std::vector<std::string> *records = nullptr);
+    std::optional<LastMessage> getLastMessage(lmdb::txn &txn, const std::string &room_id);
+    void saveLastMessage(lmdb::txn &txn,
+                         const std::string &room_id,
+                         const mtx::events::collections::TimelineEvents &event,
+                         bool encrypted);
+    //! Stores the decrypted version of the last message next to the encrypted one.
+    void saveDecryptedLastMessage(lmdb::txn &txn,
+                                  const std::string &room_id,
+                                  const mtx::events::collections::TimelineEvents &event);
+    //! Key the decrypted events are encrypted with, std::nullopt without a pickle secret.
+    std::optional<mtx::crypto::BinaryBuf> decryptedEventsKey() const;
+    //! Key the words of decrypted messages are hashed with in the search index, std::nullopt
+    //! without a pickle secret.
+    std::optional<mtx::crypto::BinaryBuf> searchTokensKey() const;
+    void deleteDecryptedEvents(lmdb::txn &txn, const std::string &room_id);
+    //! Removes the hashed words of decrypted messages from the search index of a room.
+    void deleteHashedSearchPostings(lmdb::txn &txn, const std::string &room_id);
+    void deleteReadReceipts(lmdb::txn &txn, const std::string &room_id);
+    //! Adds the words of a message to the search index of its room. The words of decrypted
+    //! messages are hashed with hashKey.
+    void indexMessage(lmdb::txn &txn,
+                      lmdb::dbi &searchDb,
+                      const mtx::events::collections::TimelineEvents &event,
+                      const std::optional<mtx::crypto::BinaryBuf> &hashKey);
+    void unindexMessage(lmdb::txn &txn,
+                        lmdb::dbi &searchDb,
+                        const mtx::events::collections::TimelineEvents &event,
+                        const std::optional<mtx::crypto::BinaryBuf> &hashKey);
+    //! Removes a stored event and its stored decrypted copy from the search index of its room.
+    void unindexStoredMessage(lmdb::txn &txn,
+                              lmdb::dbi &eventsDb,
+                              lmdb::dbi &searchDb,
+                              const std::string &room_id,
+                              const std::string &event_id,
+                              const std::optional<mtx::crypto::BinaryBuf> &secret);
+    std::optional<mtx::events::collections::TimelineEvents>
+    getDecryptedEvent(lmdb::txn &txn,
+                      const std::string &room_id,
+                      const std::string &event_id,
+                      const mtx::crypto::BinaryBuf &secret);
+
+    //! What is known about the size of the history of a room, without reading it.
+    struct PruneMark
+    {
+        uint64_t events = 0;
+        uint64_t bytes  = 0;
+        //! Timestamp of the oldest event in milliseconds, 0 if unknown.
+        uint64_t oldestTs = 0;
+    };
+
+    //! Queues a run of pruneHistory() on the writer thread.
+    void pruneNextRooms();
+    //! Prunes one room in batches. Returns false, if the deadline passed before it was done.
+    bool pruneRoom(const std::string &room_id,
+                   const RetentionPolicy &policy,
+                   const QDeadlineTimer &deadline);
+    PruneMark measureHistory(lmdb::txn &txn, const std::string &room_id);
+    //! Records events added to the timeline of a room, for the rooms with a PruneMark.
+    void noteHistoryGrowth(const std::string &room_id, uint64_t events, uint64_t bytes);
+    void forgetPruneMark(const std::string &room_id);
 
     //! retrieve a specific event from account data
     //! pass empty room_id for global account data
@@ -359,6 +543,7 @@ private:
 
     //! Remove a room from the cache.
     // void removeLeftRoom(lmdb::txn &txn, const std::string &room_id);
+    //! records optionally contains the already serialized events, see PreparedRoom.
     template<class T>
     void saveStateEvents(lmdb::txn &txn,
                          lmdb::dbi &statesdb,
@@ -366,10 +551,18 @@ private:
                          lmdb::dbi &membersdb,
                          lmdb::dbi &eventsDb,
                          const std::string &room_id,
-                         const std::vector<T> &events)
+                         const std::vector<T> &events,
+                         const std::vector<std::string> *records = nullptr)
     {
-        for (const auto &e : events)
-            saveStateEvent(txn, statesdb, stateskeydb, membersdb, eventsDb, room_id, e);
+        for (std::size_t i = 0; i < events.size(); i++)
+            saveStateEvent(txn,
+                           statesdb,
+                           stateskeydb,
+                           membersdb,
+                           eventsDb,
+                           room_id,
+                           events[i],
+                           records ? std::string_view((*records)[i]) : std::string_view());
     }
 
     template<class T>
@@ -379,7 +572,8 @@ private:
                         lmdb::dbi &membersdb,
                         lmdb::dbi &eventsDb,
                         const std::string &room_id,
-                        const T &event)
+                        const T &event,
+                        std::string_view record = {})
     {
         using namespace mtx::events;
         using namespace mtx::events::state;
@@ -397,11 +591,13 @@ private:
                 // Lightweight representation of a member.
                 MemberInfo tmp{display_name, e->content.avatar_url};
 
-                membersdb.put(txn, e->state_key, json(tmp).dump());
+                membersdb.put(txn, e->state_key, encodeMemberInfo(tmp));
+                stageMemberUpdate(txn, room_id, e->state_key, std::move(tmp));
                 break;
             }
             default: {
                 membersdb.del(txn, e->state_key, "");
+                stageMemberUpdate(txn, room_id, e->state_key, std::nullopt);
                 break;
             }
             }
@@ -412,17 +608,23 @@ private:
             return;
         }
 
+        std::string serialized;
         std::visit(
-          [&txn, &statesdb, &stateskeydb, &eventsDb, &membersdb](const auto &e) {
+          [&](const auto &e) {
               if constexpr (isStateEvent_<decltype(e)>) {
-                  eventsDb.put(txn, e.event_id, json(e).dump());
+                  if (record.empty()) {
+                      serialized = cache::dumpRecord(json(e));
+                      record     = serialized;
+                  }
+                  eventsDb.put(txn, e.event_id, record);
 
                   if (e.type != EventType::Unsupported) {
                       if (std::is_same_v<std::remove_cv_t<std::remove_reference_t<decltype(e)>>,
                                          StateEvent<mtx::events::msg::Redacted>>) {
-                          if (e.type == EventType::RoomMember)
+                          if (e.type == EventType::RoomMember) {
                               membersdb.del(txn, e.state_key, "");
-                          else if (e.state_key.empty())
+                              stageMemberUpdate(txn, room_id, e.state_key, std::nullopt);
+                          } else if (e.state_key.empty())
                               statesdb.del(txn, to_string(e.type));
                           else
                               stateskeydb.del(txn,
@@ -433,7 +635,7 @@ private:
                                                            })
                                                 .dump());
                       } else if (e.state_key.empty())
-                          statesdb.put(txn, to_string(e.type), json(e).dump());
+                          statesdb.put(txn, to_string(e.type), record);
                       else
                           stateskeydb.put(txn,
                                           to_string(e.type),
@@ -486,7 +688,7 @@ private:
                 }
             }
 
-            return json::parse(value).get<mtx::events::StateEvent<T>>();
+            return cache::parseRecord(value).get<mtx::events::StateEvent<T>>();
         } catch (std::exception &e) {
             return std::nullopt;
         }
@@ -522,7 +724,8 @@ private:
 
                     try {
                         if (eventsDb.get(txn, json::parse(data)["id"].get<std::string>(), value))
-                            events.push_back(json::parse(value).get<mtx::events::StateEvent<T>>());
+                            events.push_back(
+                              cache::parseRecord(value).get<mtx::events::StateEvent<T>>());
                     } catch (std::exception &e) {
                         nhlog::db()->warn("Failed to parse state event: {}", e.what());
                     }
@@ -532,6 +735,29 @@ private:
 
         return events;
     }
+
+    //! The records of the events of a joined room, serialized before the write transaction.
+    struct PreparedRoom
+    {
+        const mtx::responses::JoinedRoom *room = nullptr;
+        //! Parallel to room->state.events, empty for events not stored as a whole.
+        std::vector<std::string> state;
+        //! Parallel to room->timeline.events.
+        std::vector<std::string> timeline;
+    };
+    //! Serializes the events of the rooms in parallel, since the writes can't be.
+    static std::vector<PreparedRoom> prepareJoinedRooms(
+      std::vector<const mtx::responses::JoinedRoom *> rooms);
+    static void prepareJoinedRoom(PreparedRoom &prepared);
+
+    void saveJoinedRoom(lmdb::txn &txn,
+                        const std::string &room_id,
+                        const mtx::responses::JoinedRoom &room,
+                        std::set<std::string> &spaces_with_updates,
+                        std::set<std::string> &rooms_with_space_updates,
+                        const PreparedRoom *prepared = nullptr);
+    void saveGlobalAccountData(lmdb::txn &txn, const mtx::responses::Sync &res);
+
     void
     saveInvites(lmdb::txn &txn, const std::map<std::string, mtx::responses::InvitedRoom> &rooms);
 
@@ -555,6 +781,40 @@ private:
                       const std::set<std::string> &spaces_with_updates,
                       std::set<std::string> rooms_with_updates);
 
+    //! The named databases, that exist once per room.
+    enum class RoomDb : std::uint8_t
+    {
+        Events,
+        EventOrder,
+        EventToOrder,
+        MessageToOrder,
+        OrderToMessage,
+        Pending,
+        Related,
+        States,
+        StatesKey,
+        AccountData,
+        Members,
+        Mentions,
+        Search,
+        Count,
+    };
+
+    //! Returns the handle of a per room database. Handles are resolved once per environment,
+    //! after the transaction that opened them was committed through commitWriteTxn().
+    lmdb::dbi getRoomDb(lmdb::txn &txn, const std::string &room_id, RoomDb kind);
+    //! Forgets the cached handles of a room, or only the one of kind. Needs to be called before
+    //! the databases are dropped, since dropping closes the handles.
+    void forgetRoomDbs(const std::string &room_id, std::optional<RoomDb> kind = std::nullopt);
+    void forgetAllRoomDbs();
+    //! Opens all per room databases of a room, to publish them with a write transaction.
+    void openRoomDbs(lmdb::txn &txn, const std::string &room_id);
+
+    //! Write transactions, that publish the database handles opened in them on commit. Grows the
+    //! map first, if it is almost full.
+    GuardedTxn beginWriteTxn();
+    void commitWriteTxn(lmdb::txn &txn);
+
     lmdb::dbi getPendingReceiptsDb(lmdb::txn &txn)
     {
         return lmdb::dbi::open(txn, "pending_receipts", MDB_CREATE);
@@ -562,42 +822,44 @@ private:
 
     lmdb::dbi getEventsDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/events").c_str(), MDB_CREATE);
+        return getRoomDb(txn, room_id, RoomDb::Events);
     }
 
     lmdb::dbi getEventOrderDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/event_order").c_str(), MDB_CREATE | MDB_INTEGERKEY);
+        return getRoomDb(txn, room_id, RoomDb::EventOrder);
     }
 
     // inverse of EventOrderDb
     lmdb::dbi getEventToOrderDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/event2order").c_str(), MDB_CREATE);
+        return getRoomDb(txn, room_id, RoomDb::EventToOrder);
     }
 
     lmdb::dbi getMessageToOrderDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/msg2order").c_str(), MDB_CREATE);
+        return getRoomDb(txn, room_id, RoomDb::MessageToOrder);
     }
 
     lmdb::dbi getOrderToMessageDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/order2msg").c_str(), MDB_CREATE | MDB_INTEGERKEY);
+        return getRoomDb(txn, room_id, RoomDb::OrderToMessage);
     }
 
     lmdb::dbi getPendingMessagesDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/pending").c_str(), MDB_CREATE | MDB_INTEGERKEY);
+        return getRoomDb(txn, room_id, RoomDb::Pending);
     }
 
     lmdb::dbi getRelationsDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/related").c_str(), MDB_CREATE | MDB_DUPSORT);
+        return getRoomDb(txn, room_id, RoomDb::Related);
+    }
+
+    //! word -> postings of the messages containing it, see searchMessages().
+    lmdb::dbi getSearchDb(lmdb::txn &txn, const std::string &room_id)
+    {
+        return getRoomDb(txn, room_id, RoomDb::Search);
     }
 
     lmdb::dbi getInviteStatesDb(lmdb::txn &txn, const std::string &room_id)
@@ -612,30 +874,27 @@ private:
 
     lmdb::dbi getStatesDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/state").c_str(), MDB_CREATE);
+        return getRoomDb(txn, room_id, RoomDb::States);
     }
 
     lmdb::dbi getStatesKeyDb(lmdb::txn &txn, const std::string &room_id)
     {
-        auto db = lmdb::dbi::open(
-          txn, std::string(room_id + "/state_by_key").c_str(), MDB_CREATE | MDB_DUPSORT);
-        lmdb::dbi_set_dupsort(txn, db, compare_state_key);
-        return db;
+        return getRoomDb(txn, room_id, RoomDb::StatesKey);
     }
 
     lmdb::dbi getAccountDataDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/account_data").c_str(), MDB_CREATE);
+        return getRoomDb(txn, room_id, RoomDb::AccountData);
     }
 
     lmdb::dbi getMembersDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/members").c_str(), MDB_CREATE);
+        return getRoomDb(txn, room_id, RoomDb::Members);
     }
 
     lmdb::dbi getMentionsDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/mentions").c_str(), MDB_CREATE);
+        return getRoomDb(txn, room_id, RoomDb::Mentions);
     }
 
     lmdb::dbi getPresenceDb(lmdb::txn &txn) { return lmdb::dbi::open(txn, "presence", MDB_CREATE); }
@@ -671,13 +930,20 @@ private:
 
     void setNextBatchToken(lmdb::txn &txn, const std::string &token);
 
+    //! Replaces the data file with a compacted copy, if most of it are free pages. Only safe
+    //! during setup, since the environment is reopened.
+    void compactIfFragmented();
+
     lmdb::env env_;
     lmdb::dbi syncStateDb_;
     lmdb::dbi roomsDb_;
     lmdb::dbi spacesChildrenDb_, spacesParentsDb_;
     lmdb::dbi invitesDb_;
-    lmdb::dbi readReceiptsDb_;
+    lmdb::dbi readReceiptsDb_, receiptsByEventDb_;
     lmdb::dbi notificationsDb_;
+    lmdb::dbi lastMessagesDb_;
+    lmdb::dbi decryptedEventsDb_;
+    lmdb::dbi retentionPoliciesDb_;
 
     lmdb::dbi devicesDb_;
     lmdb::dbi deviceKeysDb_;
@@ -697,6 +963,58 @@ private:
     SecretsStorage secret_storage;
 
     bool databaseReady_ = false;
+
+    //! Cached handles of the per room databases, indexed by RoomDb. 0 means not resolved yet.
+    std::unordered_map<std::string, std::array<MDB_dbi, static_cast<std::size_t>(RoomDb::Count)>>
+      roomDbs_;
+    //! Incremented after every write, that may have changed the rooms.
+    std::atomic<std::uint64_t> writeGeneration_{0};
+    //! Summaries read at roomSummariesGeneration_, see roomSummaries().
+    std::shared_ptr<const RoomSummaries> roomSummaries_;
+    std::uint64_t roomSummariesGeneration_ = 0;
+    std::mutex roomSummariesMtx_;
+
+    //! Incremented whenever handles are forgotten, to not publish handles of dropped databases.
+    std::uint64_t roomDbsEpoch_ = 0;
+    std::shared_mutex roomDbsMtx_;
+
+    //! Accessed with std::atomic_load and std::atomic_store, replaced under memberDirectoriesMtx_.
+    std::shared_ptr<const MemberDirectories> memberDirectories_ =
+      std::make_shared<const MemberDirectories>();
+    //! Rooms in the order their directory was loaded, the oldest ones are evicted first.
+    std::deque<std::string> memberDirectoryOrder_;
+    //! Incremented by every member change, to not publish directories loaded concurrently.
+    std::uint64_t memberDirectoriesGeneration_ = 0;
+    //! Directories loaded from older snapshots miss changes of a transaction, that
+    //! stageMemberUpdate() could not stage.
+    std::size_t memberDirectoriesMinSnapshot_ = 0;
+    std::mutex memberDirectoriesMtx_;
+
+    //! Recently used inbound megolm sessions by megolmSessionKey(), see
+    //! cachedInboundMegolmSession().
+    std::unordered_map<std::string, std::shared_ptr<InboundGroupSessionDataRef>> inboundSessions_;
+    //! Keys in the order the sessions were loaded, the oldest ones are evicted first.
+    std::deque<std::string> inboundSessionOrder_;
+    //! Sessions with message indices, that are not saved yet.
+    std::map<std::string, std::shared_ptr<InboundGroupSessionDataRef>> changedInboundSessions_;
+    //! Incremented when sessions are replaced, to not cache sessions loaded concurrently.
+    std::uint64_t inboundSessionsGeneration_ = 0;
+    std::mutex inboundSessionsMtx_;
+    void forgetInboundMegolmSession(const std::string &key);
+
+    //! Measured when a room is first checked, then grown by the writes to its timeline.
+    std::unordered_map<std::string, PruneMark> pruneMarks_;
+    //! The room pruneHistory() continues with.
+    std::string pruneCursor_;
+    PruneStatistics pruneStatistics_;
+    std::mutex pruneMtx_;
+    QTimer pruneTimer_;
+    //! Set while a run of pruneHistory() is queued on the writer thread.
+    bool pruning_ = false;
+
+    //! Thread the sync write transactions are executed on.
+    QThread writerThread_;
+    QObject *writer_ = nullptr;
 };
 
 namespace cache {
@@ -36,6 +36,10 @@ ChatPage *ChatPage::instance_             = nullptr;
 constexpr int CHECK_CONNECTIVITY_INTERVAL = 15'000;
 constexpr int RETRY_TIMEOUT               = 5'000;
 constexpr size_t MAX_ONETIME_KEYS         = 50;
+//! Fetched sync responses waiting to be persisted, before we stop fetching ahead.
+constexpr int MAX_QUEUED_SYNCS = 2;
+//! How long storing a sync into a full map waits for reads to end, before it prunes old messages.
+constexpr int MAP_FULL_GROW_WAIT_MS = 500;
 
 Q_DECLARE_METATYPE(std::optional<mtx::crypto::EncryptedFile>)
 Q_DECLARE_METATYPE(std::optional<RelatedInfo>)
@@ -85,6 +89,7 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QWidget *parent)
 
         // Drop all pending connections.
         http::client()->shutdown();
+        resetSyncPipeline();
         trySync();
     });
 
@@ -172,12 +177,6 @@ ChatPage::ChatPage(QSharedPointer<UserSettings> userSettings, QWidget *parent)
         delete view_manager_->getWidget();
     });
 
-    connect(
-      this,
-      &ChatPage::initializeViews,
-      view_manager_,
-      [this](const mtx::responses::Sync &sync) { view_manager_->sync(sync); },
-      Qt::QueuedConnection);
     connect(this,
             &ChatPage::initializeEmptyViews,
             view_manager_,
@@ -398,6 +397,7 @@ ChatPage::loadStateFromCache()
     try {
         olm::client()->load(cache::restoreOlmAccount(), cache::client()->pickleSecret());
 
+        cache::client()->preloadRoomDbs();
         emit initializeEmptyViews();
         emit initializeMentions(cache::getTimelineMentions());
 
@@ -572,33 +572,90 @@ ChatPage::startInitialSync()
 
         nhlog::net()->info("initial sync completed");
 
-        try {
-            cache::client()->saveState(res);
+        // The network thread waits for the writer, so that the (potentially huge) response does
+        // not need to be copied. The views are then loaded from the cache, like on a restart.
+        bool saved = false;
+        cache::client()->runOnWriterThread(
+          [&res, &saved]() {
+              try {
+                  cache::client()->saveInitialState(res);
+                  saved = true;
+              } catch (const lmdb::error &e) {
+                  nhlog::db()->error("failed to save state after initial sync: {}", e.what());
+              }
+          },
+          true);
 
-            olm::handle_to_device_messages(res.to_device.events);
+        if (!saved) {
+            startInitialSync();
+            return;
+        }
 
-            emit initializeViews(std::move(res));
+        // The olm account is only used on the GUI thread, like in syncPersisted().
+        QMetaObject::invokeMethod(
+          this,
+          [events = res.to_device.events]() {
+              try {
+                  olm::handle_to_device_messages(events);
+              } catch (const lmdb::error &e) {
+                  nhlog::db()->error("processing to device messages: {}", e.what());
+              }
+          },
+          Qt::QueuedConnection);
+
+        try {
+            emit initializeEmptyViews();
             emit initializeMentions(cache::getTimelineMentions());
 
             cache::calculateRoomReadStatus();
         } catch (const lmdb::error &e) {
-            nhlog::db()->error("failed to save state after initial sync: {}", e.what());
+            nhlog::db()->error("failed to load state after initial sync: {}", e.what());
             startInitialSync();
             return;
         }
 
+        resetSyncPipeline();
         emit trySyncCb();
         emit contentLoaded();
     });
 }
 
 void
-ChatPage::handleSyncResponse(const mtx::responses::Sync &res, const std::string &prev_batch_token)
+ChatPage::handleSyncResponse(const mtx::responses::Sync &res,
+                             const std::string &prev_batch_token,
+                             unsigned int generation)
+{
+    auto sync = std::make_shared<const mtx::responses::Sync>(res);
+
+    // Writes queued on the writer thread run in order, which keeps the next_batch ordering
+    // intact, while the GUI thread stays responsive during the commit.
+    cache::client()->runOnWriterThread([this, sync, prev_batch_token, generation]() {
+        const bool saved = persistSyncResponse(*sync, prev_batch_token, generation);
+        QMetaObject::invokeMethod(
+          this, [this, sync, saved]() { syncPersisted(*sync, saved); }, Qt::QueuedConnection);
+    });
+}
+
+bool
+ChatPage::persistSyncResponse(const mtx::responses::Sync &res,
+                              const std::string &prev_batch_token,
+                              unsigned int generation)
 {
+    if (generation != syncGeneration_) {
+        nhlog::net()->debug("Dropping sync fetched before the pipeline was reset");
+        return false;
+    }
+
+    if (!cache::client() || !cache::client()->isDatabaseReady()) {
+        nhlog::db()->warn("Logged out in the mean time, dropping sync");
+        return false;
+    }
+
     try {
         if (prev_batch_token != cache::nextBatchToken()) {
             nhlog::net()->warn("Duplicate sync, dropping");
-            return;
+            resetSyncPipeline();
+            return false;
         }
     } catch (const lmdb::error &e) {
         nhlog::db()->warn("Logged out in the mean time, dropping sync");
@@ -606,54 +663,112 @@ ChatPage::handleSyncResponse(const mtx::responses::Sync &res, const std::string
 
     nhlog::net()->debug("sync completed: {}", res.next_batch);
 
-    // Ensure that we have enough one-time keys available.
-    ensureOneTimeKeyCount(res.device_one_time_keys_count);
-
     // TODO: fine grained error handling
-    try {
-        cache::client()->saveState(res);
-        olm::handle_to_device_messages(res.to_device.events);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        try {
+            // Old messages are pruned by the cache in the background.
+            cache::client()->saveState(res);
+            return true;
+        } catch (const lmdb::map_full_error &e) {
+            nhlog::db()->error("lmdb is full: {}", e.what());
+            // The map is usually grown before it is full. Make room and store the sync again, so
+            // that it is not lost. Reads on other threads only delay growing the map briefly.
+            if (!cache::client()->growMap(true, QDeadlineTimer(MAP_FULL_GROW_WAIT_MS)))
+                cache::deleteOldData();
+        } catch (const lmdb::error &e) {
+            nhlog::db()->error("saving sync response: {}", e.what());
+            break;
+        }
+    }
 
-        auto updates = cache::getRoomInfo(cache::client()->roomsWithStateUpdates(res));
+    // The responses fetched ahead build on the one we failed to store.
+    resetSyncPipeline();
+    return false;
+}
 
-        emit syncUI(std::move(res));
+void
+ChatPage::syncPersisted(const mtx::responses::Sync &res, bool saved)
+{
+    if (saved) {
+        // Ensure that we have enough one-time keys available.
+        ensureOneTimeKeyCount(res.device_one_time_keys_count);
 
-        // if we process a lot of syncs (1 every 200ms), this means we clean the
-        // db every 100s
-        static int syncCounter = 0;
-        if (syncCounter++ >= 500) {
-            cache::deleteOldData();
-            syncCounter = 0;
+        try {
+            olm::handle_to_device_messages(res.to_device.events);
+
+            emit syncUI(res);
+        } catch (const lmdb::error &e) {
+            nhlog::db()->error("processing sync response: {}", e.what());
         }
-    } catch (const lmdb::map_full_error &e) {
-        nhlog::db()->error("lmdb is full: {}", e.what());
-        cache::deleteOldData();
-    } catch (const lmdb::error &e) {
-        nhlog::db()->error("saving sync response: {}", e.what());
     }
 
-    emit trySyncCb();
+    queuedSyncs_--;
+    trySync();
 }
 
 void
-ChatPage::trySync()
+ChatPage::resetSyncPipeline()
 {
-    mtx::http::SyncOpts opts;
-    opts.set_presence = currentPresence();
+    syncGeneration_++;
+    syncInFlight_ = false;
 
+    std::lock_guard<std::mutex> lock(pipelineMtx_);
+    pipelineToken_.clear();
+}
+
+void
+ChatPage::trySync()
+{
     if (!connectivityTimer_.isActive())
         connectivityTimer_.start();
 
-    try {
-        opts.since = cache::nextBatchToken();
-    } catch (const lmdb::error &e) {
-        nhlog::db()->error("failed to retrieve next batch token: {}", e.what());
+    // Either the request in flight or the next persisted response continues the pipeline.
+    if (queuedSyncs_ >= MAX_QUEUED_SYNCS)
         return;
+
+    bool expected = false;
+    if (!syncInFlight_.compare_exchange_strong(expected, true))
+        return;
+
+    std::string since;
+    {
+        std::lock_guard<std::mutex> lock(pipelineMtx_);
+        since = pipelineToken_;
     }
 
+    if (since.empty()) {
+        try {
+            since = cache::nextBatchToken();
+        } catch (const lmdb::error &e) {
+            nhlog::db()->error("failed to retrieve next batch token: {}", e.what());
+            syncInFlight_ = false;
+            return;
+        }
+    }
+
+    fetchSync(since, currentPresence(), syncGeneration_);
+}
+
+void
+ChatPage::fetchSync(const std::string &since,
+                    mtx::presence::PresenceState presence,
+                    unsigned int generation)
+{
+    mtx::http::SyncOpts opts;
+    opts.set_presence = presence;
+    opts.since        = since;
+
     http::client()->sync(
-      opts, [this, since = opts.since](const mtx::responses::Sync &res, mtx::http::RequestErr err) {
+      opts,
+      [this, since, presence, generation](const mtx::responses::Sync &res,
+                                          mtx::http::RequestErr err) {
+          // The pipeline was reset while this request was running.
+          if (generation != syncGeneration_)
+              return;
+
           if (err) {
+              syncInFlight_ = false;
+
               const auto error = QString::fromStdString(err->matrix_error.error);
               const auto msg   = tr("Please try to login again: %1").arg(error);
 
@@ -670,7 +785,23 @@ ChatPage::trySync()
               return;
           }
 
-          emit newSyncResponse(res, since);
+          {
+              std::lock_guard<std::mutex> lock(pipelineMtx_);
+              pipelineToken_ = res.next_batch;
+          }
+
+          // Fetch the next batch, while the previous ones are being persisted. If too many are
+          // waiting already, the next persisted response restarts fetching.
+          const bool fetchAhead = ++queuedSyncs_ < MAX_QUEUED_SYNCS;
+          if (!fetchAhead)
+              syncInFlight_ = false;
+
+          // The GUI thread hands the response to the writer thread, which persists it in order.
+          // next_batch ordering is kept by the queued connection and the writer queue.
+          emit newSyncResponse(res, since, generation);
+
+          if (fetchAhead)
+              fetchSync(res.next_batch, presence, generation);
       });
 }
 
@@ -1200,10 +1331,10 @@ void
 ChatPage::startChat(QString userid)
 {
     auto joined_rooms = cache::joinedRooms();
-    auto room_infos   = cache::getRoomInfo(joined_rooms);
+    auto rooms        = cache::roomSummaries();
 
     for (std::string room_id : joined_rooms) {
-        if (room_infos[QString::fromStdString(room_id)].member_count == 2) {
+        if (rooms->infos.value(QString::fromStdString(room_id)).member_count == 2) {
             auto room_members = cache::roomMembers(room_id);
             if (std::find(room_members.begin(), room_members.end(), (userid).toStdString()) !=
                 room_members.end()) {
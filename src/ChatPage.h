@@ -6,6 +6,8 @@
 #pragma once
 
 #include <atomic>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <stack>
 #include <variant>
@@ -121,12 +123,13 @@ signals:
     void trySyncCb();
     void tryDelayedSyncCb();
     void tryInitialSyncCb();
-    void newSyncResponse(const mtx::responses::Sync &res, const std::string &prev_batch_token);
+    void newSyncResponse(const mtx::responses::Sync &res,
+                         const std::string &prev_batch_token,
+                         unsigned int generation);
     void leftRoom(const QString &room_id);
     void newRoom(const QString &room_id);
     void changeToRoom(const QString &room_id);
 
-    void initializeViews(const mtx::responses::Sync &rooms);
     void initializeEmptyViews();
     void initializeMentions(const QMap<QString, mtx::responses::Notifications> &notifs);
     void syncUI(const mtx::responses::Sync &sync);
@@ -168,7 +171,9 @@ private slots:
     void changeRoom(const QString &room_id);
     void dropToLoginPage(const QString &msg);
 
-    void handleSyncResponse(const mtx::responses::Sync &res, const std::string &prev_batch_token);
+    void handleSyncResponse(const mtx::responses::Sync &res,
+                            const std::string &prev_batch_token,
+                            unsigned int generation);
 
 private:
     static ChatPage *instance_;
@@ -176,6 +181,19 @@ private:
     void startInitialSync();
     void tryInitialSync();
     void trySync();
+    //! Long-polls /sync. Called from the network thread to fetch the next batch while the
+    //! previous responses are still being persisted.
+    void fetchSync(const std::string &since,
+                   mtx::presence::PresenceState presence,
+                   unsigned int generation);
+    //! Drops all responses in flight and restarts syncing from the stored token.
+    void resetSyncPipeline();
+    //! Stores a sync response. Runs on the database writer thread.
+    bool persistSyncResponse(const mtx::responses::Sync &res,
+                             const std::string &prev_batch_token,
+                             unsigned int generation);
+    //! Hands a persisted sync response to the UI and continues syncing.
+    void syncPersisted(const mtx::responses::Sync &res, bool saved);
     void verifyOneTimeKeyCountAfterStartup();
     void ensureOneTimeKeyCount(const std::map<std::string, uint16_t> &counts);
     void getProfileInfo();
@@ -207,6 +225,17 @@ private:
     QTimer connectivityTimer_;
     std::atomic_bool isConnected_;
 
+    // Sync pipeline: responses are fetched on the network thread and queued for persistence.
+    //! Whether a /sync request is currently running.
+    std::atomic_bool syncInFlight_{false};
+    //! Number of fetched responses, that have not been persisted yet.
+    std::atomic_int queuedSyncs_{0};
+    //! Responses fetched before the last pipeline reset are dropped.
+    std::atomic_uint syncGeneration_{0};
+    //! next_batch of the newest fetched response, empty to continue from the stored token.
+    std::string pipelineToken_;
+    std::mutex pipelineMtx_;
+
     // Global user settings.
     QSharedPointer<UserSettings> userSettings_;
 
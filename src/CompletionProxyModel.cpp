@@ -4,12 +4,24 @@
 
 #include "CompletionProxyModel.h"
 
+#include <QElapsedTimer>
 #include <QRegularExpression>
+#include <QTimer>
 
 #include "CompletionModelRoles.h"
 #include "Logging.h"
 #include "Utils.h"
 
+//! Time spent indexing at once, so that typing stays responsive in huge rooms.
+constexpr qint64 INDEX_SLICE_MS = 8;
+//! Rows indexed between two checks of the time slice.
+constexpr int INDEX_CHUNK_SIZE = 64;
+//! Source models with more rows get their keys cut off after MAX_KEY_LENGTH characters, which
+//! bounds the size of the trie. Queries are cut off the same way, so longer queries match every
+//! row, that shares the first MAX_KEY_LENGTH characters.
+constexpr int LARGE_MODEL_ROWS = 10000;
+constexpr int MAX_KEY_LENGTH   = 16;
+
 CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
                                            int max_mistakes,
                                            size_t max_completions,
@@ -19,52 +31,12 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
   , max_completions_(max_completions)
 {
     setSourceModel(model);
-    QChar splitPoints(' ');
-
-    // insert all the full texts
-    for (int i = 0; i < sourceModel()->rowCount(); i++) {
-        if (static_cast<size_t>(i) < max_completions_)
-            mapping.push_back(i);
-
-        auto string1 = sourceModel()
-                         ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole)
-                         .toString()
-                         .toLower();
-        if (!string1.isEmpty())
-            trie_.insert(string1.toUcs4(), i);
-
-        auto string2 = sourceModel()
-                         ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole2)
-                         .toString()
-                         .toLower();
-        if (!string2.isEmpty())
-            trie_.insert(string2.toUcs4(), i);
-    }
-
-    // insert the partial matches
-    for (int i = 0; i < sourceModel()->rowCount(); i++) {
-        auto string1 = sourceModel()
-                         ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole)
-                         .toString()
-                         .toLower();
-
-        for (const auto &e : string1.splitRef(splitPoints)) {
-            if (!e.isEmpty()) // NOTE(Nico): Use Qt::SkipEmptyParts in Qt 5.14
-                trie_.insert(e.toUcs4(), i);
-        }
 
-        auto string2 = sourceModel()
-                         ->data(sourceModel()->index(i, 0), CompletionModel::SearchRole2)
-                         .toString()
-                         .toLower();
+    for (int i = 0; i < sourceModel()->rowCount() && static_cast<size_t>(i) < max_completions_;
+         i++)
+        mapping.push_back(i);
 
-        if (!string2.isEmpty()) {
-            for (const auto &e : string2.splitRef(splitPoints)) {
-                if (!e.isEmpty()) // NOTE(Nico): Use Qt::SkipEmptyParts in Qt 5.14
-                    trie_.insert(e.toUcs4(), i);
-            }
-        }
-    }
+    truncateKeys_ = sourceModel()->rowCount() > LARGE_MODEL_ROWS;
 
     connect(
       this,
@@ -77,12 +49,86 @@ CompletionProxyModel::CompletionProxyModel(QAbstractItemModel *model,
           invalidate();
       },
       Qt::QueuedConnection);
+
+    // The first slice is indexed right away, which covers all but the largest models.
+    indexNextRows();
+}
+
+void
+CompletionProxyModel::insert(QVector<uint> key, int row)
+{
+    if (truncateKeys_ && key.size() > MAX_KEY_LENGTH)
+        key.resize(MAX_KEY_LENGTH);
+    trie_.insert(key, row);
+}
+
+void
+CompletionProxyModel::indexNextRows()
+{
+    const QChar splitPoints(' ');
+    const int rowCount = sourceModel()->rowCount();
+    const int first    = indexedRows_;
+
+    auto text = [this](int row, int role) {
+        return sourceModel()->data(sourceModel()->index(row, 0), role).toString().toLower();
+    };
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (indexedRows_ < rowCount && !timer.hasExpired(INDEX_SLICE_MS)) {
+        const int begin = indexedRows_;
+        const int end   = std::min(rowCount, begin + INDEX_CHUNK_SIZE);
+
+        // insert all the full texts
+        for (int i = begin; i < end; i++) {
+            auto string1 = text(i, CompletionModel::SearchRole);
+            if (!string1.isEmpty())
+                insert(string1.toUcs4(), i);
+
+            auto string2 = text(i, CompletionModel::SearchRole2);
+            if (!string2.isEmpty())
+                insert(string2.toUcs4(), i);
+        }
+
+        // insert the partial matches
+        for (int i = begin; i < end; i++) {
+            auto string1 = text(i, CompletionModel::SearchRole);
+
+            for (const auto &e : string1.splitRef(splitPoints)) {
+                if (!e.isEmpty()) // NOTE(Nico): Use Qt::SkipEmptyParts in Qt 5.14
+                    insert(e.toUcs4(), i);
+            }
+
+            auto string2 = text(i, CompletionModel::SearchRole2);
+
+            if (!string2.isEmpty()) {
+                for (const auto &e : string2.splitRef(splitPoints)) {
+                    if (!e.isEmpty()) // NOTE(Nico): Use Qt::SkipEmptyParts in Qt 5.14
+                        insert(e.toUcs4(), i);
+                }
+            }
+        }
+
+        indexedRows_ = end;
+    }
+
+    if (indexedRows_ < rowCount)
+        QTimer::singleShot(0, this, &CompletionProxyModel::indexNextRows);
+
+    // Show matches from the new rows, if the current results are not complete yet. Once
+    // everything is indexed, search again, since better matches may have been added.
+    if (first != 0 && !searchString_.isEmpty() &&
+        (mapping.size() < max_completions_ || indexedRows_ == rowCount))
+        invalidate();
 }
 
 void
 CompletionProxyModel::invalidate()
 {
     auto key = searchString_.toUcs4();
+    if (truncateKeys_ && key.size() > MAX_KEY_LENGTH)
+        key.resize(MAX_KEY_LENGTH);
     beginResetModel();
     if (!key.empty()) // return default model data, if no search string
         mapping = trie_.search(key, max_completions_, maxMistakes_);
@@ -7,141 +7,215 @@
 // Class for showing a limited amount of completions at a time
 
 #include <QAbstractProxyModel>
-
+#include <QVector>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+//! Prefix tree with fuzzy search. All nodes are stored in one vector and refer to each other by
+//! index. The children of a node form a list sorted by key, the values of a node a list in
+//! insertion order. Values have to be small non negative integers (i.e. row numbers), since they
+//! index the table used for deduplicating results.
 template<typename Key, typename Value>
 struct trie
 {
-    std::vector<Value> values;
-    std::map<Key, trie> next;
+    static_assert(std::is_integral_v<Value>, "Values are used to deduplicate results.");
 
     void insert(const QVector<Key> &keys, const Value &v)
     {
-        auto t = this;
-        for (const auto k : keys) {
-            t = &t->next[k];
-        }
-
-        t->values.push_back(v);
+        std::uint32_t t = 0;
+        for (const auto k : keys)
+            t = childOrInsert(t, k);
+
+        const auto value = static_cast<std::uint32_t>(values_.size());
+        values_.push_back({v, NONE});
+
+        if (nodes_[t].lastValue == NONE)
+            nodes_[t].firstValue = value;
+        else
+            values_[nodes_[t].lastValue].next = value;
+        nodes_[t].lastValue = value;
     }
 
     std::vector<Value> valuesAndSubvalues(size_t limit = -1) const
     {
-        std::vector<Value> ret;
-        if (limit < 200)
-            ret.reserve(limit);
-
-        for (const auto &v : values) {
-            if (ret.size() >= limit)
-                return ret;
-            else
-                ret.push_back(v);
+        Results ret(*this, limit);
+        collect(0, ret);
+        return std::move(ret.values);
+    }
+
+    std::vector<Value> search(const QVector<Key> &keys, //< TODO(Nico): replace this with a span
+                              size_t result_count_limit,
+                              size_t max_edit_distance_ = 2) const
+    {
+        Results ret(*this, result_count_limit);
+        search(0, keys.constData(), static_cast<size_t>(keys.size()), max_edit_distance_, ret);
+        return std::move(ret.values);
+    }
+
+private:
+    static constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+
+    struct Node
+    {
+        Key key{};
+        std::uint32_t firstChild  = NONE;
+        std::uint32_t nextSibling = NONE;
+        std::uint32_t firstValue  = NONE;
+        std::uint32_t lastValue   = NONE;
+    };
+
+    struct ValueEntry
+    {
+        Value value;
+        std::uint32_t next;
+    };
+
+    //! Unique values found by a search. A value is marked as seen by storing the epoch of the
+    //! search in the table of the trie, so the table never has to be cleared.
+    struct Results
+    {
+        Results(const trie &t, size_t limit_)
+          : owner(t)
+          , limit(limit_)
+        {
+            if (limit < 200)
+                values.reserve(limit);
+
+            epoch = ++owner.epoch_;
+            if (epoch == 0) {
+                std::fill(owner.seen_.begin(), owner.seen_.end(), 0);
+                epoch = ++owner.epoch_;
+            }
         }
 
-        for (const auto &[k, t] : next) {
-            (void)k;
-            if (ret.size() >= limit)
-                return ret;
-            else {
-                auto temp = t.valuesAndSubvalues(limit - ret.size());
-                for (auto &&v : temp) {
-                    if (ret.size() >= limit)
-                        return ret;
-
-                    if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                        ret.push_back(std::move(v));
-                    }
-                }
+        bool full() const { return values.size() >= limit; }
+
+        void add(Value v)
+        {
+            const auto idx = static_cast<std::size_t>(v);
+            if (idx >= owner.seen_.size())
+                owner.seen_.resize(idx + 1, 0);
+
+            if (owner.seen_[idx] != epoch) {
+                owner.seen_[idx] = epoch;
+                values.push_back(v);
             }
         }
 
-        return ret;
+        const trie &owner;
+        size_t limit;
+        std::uint32_t epoch;
+        std::vector<Value> values;
+    };
+
+    std::uint32_t child(std::uint32_t node, Key k) const
+    {
+        for (auto c = nodes_[node].firstChild; c != NONE && !(k < nodes_[c].key);
+             c      = nodes_[c].nextSibling) {
+            if (nodes_[c].key == k)
+                return c;
+        }
+        return NONE;
     }
 
-    std::vector<Value> search(const QVector<Key> &keys, //< TODO(Nico): replace this with a span
-                              size_t result_count_limit,
-                              size_t max_edit_distance_ = 2) const
+    std::uint32_t childOrInsert(std::uint32_t node, Key k)
     {
-        std::vector<Value> ret;
-        if (!result_count_limit)
-            return ret;
+        auto prev = NONE;
+        auto c    = nodes_[node].firstChild;
+        while (c != NONE && nodes_[c].key < k) {
+            prev = c;
+            c    = nodes_[c].nextSibling;
+        }
 
-        if (keys.isEmpty())
-            return valuesAndSubvalues(result_count_limit);
+        if (c != NONE && nodes_[c].key == k)
+            return c;
 
-        auto append = [&ret, result_count_limit](std::vector<Value> &&in) {
-            for (auto &&v : in) {
-                if (ret.size() >= result_count_limit)
-                    return;
+        const auto inserted = static_cast<std::uint32_t>(nodes_.size());
+        Node n;
+        n.key         = k;
+        n.nextSibling = c;
+        nodes_.push_back(n);
 
-                if (std::find(ret.begin(), ret.end(), v) == ret.end()) {
-                    ret.push_back(std::move(v));
-                }
-            }
-        };
+        if (prev == NONE)
+            nodes_[node].firstChild = inserted;
+        else
+            nodes_[prev].nextSibling = inserted;
+
+        return inserted;
+    }
+
+    void collect(std::uint32_t node, Results &ret) const
+    {
+        for (auto v = nodes_[node].firstValue; v != NONE && !ret.full(); v = values_[v].next)
+            ret.add(values_[v].value);
 
-        auto limit = [&ret, result_count_limit] {
-            return std::min(result_count_limit, (result_count_limit - ret.size()) * 2);
-        };
+        for (auto c = nodes_[node].firstChild; c != NONE && !ret.full(); c = nodes_[c].nextSibling)
+            collect(c, ret);
+    }
+
+    void search(std::uint32_t node,
+                const Key *keys,
+                size_t count,
+                size_t max_edit_distance_,
+                Results &ret) const
+    {
+        if (ret.full())
+            return;
+
+        if (count == 0) {
+            collect(node, ret);
+            return;
+        }
 
         // Try first exact matches, then with maximum errors
         for (size_t max_edit_distance = 0;
-             max_edit_distance <= max_edit_distance_ && ret.size() < result_count_limit;
+             max_edit_distance <= max_edit_distance_ && !ret.full();
              max_edit_distance += 1) {
-            if (max_edit_distance && ret.size() < result_count_limit) {
-                max_edit_distance -= 1;
+            if (max_edit_distance) {
+                const auto distance = max_edit_distance - 1;
 
                 // swap chars case
-                if (keys.size() >= 2) {
-                    auto t = this;
-                    for (int i = 1; i >= 0; i--) {
-                        if (auto e = t->next.find(keys[i]); e != t->next.end()) {
-                            t = &e->second;
-                        } else {
-                            t = nullptr;
-                            break;
-                        }
-                    }
-
-                    if (t) {
-                        append(t->search(keys.mid(2), limit(), max_edit_distance));
-                    }
+                if (count >= 2) {
+                    auto t = child(node, keys[1]);
+                    if (t != NONE)
+                        t = child(t, keys[0]);
+                    if (t != NONE)
+                        search(t, keys + 2, count - 2, distance, ret);
                 }
 
                 // insert case
-                for (const auto &[k, t] : this->next) {
-                    if (k == keys[0])
-                        continue;
-                    if (ret.size() >= limit())
-                        break;
-
-                    // insert
-                    append(t.search(keys, limit(), max_edit_distance));
+                for (auto c = nodes_[node].firstChild; c != NONE && !ret.full();
+                     c      = nodes_[c].nextSibling) {
+                    if (nodes_[c].key != keys[0])
+                        search(c, keys, count, distance, ret);
                 }
 
                 // delete character case
-                append(this->search(keys.mid(1), limit(), max_edit_distance));
+                search(node, keys + 1, count - 1, distance, ret);
 
                 // substitute case
-                for (const auto &[k, t] : this->next) {
-                    if (k == keys[0])
-                        continue;
-                    if (ret.size() >= limit())
-                        break;
-
-                    // substitute
-                    append(t.search(keys.mid(1), limit(), max_edit_distance));
+                for (auto c = nodes_[node].firstChild; c != NONE && !ret.full();
+                     c      = nodes_[c].nextSibling) {
+                    if (nodes_[c].key != keys[0])
+                        search(c, keys + 1, count - 1, distance, ret);
                 }
-
-                max_edit_distance += 1;
             }
 
-            if (auto e = this->next.find(keys[0]); e != this->next.end()) {
-                append(e->second.search(keys.mid(1), limit(), max_edit_distance));
-            }
+            if (auto c = child(node, keys[0]); c != NONE)
+                search(c, keys + 1, count - 1, max_edit_distance, ret);
         }
-
-        return ret;
     }
+
+    //! The root is the first node.
+    std::vector<Node> nodes_ = std::vector<Node>(1);
+    std::vector<ValueEntry> values_;
+
+    mutable std::vector<std::uint32_t> seen_;
+    mutable std::uint32_t epoch_ = 0;
 };
 
 class CompletionProxyModel : public QAbstractProxyModel
@@ -177,8 +251,16 @@ signals:
     void newSearchString(QString);
 
 private:
+    //! Adds the next rows of the source model to the index, until the time slice is used up.
+    void indexNextRows();
+    void insert(QVector<uint> key, int row);
+
     QString searchString_;
     trie<uint, int> trie_;
+    //! Rows of the source model, that are already searchable.
+    int indexedRows_ = 0;
+    //! Keys and queries are cut off after MAX_KEY_LENGTH characters for huge source models.
+    bool truncateKeys_ = false;
     std::vector<int> mapping;
     int maxMistakes_;
     size_t max_completions_;
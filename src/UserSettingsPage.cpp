@@ -131,6 +131,8 @@ UserSettings::load(std::optional<QString> profile)
     onlyShareKeysWithVerifiedUsers_ =
       settings.value(prefix + "user/only_share_keys_with_verified_users", false).toBool();
     useOnlineKeyBackup_ = settings.value(prefix + "user/online_key_backup", false).toBool();
+    storeDecryptedMessages_ =
+      settings.value(prefix + "user/store_decrypted_messages", false).toBool();
 
     disableCertificateValidation_ =
       settings.value("disable_certificate_validation", false).toBool();
@@ -476,6 +478,17 @@ UserSettings::setUseOnlineKeyBackup(bool useBackup)
     save();
 }
 
+void
+UserSettings::setStoreDecryptedMessages(bool state)
+{
+    if (state == storeDecryptedMessages_)
+        return;
+
+    storeDecryptedMessages_ = state;
+    emit storeDecryptedMessagesChanged(state);
+    save();
+}
+
 void
 UserSettings::setRingtone(QString ringtone)
 {
@@ -725,6 +738,7 @@ UserSettings::save()
     settings.setValue(prefix + "user/only_share_keys_with_verified_users",
                       onlyShareKeysWithVerifiedUsers_);
     settings.setValue(prefix + "user/online_key_backup", useOnlineKeyBackup_);
+    settings.setValue(prefix + "user/store_decrypted_messages", storeDecryptedMessages_);
     settings.setValue(prefix + "user/hidden_tags", hiddenTags_);
     settings.setValue(prefix + "user/hidden_pins", hiddenPins_);
     settings.setValue(prefix + "user/recent_reactions", recentReactions_);
@@ -796,6 +810,7 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
     onlyShareKeysWithVerifiedUsers_ = new Toggle(this);
     shareKeysWithTrustedUsers_      = new Toggle(this);
     useOnlineKeyBackup_             = new Toggle(this);
+    storeDecryptedMessages_         = new Toggle(this);
     groupViewToggle_                = new Toggle{this};
     timelineButtonsToggle_          = new Toggle{this};
     typingNotifications_            = new Toggle{this};
@@ -830,6 +845,7 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
     onlyShareKeysWithVerifiedUsers_->setChecked(settings_->onlyShareKeysWithVerifiedUsers());
     shareKeysWithTrustedUsers_->setChecked(settings_->shareKeysWithTrustedUsers());
     useOnlineKeyBackup_->setChecked(settings_->useOnlineKeyBackup());
+    storeDecryptedMessages_->setChecked(settings_->storeDecryptedMessages());
     groupViewToggle_->setChecked(settings_->groupView());
     timelineButtonsToggle_->setChecked(settings_->buttonsInTimeline());
     typingNotifications_->setChecked(settings_->typingNotifications());
@@ -1114,6 +1130,10 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
             useOnlineKeyBackup_,
             tr("Download message encryption keys from and upload to the encrypted online key "
                "backup."));
+    boxWrap(tr("Store decrypted messages"),
+            storeDecryptedMessages_,
+            tr("Keep decrypted messages in the encrypted local cache, so that they don't need to "
+               "be decrypted again after a restart."));
     formLayout_->addRow(new HorizontalLine{this});
     formLayout_->addRow(sessionKeysLabel, sessionKeysLayout);
     formLayout_->addRow(crossSigningKeysLabel, crossSigningKeysLayout);
@@ -1301,6 +1321,12 @@ UserSettingsPage::UserSettingsPage(QSharedPointer<UserSettings> settings, QWidge
         settings_->setUseOnlineKeyBackup(enabled);
     });
 
+    connect(storeDecryptedMessages_, &Toggle::toggled, this, [this](bool enabled) {
+        settings_->setStoreDecryptedMessages(enabled);
+        if (!enabled)
+            cache::clearDecryptedEvents();
+    });
+
     connect(avatarCircles_, &Toggle::toggled, this, [this](bool enabled) {
         settings_->setAvatarCircles(enabled);
     });
@@ -1402,6 +1428,7 @@ UserSettingsPage::showEvent(QShowEvent *)
     onlyShareKeysWithVerifiedUsers_->setState(settings_->onlyShareKeysWithVerifiedUsers());
     shareKeysWithTrustedUsers_->setState(settings_->shareKeysWithTrustedUsers());
     useOnlineKeyBackup_->setState(settings_->useOnlineKeyBackup());
+    storeDecryptedMessages_->setState(settings_->storeDecryptedMessages());
     avatarCircles_->setState(settings_->avatarCircles());
     typingNotifications_->setState(settings_->typingNotifications());
     sortByImportance_->setState(settings_->sortByImportance());
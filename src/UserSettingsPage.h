@@ -96,6 +96,8 @@ class UserSettings : public QObject
                  setShareKeysWithTrustedUsers NOTIFY shareKeysWithTrustedUsersChanged)
     Q_PROPERTY(bool useOnlineKeyBackup READ useOnlineKeyBackup WRITE setUseOnlineKeyBackup NOTIFY
                  useOnlineKeyBackupChanged)
+    Q_PROPERTY(bool storeDecryptedMessages READ storeDecryptedMessages WRITE
+                 setStoreDecryptedMessages NOTIFY storeDecryptedMessagesChanged)
     Q_PROPERTY(QString profile READ profile WRITE setProfile NOTIFY profileChanged)
     Q_PROPERTY(QString userId READ userId WRITE setUserId NOTIFY userIdChanged)
     Q_PROPERTY(QString accessToken READ accessToken WRITE setAccessToken NOTIFY accessTokenChanged)
@@ -168,6 +170,7 @@ public:
     void setOnlyShareKeysWithVerifiedUsers(bool state);
     void setShareKeysWithTrustedUsers(bool state);
     void setUseOnlineKeyBackup(bool state);
+    void setStoreDecryptedMessages(bool state);
     void setProfile(QString profile);
     void setUserId(QString userId);
     void setAccessToken(QString accessToken);
@@ -227,6 +230,7 @@ public:
     bool shareKeysWithTrustedUsers() const { return shareKeysWithTrustedUsers_; }
     bool onlyShareKeysWithVerifiedUsers() const { return onlyShareKeysWithVerifiedUsers_; }
     bool useOnlineKeyBackup() const { return useOnlineKeyBackup_; }
+    bool storeDecryptedMessages() const { return storeDecryptedMessages_; }
     QString profile() const { return profile_; }
     QString userId() const { return userId_; }
     QString accessToken() const { return accessToken_; }
@@ -279,6 +283,7 @@ signals:
     void onlyShareKeysWithVerifiedUsersChanged(bool state);
     void shareKeysWithTrustedUsersChanged(bool state);
     void useOnlineKeyBackupChanged(bool state);
+    void storeDecryptedMessagesChanged(bool state);
     void profileChanged(QString profile);
     void userIdChanged(QString userId);
     void accessTokenChanged(QString accessToken);
@@ -316,6 +321,7 @@ private:
     bool shareKeysWithTrustedUsers_;
     bool onlyShareKeysWithVerifiedUsers_;
     bool useOnlineKeyBackup_;
+    bool storeDecryptedMessages_;
     bool mobileMode_;
     int timelineMaxWidth_;
     int roomListWidth_;
@@ -414,6 +420,7 @@ private:
     Toggle *shareKeysWithTrustedUsers_;
     Toggle *onlyShareKeysWithVerifiedUsers_;
     Toggle *useOnlineKeyBackup_;
+    Toggle *storeDecryptedMessages_;
     Toggle *mobileMode_;
     QLabel *deviceFingerprintValue_;
     QLabel *deviceIdValue_;
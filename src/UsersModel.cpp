@@ -15,10 +15,16 @@ UsersModel::UsersModel(const std::string &roomId, QObject *parent)
   , room_id(roomId)
 {
     roomMembers_ = cache::roomMembers(roomId);
-    for (const auto &m : roomMembers_) {
-        displayNames.push_back(QString::fromStdString(cache::displayName(room_id, m)));
-        userids.push_back(QString::fromStdString(m));
-    }
+    displayNames.resize(roomMembers_.size());
+}
+
+const QString &
+UsersModel::displayName(int row) const
+{
+    auto &name = displayNames[row];
+    if (!name)
+        name = QString::fromStdString(cache::displayName(room_id, roomMembers_[row]));
+    return *name;
 }
 
 QHash<int, QByteArray>
@@ -42,22 +48,23 @@ UsersModel::data(const QModelIndex &index, int role) const
         case CompletionModel::CompletionRole:
             if (UserSettings::instance()->markdown())
                 return QString("[%1](https://matrix.to/#/%2)")
-                  .arg(displayNames[index.row()].toHtmlEscaped())
-                  .arg(QString(QUrl::toPercentEncoding(userids[index.row()])));
+                  .arg(displayName(index.row()).toHtmlEscaped())
+                  .arg(QString(QUrl::toPercentEncoding(
+                    QString::fromStdString(roomMembers_[index.row()]))));
             else
-                return displayNames[index.row()];
+                return displayName(index.row());
         case CompletionModel::SearchRole:
-            return displayNames[index.row()];
+            return displayName(index.row());
         case Qt::DisplayRole:
         case Roles::DisplayName:
-            return displayNames[index.row()].toHtmlEscaped();
+            return displayName(index.row()).toHtmlEscaped();
         case CompletionModel::SearchRole2:
-            return userids[index.row()];
+            return QString::fromStdString(roomMembers_[index.row()]);
         case Roles::AvatarUrl:
             return cache::avatarUrl(QString::fromStdString(room_id),
                                     QString::fromStdString(roomMembers_[index.row()]));
         case Roles::UserID:
-            return userids[index.row()].toHtmlEscaped();
+            return QString::fromStdString(roomMembers_[index.row()]).toHtmlEscaped();
         }
     }
     return {};
@@ -6,6 +6,8 @@
 
 #include <QAbstractListModel>
 
+#include <optional>
+
 class UsersModel : public QAbstractListModel
 {
 public:
@@ -26,8 +28,11 @@ public:
     QVariant data(const QModelIndex &index, int role) const override;
 
 private:
+    //! Display names are resolved when a row is first accessed, so that opening the completer
+    //! in a huge room only loads the member ids.
+    const QString &displayName(int row) const;
+
     std::string room_id;
     std::vector<std::string> roomMembers_;
-    std::vector<QString> displayNames;
-    std::vector<QString> userids;
+    mutable std::vector<std::optional<QString>> displayNames;
 };
@@ -114,6 +114,11 @@ handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEven
     nhlog::crypto()->info("received {} to_device messages", msgs.size());
     nlohmann::json j_msg;
 
+    // Olm messages are grouped by sender, so that the keys of all senders can be queried at
+    // once. The messages of a sender are handled in the order they were received.
+    auto olmMessages = std::make_shared<std::map<std::string, std::vector<olm::OlmMessage>>>();
+    std::vector<std::string> senders;
+
     for (const auto &msg : msgs) {
         j_msg = std::visit([](auto &e) { return json(e); }, std::move(msg));
         if (j_msg.count("type") == 0) {
@@ -126,15 +131,10 @@ handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEven
         if (msg_type == to_string(mtx::events::EventType::RoomEncrypted)) {
             try {
                 olm::OlmMessage olm_msg = j_msg;
-                cache::client()->query_keys(
-                  olm_msg.sender, [olm_msg](const UserKeyCache &userKeys, mtx::http::RequestErr e) {
-                      if (e) {
-                          nhlog::crypto()->error("Failed to query user keys, dropping olm "
-                                                 "message");
-                          return;
-                      }
-                      handle_olm_message(std::move(olm_msg), userKeys);
-                  });
+                auto &messages          = (*olmMessages)[olm_msg.sender];
+                if (messages.empty())
+                    senders.push_back(olm_msg.sender);
+                messages.push_back(std::move(olm_msg));
             } catch (const nlohmann::json::exception &e) {
                 nhlog::crypto()->warn(
                   "parsing error for olm message: {} {}", e.what(), j_msg.dump(2));
@@ -196,6 +196,27 @@ handle_to_device_messages(const std::vector<mtx::events::collections::DeviceEven
             nhlog::crypto()->warn("unhandled event: {}", j_msg.dump(2));
         }
     }
+
+    if (senders.empty())
+        return;
+
+    cache::client()->query_keys(
+      senders,
+      [olmMessages](
+        const std::string &sender, const UserKeyCache &userKeys, mtx::http::RequestErr e) {
+          auto messages = olmMessages->find(sender);
+          if (messages == olmMessages->end())
+              return;
+
+          if (e) {
+              nhlog::crypto()->error("Failed to query user keys, dropping {} olm messages",
+                                     messages->second.size());
+          } else {
+              for (const auto &msg : messages->second)
+                  handle_olm_message(msg, userKeys);
+          }
+          olmMessages->erase(messages);
+      });
 }
 
 void
@@ -1117,35 +1138,29 @@ decryptEvent(const MegolmSessionIndex &index,
              const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event,
              bool dont_write_db)
 {
-    try {
-        if (!cache::client()->inboundMegolmSessionExists(index)) {
-            return {DecryptionErrorCode::MissingSession, std::nullopt, std::nullopt};
-        }
-    } catch (const lmdb::error &e) {
-        return {DecryptionErrorCode::DbError, e.what(), std::nullopt};
-    }
-
     std::string msg_str;
     try {
-        auto session = cache::client()->getInboundMegolmSession(index);
+        // Sessions are kept in memory, only the new message indices are written to the database.
+        auto session = cache::client()->cachedInboundMegolmSession(index);
         if (!session) {
             return {DecryptionErrorCode::MissingSession, std::nullopt, std::nullopt};
         }
 
-        auto sessionData =
-          cache::client()->getMegolmSessionData(index).value_or(GroupSessionData{});
+        std::lock_guard lock(session->mtx);
 
-        auto res = olm::client()->decrypt_group_message(session.get(), event.content.ciphertext);
-        msg_str  = std::string((char *)res.data.data(), res.data.size());
+        auto res =
+          olm::client()->decrypt_group_message(session->session.get(), event.content.ciphertext);
+        msg_str = std::string((char *)res.data.data(), res.data.size());
 
         if (!event.event_id.empty() && event.event_id[0] == '$') {
-            auto oldIdx = sessionData.indices.find(res.message_index);
-            if (oldIdx != sessionData.indices.end()) {
+            auto &indices = session->data.indices;
+            auto oldIdx   = indices.find(res.message_index);
+            if (oldIdx != indices.end()) {
                 if (oldIdx->second != event.event_id)
                     return {DecryptionErrorCode::ReplayAttack, std::nullopt, std::nullopt};
             } else if (!dont_write_db) {
-                sessionData.indices[res.message_index] = event.event_id;
-                cache::client()->saveInboundMegolmSession(index, std::move(session), sessionData);
+                indices[res.message_index] = event.event_id;
+                cache::client()->inboundMegolmSessionChanged(index, session);
             }
         }
     } catch (const lmdb::error &e) {
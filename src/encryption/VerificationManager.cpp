@@ -77,10 +77,10 @@ void
 VerificationManager::verifyUser(QString userid)
 {
     auto joined_rooms = cache::joinedRooms();
-    auto room_infos   = cache::getRoomInfo(joined_rooms);
+    auto rooms        = cache::roomSummaries();
 
     for (std::string room_id : joined_rooms) {
-        if ((room_infos[QString::fromStdString(room_id)].member_count == 2) &&
+        if ((rooms->infos.value(QString::fromStdString(room_id)).member_count == 2) &&
             cache::isRoomEncrypted(room_id)) {
             auto room_members = cache::roomMembers(room_id);
             if (std::find(room_members.begin(), room_members.end(), (userid).toStdString()) !=
@@ -3,6 +3,7 @@
 //
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <cstdio>
 #include <iostream>
 
 #include <QApplication>
@@ -21,6 +22,7 @@
 #include <QStandardPaths>
 #include <QTranslator>
 
+#include "Cache_p.h"
 #include "ChatPage.h"
 #include "Config.h"
 #include "Logging.h"
@@ -122,6 +124,72 @@ createStandardDirectory(QStandardPaths::StandardLocation path)
     }
 }
 
+double
+mebibytes(uint64_t bytes)
+{
+    return bytes / (1024. * 1024.);
+}
+
+void
+printDatabaseStatistics(const std::string &name, const DatabaseStatistics &db)
+{
+    std::printf("%-20s %6llu %10llu %5llu %8llu %8llu %8llu %10.2f\n",
+                name.c_str(),
+                (unsigned long long)db.databases,
+                (unsigned long long)db.entries,
+                (unsigned long long)db.depth,
+                (unsigned long long)db.branchPages,
+                (unsigned long long)db.leafPages,
+                (unsigned long long)db.overflowPages,
+                mebibytes(db.bytes));
+}
+
+//! Prints what the cache of the profile contains, for --cache-stats.
+int
+printCacheStatistics()
+{
+    const auto userId = UserSettings::instance()->userId();
+    if (userId.isEmpty()) {
+        std::cerr << "This profile is not logged in, so it has no cache." << std::endl;
+        return 1;
+    }
+
+    CacheStatistics stats;
+    try {
+        stats = Cache::readStatistics(userId, 10);
+    } catch (const std::exception &e) {
+        std::cerr << "Failed to read the cache: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::printf("map size    %10.2f MiB\n", mebibytes(stats.mapSize));
+    std::printf("file size   %10.2f MiB\n", mebibytes(stats.fileSize));
+    std::printf("free pages  %10.2f MiB\n", mebibytes(stats.freeSize));
+    std::printf("page size   %10llu B\n\n", (unsigned long long)stats.pageSize);
+
+    std::printf("%-20s %6s %10s %5s %8s %8s %8s %10s\n",
+                "kind",
+                "dbs",
+                "entries",
+                "depth",
+                "branch",
+                "leaf",
+                "overflow",
+                "MiB");
+    for (const auto &[kind, db] : stats.kinds)
+        printDatabaseStatistics(kind, db);
+
+    std::printf("\nheaviest rooms\n");
+    for (const auto &room : stats.heaviestRooms) {
+        std::printf("%s\n", room.room_id.c_str());
+        for (const auto &[kind, db] : room.kinds)
+            printDatabaseStatistics("  " + kind, db);
+        printDatabaseStatistics("  total", room.total);
+    }
+
+    return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -194,8 +262,35 @@ main(int argc, char *argv[])
       QCoreApplication::tr("profile name"));
     parser.addOption(configName);
 
+    QCommandLineOption cacheStatsOption(
+      "cache-stats",
+      QCoreApplication::tr("Print the size of the cache databases of the profile and exit."));
+    parser.addOption(cacheStatsOption);
+
     parser.process(app);
 
+    // Handled before the check for a running instance, since the cache is only read, which
+    // works while nheko is running for the profile. The log goes to a file of its own, so that
+    // it does not interfere with the log of the running instance.
+    if (parser.isSet(cacheStatsOption)) {
+        createStandardDirectory(QStandardPaths::CacheLocation);
+        try {
+            nhlog::init(QString("%1/nheko-cache-stats.log")
+                          .arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation))
+                          .toStdString());
+        } catch (const spdlog::spdlog_ex &ex) {
+            std::cerr << "Log initialization failed: " << ex.what() << std::endl;
+            return 1;
+        }
+
+        if (parser.isSet(configName))
+            UserSettings::initialize(parser.value(configName));
+        else
+            UserSettings::initialize(std::nullopt);
+
+        return printCacheStatistics();
+    }
+
     // This check needs to happen _after_ process(), so that we actually print help for --help when
     // Nheko is already running.
     if (app.isSecondary()) {
@@ -231,7 +231,8 @@ CommunitiesModel::initializeSidebar()
     std::map<std::string, std::set<std::string>> spaceChilds;
     std::map<std::string, std::set<std::string>> spaceParents;
 
-    auto infos = cache::roomInfo();
+    auto rooms        = cache::roomSummaries();
+    const auto &infos = rooms->infos;
     for (auto it = infos.begin(); it != infos.end(); it++) {
         if (it.value().is_space) {
             spaces_[it.key()] = it.value();
@@ -252,7 +253,7 @@ CommunitiesModel::initializeSidebar()
     // TODO(Nico): Optimize this. We can do this with a lot fewer allocations and checks.
     for (const auto &space : isSpace) {
         spaceParents[space];
-        for (const auto &p : cache::client()->getParentRoomIds(space)) {
+        for (const auto &p : rooms->parentSpaces(space)) {
             spaceParents[space].insert(p);
             spaceChilds[p].insert(space);
         }
@@ -4,8 +4,13 @@
 
 #include "EventStore.h"
 
+#include <QCoreApplication>
+#include <QPointer>
 #include <QThread>
 #include <QTimer>
+#include <QtConcurrent>
+
+#include <numeric>
 
 #include <mtx/responses/common.hpp>
 
@@ -15,6 +20,7 @@
 #include "EventAccessors.h"
 #include "Logging.h"
 #include "MatrixClient.h"
+#include "UserSettingsPage.h"
 #include "Utils.h"
 
 Q_DECLARE_METATYPE(Reaction)
@@ -24,6 +30,27 @@ QCache<EventStore::IdIndex, mtx::events::collections::TimelineEvents> EventStore
   1000};
 QCache<EventStore::Index, mtx::events::collections::TimelineEvents> EventStore::events_{1000};
 
+namespace {
+//! Decrypts an event or, if persist is set, loads it from the decrypted events in the cache.
+//! Newly decrypted events are appended to toStore then.
+olm::DecryptionResult
+decryptOrLoad(const std::string &room_id,
+              const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e,
+              bool persist,
+              std::vector<mtx::events::collections::TimelineEvents> &toStore)
+{
+    if (persist) {
+        if (auto stored = cache::client()->getDecryptedEvent(room_id, e.event_id))
+            return {olm::DecryptionErrorCode::NoError, std::nullopt, std::move(stored)};
+    }
+
+    auto result = olm::decryptEvent(MegolmSessionIndex(room_id, e.content), e);
+    if (persist && result.event && !e.event_id.empty() && e.event_id[0] == '$')
+        toStore.push_back(*result.event);
+    return result;
+}
+}
+
 EventStore::EventStore(std::string room_id, QObject *)
   : room_id_(std::move(room_id))
 {
@@ -65,6 +92,14 @@ EventStore::EventStore(std::string room_id, QObject *)
           }
 
           uint64_t newFirst = cache::client()->saveOldMessages(room_id_, res);
+
+          std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> encrypted;
+          for (const auto &e : res.chunk)
+              if (auto ev =
+                    std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&e))
+                  encrypted.push_back(*ev);
+          decryptInBackground(std::move(encrypted), false);
+
           if (newFirst == first)
               fetchMore();
           else {
@@ -296,9 +331,10 @@ EventStore::receivedSessionKey(const std::string &session_id)
             decryptedEvents_.remove({room_id_, e.event_id});
             events_by_id_.remove({room_id_, e.event_id});
             events_.remove({room_id_, toInternalIdx(*idx)});
-            emit dataChanged(*idx, *idx);
         }
     }
+
+    decryptInBackground(std::move(request.events), false);
 }
 
 void
@@ -333,6 +369,8 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         emit endInsertRows();
     }
 
+    std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> encrypted;
+
     for (const auto &event : events.events) {
         std::set<std::string> relates_to;
         if (auto redaction =
@@ -377,15 +415,114 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         }
 
         // decrypting and checking some encrypted messages
-        if (auto encrypted =
-              std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&event)) {
-            auto d_event = decryptEvent({room_id_, encrypted->event_id}, *encrypted);
-            if (d_event->event &&
-                std::visit([](auto e) { return (e.sender != utils::localUser().toStdString()); },
-                           *d_event->event)) {
-                handle_room_verification(*d_event->event);
+        if (auto e = std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&event))
+            encrypted.push_back(*e);
+    }
+
+    decryptInBackground(std::move(encrypted), true);
+}
+
+void
+EventStore::decryptInBackground(
+  std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> events,
+  bool fromSync)
+{
+    std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> pending;
+    // Events of a sync, that are decrypted already, are still passed on in order.
+    std::vector<std::optional<olm::DecryptionResult>> decrypted;
+    for (auto &e : events) {
+        if (decrypting_.count(e.event_id))
+            continue;
+
+        if (auto cached = decryptedEvents_.object({room_id_, e.event_id})) {
+            if (fromSync) {
+                pending.push_back(std::move(e));
+                decrypted.push_back(*cached);
             }
+            continue;
         }
+
+        decrypting_.insert(e.event_id);
+        pending.push_back(std::move(e));
+        decrypted.push_back(std::nullopt);
+    }
+
+    if (pending.empty())
+        return;
+
+    // The store may be destroyed, while the events are decrypted, so the results are posted to
+    // the application object and only handed to the store, if it still exists.
+    QtConcurrent::run([self      = QPointer<EventStore>(this),
+                       room_id   = room_id_,
+                       events    = std::move(pending),
+                       decrypted = std::move(decrypted),
+                       persist   = UserSettings::instance()->storeDecryptedMessages(),
+                       fromSync]() mutable {
+        // Events of the same session follow each other, so that a session is looked up and
+        // locked once per run and not once per event. The order of the events is kept.
+        std::vector<std::size_t> order(events.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&events](std::size_t a, std::size_t b) {
+            return std::tie(events[a].content.sender_key, events[a].content.session_id) <
+                   std::tie(events[b].content.sender_key, events[b].content.session_id);
+        });
+
+        std::vector<olm::DecryptionResult> results(events.size());
+        std::vector<mtx::events::collections::TimelineEvents> toStore;
+        for (auto i : order) {
+            if (decrypted[i])
+                results[i] = std::move(*decrypted[i]);
+            else
+                results[i] = decryptOrLoad(room_id, events[i], persist, toStore);
+        }
+        cache::client()->storeDecryptedEvents(room_id, toStore);
+
+        QMetaObject::invokeMethod(
+          QCoreApplication::instance(),
+          [self, events = std::move(events), results = std::move(results), fromSync]() mutable {
+              if (self)
+                  self->storeDecryptionResults(events, std::move(results), fromSync);
+          },
+          Qt::QueuedConnection);
+    });
+}
+
+void
+EventStore::storeDecryptionResults(
+  const std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> &events,
+  std::vector<olm::DecryptionResult> results,
+  bool fromSync)
+{
+    std::vector<int> rows;
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const auto &e = events[i];
+        decrypting_.erase(e.event_id);
+
+        IdIndex idx{room_id_, e.event_id};
+        auto result = decryptedEvents_.object(idx);
+        if (!result)
+            result = cacheDecryptionResult(idx, e, std::move(results[i]));
+
+        if (fromSync && result->event) {
+            if (std::visit(
+                  [](const auto &ev) { return ev.sender != utils::localUser().toStdString(); },
+                  *result->event))
+                handle_room_verification(*result->event);
+            emit syncEventDecrypted(*result->event);
+        }
+
+        if (auto row = idToIndex(e.event_id))
+            rows.push_back(*row);
+    }
+
+    // Consecutive rows are updated together.
+    std::sort(rows.begin(), rows.end());
+    for (std::size_t first = 0; first < rows.size();) {
+        auto last = first;
+        while (last + 1 < rows.size() && rows[last + 1] <= rows[last] + 1)
+            last++;
+        emit dataChanged(rows[first], rows[last]);
+        first = last + 1;
     }
 }
 
@@ -585,6 +722,9 @@ EventStore::get(int idx, bool decrypt)
     if (decrypt) {
         if (auto encrypted =
               std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(event_ptr)) {
+            if (decrypting_.count(encrypted->event_id))
+                return event_ptr;
+
             auto decrypted = decryptEvent({room_id_, encrypted->event_id}, *encrypted);
             if (decrypted->event)
                 return &*decrypted->event;
@@ -622,6 +762,24 @@ EventStore::decryptEvent(const IdIndex &idx,
     if (auto cachedEvent = decryptedEvents_.object(idx))
         return cachedEvent;
 
+    std::vector<mtx::events::collections::TimelineEvents> toStore;
+    auto result =
+      decryptOrLoad(room_id_, e, UserSettings::instance()->storeDecryptedMessages(), toStore);
+
+    // Don't wait for the sync to finish writing.
+    if (!toStore.empty())
+        QtConcurrent::run([room_id = room_id_, toStore = std::move(toStore)]() {
+            cache::client()->storeDecryptedEvents(room_id, toStore);
+        });
+
+    return cacheDecryptionResult(idx, e, std::move(result));
+}
+
+olm::DecryptionResult *
+EventStore::cacheDecryptionResult(const IdIndex &idx,
+                                  const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e,
+                                  olm::DecryptionResult &&decryptionResult)
+{
     MegolmSessionIndex index(room_id_, e.content);
 
     auto asCacheEntry = [&idx](olm::DecryptionResult &&event) {
@@ -630,8 +788,6 @@ EventStore::decryptEvent(const IdIndex &idx,
         return event_ptr;
     };
 
-    auto decryptionResult = olm::decryptEvent(index, e);
-
     if (decryptionResult.error) {
         switch (decryptionResult.error) {
         case olm::DecryptionErrorCode::MissingSession:
@@ -772,6 +928,9 @@ EventStore::get(std::string id, std::string_view related_to, bool decrypt, bool
     if (decrypt) {
         if (auto encrypted =
               std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(event_ptr)) {
+            if (decrypting_.count(encrypted->event_id))
+                return event_ptr;
+
             auto decrypted = decryptEvent(index, *encrypted);
             if (decrypted->event)
                 return &*decrypted->event;
@@ -810,6 +969,9 @@ EventStore::decryptionError(std::string id)
 
     if (auto encrypted =
           std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(event_ptr)) {
+        if (decrypting_.count(encrypted->event_id))
+            return olm::DecryptionErrorCode::NoError;
+
         auto decrypted = decryptEvent(index, *encrypted);
         return decrypted->error;
     }
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <limits>
+#include <set>
 #include <string>
 
 #include <QCache>
@@ -94,6 +95,9 @@ public:
     std::optional<int> idToIndex(std::string_view id) const;
     std::optional<std::string> indexToId(int idx) const;
 
+    //! Whether the event is decrypted in the background. Until then get() returns it encrypted.
+    bool isDecrypting(const std::string &event_id) const { return decrypting_.count(event_id); }
+
 signals:
     void beginInsertRows(int from, int to);
     void endInsertRows();
@@ -113,6 +117,8 @@ signals:
     void startDMVerification(
       const mtx::events::RoomEvent<mtx::events::msg::KeyVerificationRequest> &msg);
     void updateFlowEventId(std::string event_id);
+    //! An encrypted event of a sync was decrypted.
+    void syncEventDecrypted(mtx::events::collections::TimelineEvents event);
 
 public slots:
     void addPending(mtx::events::collections::TimelineEvents event);
@@ -124,6 +130,19 @@ private:
     olm::DecryptionResult *
     decryptEvent(const IdIndex &idx,
                  const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e);
+    olm::DecryptionResult *
+    cacheDecryptionResult(const IdIndex &idx,
+                          const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e,
+                          olm::DecryptionResult &&result);
+    //! Decrypts a batch of events on the thread pool and emits dataChanged for their rows, once
+    //! the results are cached.
+    void decryptInBackground(
+      std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> events,
+      bool fromSync);
+    void storeDecryptionResults(
+      const std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> &events,
+      std::vector<olm::DecryptionResult> results,
+      bool fromSync);
     void handle_room_verification(mtx::events::collections::TimelineEvents event);
 
     std::string room_id_;
@@ -142,6 +161,8 @@ private:
         qint64 requested_at;
     };
     std::map<std::string, PendingKeyRequests> pending_key_requests;
+    //! Ids of the events, that are decrypted in the background right now.
+    std::set<std::string> decrypting_;
 
     std::string current_txn;
     int current_txn_error_count = 0;
@@ -0,0 +1,161 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "MessageSearchModel.h"
+
+#include <QCoreApplication>
+#include <QPointer>
+#include <QtConcurrent>
+
+#include "Cache.h"
+#include "Cache_p.h"
+#include "EventAccessors.h"
+
+//! Results shown at most.
+constexpr std::size_t MAX_SEARCH_RESULTS = 100;
+
+MessageSearchModel::MessageSearchModel(QObject *parent)
+  : QAbstractListModel(parent)
+{}
+
+QHash<int, QByteArray>
+MessageSearchModel::roleNames() const
+{
+    return {
+      {Roles::RoomId, "roomId"},
+      {Roles::RoomName, "roomName"},
+      {Roles::EventId, "eventId"},
+      {Roles::UserId, "userId"},
+      {Roles::UserName, "userName"},
+      {Roles::Body, "body"},
+      {Roles::Timestamp, "timestamp"},
+    };
+}
+
+QVariant
+MessageSearchModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() < 0 || index.row() >= rowCount())
+        return {};
+
+    const auto &result = results_[index.row()];
+    switch (role) {
+    case Roles::RoomId:
+        return result.roomId;
+    case Roles::RoomName:
+        return result.roomName;
+    case Roles::EventId:
+        return result.eventId;
+    case Roles::UserId:
+        return result.userId;
+    case Roles::UserName:
+        return result.userName;
+    case Roles::Body:
+        return result.body;
+    case Roles::Timestamp:
+        return result.timestamp;
+    default:
+        return {};
+    }
+}
+
+void
+MessageSearchModel::setSearchTerm(const QString &term)
+{
+    if (term == searchTerm_)
+        return;
+
+    searchTerm_ = term;
+    emit searchTermChanged();
+    search();
+}
+
+void
+MessageSearchModel::setRoomId(const QString &roomId)
+{
+    if (roomId == roomId_)
+        return;
+
+    roomId_ = roomId;
+    emit roomIdChanged();
+    search();
+}
+
+void
+MessageSearchModel::search()
+{
+    const auto generation = ++generation_;
+
+    if (searchTerm_.trimmed().isEmpty()) {
+        setResults(generation, {});
+        return;
+    }
+
+    if (!searching_) {
+        searching_ = true;
+        emit searchingChanged();
+    }
+
+    // The model may be destroyed by QML, while the search runs, so the results are posted to the
+    // application object and only handed to the model, if it still exists.
+    QtConcurrent::run([self   = QPointer<MessageSearchModel>(this),
+                       term   = searchTerm_,
+                       roomId = roomId_.toStdString(),
+                       generation]() {
+        auto found     = cache::client()->searchMessages(term, roomId, MAX_SEARCH_RESULTS);
+        auto summaries = cache::roomSummaries();
+
+        std::vector<Result> results;
+        results.reserve(found.size());
+        for (const auto &f : found) {
+            auto event = cache::client()->getEvent(f.room_id, f.event_id);
+            if (!event)
+                continue;
+
+            // Encrypted messages are only found, if the decrypted event was stored.
+            auto data = std::move(event->data);
+            if (std::holds_alternative<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(
+                  data)) {
+                auto decrypted = cache::client()->getDecryptedEvent(f.room_id, f.event_id);
+                if (!decrypted)
+                    continue;
+                data = std::move(*decrypted);
+            }
+
+            Result result;
+            result.roomId    = QString::fromStdString(f.room_id);
+            result.roomName  = summaries->infos.value(result.roomId).name;
+            result.eventId   = QString::fromStdString(f.event_id);
+            result.userId    = QString::fromStdString(mtx::accessors::sender(data));
+            result.userName  = cache::displayName(result.roomId, result.userId);
+            result.body      = QString::fromStdString(mtx::accessors::body(data));
+            result.timestamp = mtx::accessors::origin_server_ts(data);
+            results.push_back(std::move(result));
+        }
+
+        QMetaObject::invokeMethod(
+          QCoreApplication::instance(),
+          [self, generation, results = std::move(results)]() mutable {
+              if (self)
+                  self->setResults(generation, std::move(results));
+          },
+          Qt::QueuedConnection);
+    });
+}
+
+void
+MessageSearchModel::setResults(std::uint64_t generation, std::vector<Result> results)
+{
+    if (generation != generation_)
+        return;
+
+    beginResetModel();
+    results_ = std::move(results);
+    endResetModel();
+
+    if (searching_) {
+        searching_ = false;
+        emit searchingChanged();
+    }
+}
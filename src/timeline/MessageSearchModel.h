@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2021 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QAbstractListModel>
+#include <QDateTime>
+#include <QHash>
+#include <QString>
+#include <cstdint>
+#include <vector>
+
+//! Messages found in the local search index, see Cache::searchMessages(). Searches all joined
+//! rooms or only the room set as roomId.
+class MessageSearchModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+    Q_PROPERTY(QString searchTerm READ searchTerm WRITE setSearchTerm NOTIFY searchTermChanged)
+    Q_PROPERTY(QString roomId READ roomId WRITE setRoomId NOTIFY roomIdChanged)
+    Q_PROPERTY(bool searching READ searching NOTIFY searchingChanged)
+
+public:
+    explicit MessageSearchModel(QObject *parent = nullptr);
+
+    enum Roles
+    {
+        RoomId = Qt::UserRole,
+        RoomName,
+        EventId,
+        UserId,
+        UserName,
+        Body,
+        Timestamp,
+    };
+    QHash<int, QByteArray> roleNames() const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override
+    {
+        (void)parent;
+        return static_cast<int>(results_.size());
+    }
+
+    QString searchTerm() const { return searchTerm_; }
+    void setSearchTerm(const QString &term);
+    QString roomId() const { return roomId_; }
+    void setRoomId(const QString &roomId);
+    bool searching() const { return searching_; }
+
+signals:
+    void searchTermChanged();
+    void roomIdChanged();
+    void searchingChanged();
+
+private:
+    struct Result
+    {
+        QString roomId, roomName, eventId, userId, userName, body;
+        QDateTime timestamp;
+    };
+
+    void search();
+    void setResults(std::uint64_t generation, std::vector<Result> results);
+
+    QString searchTerm_, roomId_;
+    std::vector<Result> results_;
+    //! Incremented for every search, results of older searches are dropped.
+    std::uint64_t generation_ = 0;
+    bool searching_           = false;
+};
@@ -4,6 +4,10 @@
 
 #include "RoomlistModel.h"
 
+#include <algorithm>
+
+#include <QTimer>
+
 #include "Cache_p.h"
 #include "ChatPage.h"
 #include "Logging.h"
@@ -30,6 +34,11 @@ RoomlistModel::RoomlistModel(TimelineViewManager *parent)
                 ptr->updateLastMessage();
             }
         }
+
+        for (const auto &roomid : summaries.keys()) {
+            if (!models.contains(roomid))
+                updateLastMessage(roomid);
+        }
     });
 
     connect(this,
@@ -45,6 +54,7 @@ RoomlistModel::RoomlistModel(TimelineViewManager *parent)
           if (this->previewedRooms.contains(roomid)) {
               this->previewedRooms.insert(roomid, std::move(info));
               auto idx = this->roomidToIndex(roomid);
+              updateSortKeys(idx);
               emit dataChanged(index(idx),
                                index(idx),
                                {
@@ -88,11 +98,7 @@ RoomlistModel::data(const QModelIndex &index, int role) const
         auto roomid = roomids.at(index.row());
 
         if (role == Roles::ParentSpaces) {
-            auto parents = cache::client()->getParentRoomIds(roomid.toStdString());
-            QStringList list;
-            for (const auto &t : parents)
-                list.push_back(QString::fromStdString(t));
-            return list;
+            return keyNames(sortKeys.at(index.row()).parentSpaces);
         } else if (role == Roles::RoomId) {
             return roomid;
         } else if (role == Roles::IsDirect) {
@@ -101,38 +107,33 @@ RoomlistModel::data(const QModelIndex &index, int role) const
             return directChatToUser.count(roomid) ? directChatToUser.at(roomid).front() : "";
         }
 
-        if (models.contains(roomid)) {
-            auto room = models.value(roomid);
+        if (auto it = summaries.constFind(roomid); it != summaries.constEnd()) {
+            const auto &room = it.value();
             switch (role) {
             case Roles::AvatarUrl:
-                return room->roomAvatarUrl();
+                return room.avatarUrl;
             case Roles::RoomName:
-                return room->plainRoomName();
+                return room.name;
             case Roles::LastMessage:
-                return room->lastMessage().body;
+                return room.lastMessage.body;
             case Roles::Time:
-                return room->lastMessage().descriptiveTime;
+                return room.lastMessage.descriptiveTime;
             case Roles::Timestamp:
-                return QVariant(static_cast<quint64>(room->lastMessage().timestamp));
+                return QVariant(static_cast<quint64>(room.lastMessage.timestamp));
             case Roles::HasUnreadMessages:
                 return this->roomReadStatus.count(roomid) && this->roomReadStatus.at(roomid);
             case Roles::HasLoudNotification:
-                return room->hasMentions();
+                return room.highlightCount > 0;
             case Roles::NotificationCount:
-                return room->notificationCount();
+                return room.notificationCount;
             case Roles::IsInvite:
                 return false;
             case Roles::IsSpace:
-                return room->isSpace();
+                return room.isSpace;
             case Roles::IsPreview:
                 return false;
-            case Roles::Tags: {
-                auto info = cache::singleRoomInfo(roomid.toStdString());
-                QStringList list;
-                for (const auto &t : info.tags)
-                    list.push_back(QString::fromStdString(t));
-                return list;
-            }
+            case Roles::Tags:
+                return keyNames(sortKeys.at(index.row()).tags);
             default:
                 return {};
             }
@@ -256,9 +257,126 @@ RoomlistModel::updateReadStatus(const std::map<QString, bool> roomReadStatus_)
     }
 }
 void
-RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
+RoomlistModel::appendRoomId(QString roomid)
+{
+    roomids.push_back(std::move(roomid));
+    sortKeys.emplace_back();
+    updateSortKeys((int)roomids.size() - 1);
+}
+
+void
+RoomlistModel::removeRoomId(int idx)
+{
+    roomids.erase(roomids.begin() + idx);
+    sortKeys.erase(sortKeys.begin() + idx);
+}
+
+void
+RoomlistModel::updateSortKeys(int idx)
+{
+    if (idx < 0 || idx >= (int)roomids.size())
+        return;
+
+    const auto &roomid = roomids[idx];
+    auto &keys         = sortKeys[idx];
+
+    keys.timestamp         = 0;
+    keys.notificationCount = 0;
+    keys.flags             = 0;
+
+    if (directChatToUser.count(roomid))
+        keys.flags |= RoomSortKeys::Direct;
+
+    if (auto room = summaries.constFind(roomid); room != summaries.constEnd()) {
+        keys.timestamp         = room->lastMessage.timestamp;
+        keys.notificationCount = room->notificationCount;
+        if (room->highlightCount > 0)
+            keys.flags |= RoomSortKeys::Mentions;
+        if (room->isSpace)
+            keys.flags |= RoomSortKeys::Space;
+    } else if (invites.contains(roomid)) {
+        keys.flags |= RoomSortKeys::Invite;
+    } else {
+        keys.flags |= RoomSortKeys::Preview;
+        if (auto preview = previewedRooms.value(roomid)) {
+            keys.flags |= RoomSortKeys::PreviewFetched;
+            if (preview->is_space)
+                keys.flags |= RoomSortKeys::Space;
+        }
+    }
+}
+
+void
+RoomlistModel::updateTagsAndParents(int idx)
+{
+    if (idx < 0 || idx >= (int)roomids.size())
+        return;
+
+    auto rooms = cache::roomSummaries();
+
+    // Only joined rooms have tags.
+    if (auto info = rooms->infos.constFind(roomids[idx]);
+        summaries.contains(roomids[idx]) && info != rooms->infos.constEnd())
+        setTags(idx, info->tags);
+    else
+        setTags(idx, {});
+
+    updateParentSpaces(idx);
+}
+
+void
+RoomlistModel::updateParentSpaces(int idx)
+{
+    if (idx < 0 || idx >= (int)roomids.size())
+        return;
+
+    auto &parents = sortKeys[idx].parentSpaces;
+    parents.clear();
+    for (const auto &p : cache::roomSummaries()->parentSpaces(roomids[idx].toStdString()))
+        parents.push_back(keyId(QString::fromStdString(p)));
+    std::sort(parents.begin(), parents.end());
+}
+
+void
+RoomlistModel::setTags(int idx, const std::vector<std::string> &tags)
+{
+    if (idx < 0 || idx >= (int)roomids.size())
+        return;
+
+    auto &ids = sortKeys[idx].tags;
+    ids.clear();
+    for (const auto &t : tags)
+        ids.push_back(keyId(QString::fromStdString(t)));
+    std::sort(ids.begin(), ids.end());
+}
+
+std::uint32_t
+RoomlistModel::keyId(const QString &key)
+{
+    if (auto it = keyIds.constFind(key); it != keyIds.constEnd())
+        return it.value();
+
+    auto id = static_cast<std::uint32_t>(keyStrings.size());
+    keyIds.insert(key, id);
+    keyStrings.push_back(key);
+    return id;
+}
+
+QStringList
+RoomlistModel::keyNames(const std::vector<std::uint32_t> &ids) const
+{
+    QStringList list;
+    for (auto id : ids)
+        list.push_back(keyStrings.at(id));
+    return list;
+}
+
+void
+RoomlistModel::addRoom(const QString &room_id,
+                       bool suppressInsertNotification,
+                       std::optional<RoomInfo> info)
 {
-    if (!models.contains(room_id)) {
+    if (!summaries.contains(room_id)) {
         // ensure we get read status updates and are only connected once
         connect(cache::client(),
                 &Cache::roomReadStatus,
@@ -266,73 +384,23 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
                 &RoomlistModel::updateReadStatus,
                 Qt::UniqueConnection);
 
-        QSharedPointer<TimelineModel> newRoom(new TimelineModel(manager, room_id));
-        newRoom->setDecryptDescription(ChatPage::instance()->userSettings()->decryptSidebar());
-
-        connect(newRoom.data(),
-                &TimelineModel::newEncryptedImage,
-                manager->imageProvider(),
-                &MxcImageProvider::addEncryptionInfo);
-        connect(newRoom.data(),
-                &TimelineModel::forwardToRoom,
-                manager,
-                &TimelineViewManager::forwardMessageToRoom);
-        connect(newRoom.data(), &TimelineModel::lastMessageChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::HasLoudNotification,
-                               Roles::LastMessage,
-                               Roles::Timestamp,
-                               Roles::NotificationCount,
-                               Qt::DisplayRole,
-                             });
-        });
-        connect(newRoom.data(), &TimelineModel::roomAvatarUrlChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::AvatarUrl,
-                             });
-        });
-        connect(newRoom.data(), &TimelineModel::roomNameChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::RoomName,
-                             });
-        });
-        connect(newRoom.data(), &TimelineModel::notificationsChanged, this, [room_id, this]() {
-            auto idx = this->roomidToIndex(room_id);
-            emit dataChanged(index(idx),
-                             index(idx),
-                             {
-                               Roles::HasLoudNotification,
-                               Roles::NotificationCount,
-                               Qt::DisplayRole,
-                             });
-
-            int total_unread_msgs = 0;
-
-            for (const auto &room : models) {
-                if (!room.isNull())
-                    total_unread_msgs += room->notificationCount();
-            }
-
-            emit totalUnreadMessageCountUpdated(total_unread_msgs);
-        });
+        if (!info)
+            info = cache::singleRoomInfo(room_id.toStdString());
 
-        newRoom->updateLastMessage();
+        RoomSummary summary;
+        summary.name        = QString::fromStdString(info->name);
+        summary.avatarUrl   = QString::fromStdString(info->avatar_url);
+        summary.isSpace     = info->is_space;
+        summary.lastMessage = TimelineModel::lastMessageFromCache(
+          room_id, ChatPage::instance()->userSettings()->decryptSidebar());
 
         std::vector<QString> previewsToAdd;
-        if (newRoom->isSpace()) {
+        if (summary.isSpace) {
             auto childs = cache::client()->getChildRoomIds(room_id.toStdString());
             for (const auto &c : childs) {
                 auto id = QString::fromStdString(c);
-                if (!(models.contains(id) || invites.contains(id) || previewedRooms.contains(id))) {
+                if (!(summaries.contains(id) || invites.contains(id) ||
+                      previewedRooms.contains(id))) {
                     previewsToAdd.push_back(std::move(id));
                 }
             }
@@ -348,29 +416,35 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
               (int)roomids.size(),
               (int)(roomids.size() + previewsToAdd.size() - ((wasInvite || wasPreview) ? 1 : 0)));
 
-        models.insert(room_id, std::move(newRoom));
+        summaries.insert(room_id, std::move(summary));
         if (wasInvite) {
             auto idx = roomidToIndex(room_id);
             invites.remove(room_id);
+            updateSortKeys(idx);
+            updateTagsAndParents(idx);
             emit dataChanged(index(idx), index(idx));
         } else if (wasPreview) {
             auto idx = roomidToIndex(room_id);
             previewedRooms.remove(room_id);
+            updateSortKeys(idx);
+            updateTagsAndParents(idx);
             emit dataChanged(index(idx), index(idx));
         } else {
-            roomids.push_back(room_id);
+            appendRoomId(room_id);
+            updateTagsAndParents((int)roomids.size() - 1);
         }
 
         if ((wasInvite || wasPreview) && currentRoomPreview_ &&
             currentRoomPreview_->roomid() == room_id) {
-            currentRoom_ = models.value(room_id);
+            currentRoom_ = getRoomById(room_id);
             currentRoomPreview_.reset();
             emit currentRoomChanged();
         }
 
         for (auto p : previewsToAdd) {
             previewedRooms.insert(p, std::nullopt);
-            roomids.push_back(std::move(p));
+            appendRoomId(std::move(p));
+            updateTagsAndParents((int)roomids.size() - 1);
         }
 
         if (!suppressInsertNotification && ((!wasInvite && !wasPreview) || !previewedRooms.empty()))
@@ -380,6 +454,138 @@ RoomlistModel::addRoom(const QString &room_id, bool suppressInsertNotification)
     }
 }
 
+QSharedPointer<TimelineModel>
+RoomlistModel::getRoomById(const QString &room_id)
+{
+    if (auto model = models.value(room_id))
+        return model;
+    else if (!summaries.contains(room_id))
+        return {};
+
+    QSharedPointer<TimelineModel> newRoom(new TimelineModel(manager, room_id));
+    newRoom->setDecryptDescription(ChatPage::instance()->userSettings()->decryptSidebar());
+
+    connect(newRoom.data(),
+            &TimelineModel::newEncryptedImage,
+            manager->imageProvider(),
+            &MxcImageProvider::addEncryptionInfo);
+    connect(newRoom.data(),
+            &TimelineModel::forwardToRoom,
+            manager,
+            &TimelineViewManager::forwardMessageToRoom);
+    connect(newRoom.data(),
+            &TimelineModel::newCallEvent,
+            manager->callManager(),
+            &CallManager::syncEvent,
+            Qt::UniqueConnection);
+
+    auto room = newRoom.data();
+    connect(room, &TimelineModel::lastMessageChanged, this, [room_id, room, this]() {
+        if (!summaries.contains(room_id))
+            return;
+        summaries[room_id].lastMessage = room->lastMessage();
+
+        auto idx = this->roomidToIndex(room_id);
+        updateSortKeys(idx);
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::HasLoudNotification,
+                           Roles::LastMessage,
+                           Roles::Timestamp,
+                           Roles::NotificationCount,
+                           Qt::DisplayRole,
+                         });
+    });
+    connect(room, &TimelineModel::roomAvatarUrlChanged, this, [room_id, this]() {
+        updateSummaryInfo(room_id, cache::singleRoomInfo(room_id.toStdString()));
+    });
+    connect(room, &TimelineModel::roomNameChanged, this, [room_id, this]() {
+        updateSummaryInfo(room_id, cache::singleRoomInfo(room_id.toStdString()));
+    });
+    connect(room, &TimelineModel::notificationsChanged, this, [room_id, room, this]() {
+        if (!summaries.contains(room_id))
+            return;
+        auto &summary             = summaries[room_id];
+        summary.notificationCount = room->notificationCount();
+        summary.highlightCount    = room->highlightCount();
+
+        auto idx = this->roomidToIndex(room_id);
+        updateSortKeys(idx);
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::HasLoudNotification,
+                           Roles::NotificationCount,
+                           Qt::DisplayRole,
+                         });
+
+        int total_unread_msgs = 0;
+
+        for (const auto &r : summaries)
+            total_unread_msgs += r.notificationCount;
+
+        emit totalUnreadMessageCountUpdated(total_unread_msgs);
+    });
+
+    const auto &summary = summaries[room_id];
+    newRoom->setNotificationCounts(summary.notificationCount, summary.highlightCount);
+    newRoom->updateLastMessage();
+
+    models.insert(room_id, newRoom);
+    return newRoom;
+}
+
+void
+RoomlistModel::updateSummaryInfo(const QString &room_id, const RoomInfo &info)
+{
+    if (!summaries.contains(room_id))
+        return;
+
+    auto &summary  = summaries[room_id];
+    auto name      = QString::fromStdString(info.name);
+    auto avatarUrl = QString::fromStdString(info.avatar_url);
+    QVector<int> changed;
+    if (summary.name != name) {
+        summary.name = std::move(name);
+        changed.push_back(Roles::RoomName);
+    }
+    if (summary.avatarUrl != avatarUrl) {
+        summary.avatarUrl = std::move(avatarUrl);
+        changed.push_back(Roles::AvatarUrl);
+    }
+
+    if (!changed.isEmpty()) {
+        auto idx = roomidToIndex(room_id);
+        emit dataChanged(index(idx), index(idx), changed);
+    }
+}
+
+void
+RoomlistModel::updateLastMessage(const QString &room_id)
+{
+    if (!summaries.contains(room_id))
+        return;
+
+    auto description = TimelineModel::lastMessageFromCache(
+      room_id, ChatPage::instance()->userSettings()->decryptSidebar());
+
+    auto &summary = summaries[room_id];
+    if (description != summary.lastMessage) {
+        summary.lastMessage = std::move(description);
+
+        auto idx = roomidToIndex(room_id);
+        updateSortKeys(idx);
+        emit dataChanged(index(idx),
+                         index(idx),
+                         {
+                           Roles::LastMessage,
+                           Roles::Timestamp,
+                           Qt::DisplayRole,
+                         });
+    }
+}
+
 void
 RoomlistModel::fetchPreview(QString roomid_) const
 {
@@ -489,27 +695,76 @@ RoomlistModel::sync(const mtx::responses::Sync &sync_)
               std::get_if<mtx::events::AccountDataEvent<mtx::events::account_data::Direct>>(&e)) {
             auto updatedDMs = updateDMs(*event);
             for (const auto &r : updatedDMs) {
-                if (auto idx = roomidToIndex(r); idx != -1)
+                if (auto idx = roomidToIndex(r); idx != -1) {
+                    updateSortKeys(idx);
                     emit dataChanged(index(idx), index(idx), {IsDirect, DirectChatOtherUserId});
+                }
             }
         }
     }
 
+    bool spacesChanged       = false;
+    bool unreadCountsChanged = false;
     for (const auto &[room_id, room] : sync_.rooms.join) {
+        using namespace mtx::events;
         auto qroomid = QString::fromStdString(room_id);
 
         // addRoom will only add the room, if it doesn't exist
         addRoom(qroomid);
-        const auto &room_model = models.value(qroomid);
-        room_model->sync(room);
-        // room_model->addEvents(room.timeline);
-        connect(room_model.data(),
-                &TimelineModel::newCallEvent,
-                manager->callManager(),
-                &CallManager::syncEvent,
-                Qt::UniqueConnection);
 
-        if (ChatPage::instance()->userSettings()->typingNotifications()) {
+        // Events need a timeline to be processed, everything else can be applied to the summary.
+        auto room_model =
+          room.timeline.events.empty() ? models.value(qroomid) : getRoomById(qroomid);
+        if (room_model) {
+            room_model->sync(room);
+        } else {
+            if (!room.state.events.empty())
+                updateSummaryInfo(qroomid, cache::singleRoomInfo(room_id));
+
+            auto &summary = summaries[qroomid];
+            if (room.unread_notifications.notification_count != summary.notificationCount ||
+                room.unread_notifications.highlight_count != summary.highlightCount) {
+                summary.notificationCount = room.unread_notifications.notification_count;
+                summary.highlightCount    = room.unread_notifications.highlight_count;
+                unreadCountsChanged       = true;
+
+                auto idx = roomidToIndex(qroomid);
+                updateSortKeys(idx);
+                emit dataChanged(index(idx),
+                                 index(idx),
+                                 {
+                                   Roles::HasLoudNotification,
+                                   Roles::NotificationCount,
+                                   Qt::DisplayRole,
+                                 });
+            }
+        }
+
+        for (const auto &e : room.account_data.events) {
+            if (auto tags = std::get_if<AccountDataEvent<account_data::Tags>>(&e)) {
+                std::vector<std::string> names;
+                for (const auto &tag : tags->content.tags)
+                    names.push_back(tag.first);
+
+                auto idx = roomidToIndex(qroomid);
+                setTags(idx, names);
+                emit dataChanged(index(idx), index(idx), {Tags});
+            }
+        }
+
+        // Same events as in Cache::saveJoinedRoom, that change the parents of any room.
+        auto changesSpaces = [](const auto &e) {
+            return std::holds_alternative<StateEvent<state::space::Child>>(e) ||
+                   std::holds_alternative<StateEvent<state::space::Parent>>(e) ||
+                   std::holds_alternative<StateEvent<state::PowerLevels>>(e);
+        };
+        const auto &state    = room.state.events;
+        const auto &timeline = room.timeline.events;
+        if (std::any_of(state.begin(), state.end(), changesSpaces) ||
+            std::any_of(timeline.begin(), timeline.end(), changesSpaces))
+            spacesChanged = true;
+
+        if (room_model && ChatPage::instance()->userSettings()->typingNotifications()) {
             for (const auto &ev : room.ephemeral.events) {
                 if (auto t =
                       std::get_if<mtx::events::EphemeralEvent<mtx::events::ephemeral::Typing>>(
@@ -526,6 +781,21 @@ RoomlistModel::sync(const mtx::responses::Sync &sync_)
         }
     }
 
+    if (unreadCountsChanged) {
+        int total_unread_msgs = 0;
+        for (const auto &r : summaries)
+            total_unread_msgs += r.notificationCount;
+
+        emit totalUnreadMessageCountUpdated(total_unread_msgs);
+    }
+
+    if (spacesChanged) {
+        for (int i = 0; i < (int)roomids.size(); i++)
+            updateParentSpaces(i);
+        if (!roomids.empty())
+            emit dataChanged(index(0), index((int)roomids.size() - 1), {ParentSpaces});
+    }
+
     for (const auto &[room_id, room] : sync_.rooms.leave) {
         (void)room;
         auto qroomid = QString::fromStdString(room_id);
@@ -537,10 +807,11 @@ RoomlistModel::sync(const mtx::responses::Sync &sync_)
         auto idx = this->roomidToIndex(qroomid);
         if (idx != -1) {
             beginRemoveRows(QModelIndex(), idx, idx);
-            roomids.erase(roomids.begin() + idx);
-            if (models.contains(qroomid))
+            removeRoomId(idx);
+            if (summaries.contains(qroomid)) {
+                summaries.remove(qroomid);
                 models.remove(qroomid);
-            else if (invites.contains(qroomid))
+            } else if (invites.contains(qroomid))
                 invites.remove(qroomid);
             endRemoveRows();
         }
@@ -557,11 +828,13 @@ RoomlistModel::sync(const mtx::responses::Sync &sync_)
         if (invites.contains(qroomid)) {
             invites[qroomid] = *invite;
             auto idx         = roomidToIndex(qroomid);
+            updateSortKeys(idx);
             emit dataChanged(index(idx), index(idx));
         } else {
             beginInsertRows(QModelIndex(), (int)roomids.size(), (int)roomids.size());
             invites.insert(qroomid, *invite);
-            roomids.push_back(std::move(qroomid));
+            appendRoomId(std::move(qroomid));
+            updateTagsAndParents((int)roomids.size() - 1);
             endInsertRows();
         }
     }
@@ -572,7 +845,9 @@ RoomlistModel::initializeRooms()
 {
     beginResetModel();
     models.clear();
+    summaries.clear();
     roomids.clear();
+    sortKeys.clear();
     invites.clear();
     currentRoom_ = nullptr;
 
@@ -587,11 +862,14 @@ RoomlistModel::initializeRooms()
 
     invites = cache::client()->invites();
     for (const auto &id : invites.keys()) {
-        roomids.push_back(id);
+        appendRoomId(id);
+        updateTagsAndParents((int)roomids.size() - 1);
     }
 
-    for (const auto &id : cache::client()->roomIds())
-        addRoom(id, true);
+    // Read the summaries of all rooms in one pass, the timelines are created on demand.
+    auto infos = cache::client()->roomInfo(false);
+    for (auto it = infos.constBegin(); it != infos.constEnd(); ++it)
+        addRoom(it.key(), true, it.value());
 
     nhlog::db()->info("Restored {} rooms from cache", rowCount());
 
@@ -603,8 +881,10 @@ RoomlistModel::clear()
 {
     beginResetModel();
     models.clear();
+    summaries.clear();
     invites.clear();
     roomids.clear();
+    sortKeys.clear();
     currentRoom_ = nullptr;
     emit currentRoomChanged();
     endResetModel();
@@ -648,7 +928,7 @@ RoomlistModel::declineInvite(QString roomid)
 
         if (idx != -1) {
             beginRemoveRows(QModelIndex(), idx, idx);
-            roomids.erase(roomids.begin() + idx);
+            removeRoomId(idx);
             invites.remove(roomid);
             endRemoveRows();
             ChatPage::instance()->leaveRoom(roomid);
@@ -658,12 +938,13 @@ RoomlistModel::declineInvite(QString roomid)
 void
 RoomlistModel::leave(QString roomid)
 {
-    if (models.contains(roomid)) {
+    if (summaries.contains(roomid)) {
         auto idx = roomidToIndex(roomid);
 
         if (idx != -1) {
             beginRemoveRows(QModelIndex(), idx, idx);
-            roomids.erase(roomids.begin() + idx);
+            removeRoomId(idx);
+            summaries.remove(roomid);
             models.remove(roomid);
             endRemoveRows();
             ChatPage::instance()->leaveRoom(roomid);
@@ -685,8 +966,8 @@ RoomlistModel::setCurrentRoom(QString roomid)
     }
 
     nhlog::ui()->debug("Trying to switch to: {}", roomid.toStdString());
-    if (models.contains(roomid)) {
-        currentRoom_ = models.value(roomid);
+    if (summaries.contains(roomid)) {
+        currentRoom_ = getRoomById(roomid);
         currentRoomPreview_.reset();
         emit currentRoomChanged();
         nhlog::ui()->debug("Switched to: {}", roomid.toStdString());
@@ -739,29 +1020,29 @@ enum NotificationImportance : short
 }
 
 short int
-FilteredRoomlistModel::calculateImportance(const QModelIndex &idx) const
+FilteredRoomlistModel::calculateImportance(int sourceRow) const
 {
     // Returns the degree of importance of the unread messages in the room.
     // If sorting by importance is disabled in settings, this only ever
     // returns ImportanceDisabled or Invite
-    if (sourceModel()->data(idx, RoomlistModel::IsSpace).toBool()) {
-        if (filterType == FilterBy::Space &&
-            filterStr == sourceModel()->data(idx, RoomlistModel::RoomId).toString())
+    const auto &keys = roomlistmodel->sortKeys[sourceRow];
+    if (keys.has(RoomSortKeys::Space)) {
+        if (filterType == FilterBy::Space && filterStr == roomlistmodel->roomids[sourceRow])
             return CurrentSpace;
         else
             return SubSpace;
-    } else if (sourceModel()->data(idx, RoomlistModel::IsPreview).toBool()) {
-        if (sourceModel()->data(idx, RoomlistModel::IsPreviewFetched).toBool())
+    } else if (keys.has(RoomSortKeys::Preview)) {
+        if (keys.has(RoomSortKeys::PreviewFetched))
             return Preview;
         else
             return NoPreview;
-    } else if (sourceModel()->data(idx, RoomlistModel::IsInvite).toBool()) {
+    } else if (keys.has(RoomSortKeys::Invite)) {
         return Invite;
     } else if (!this->sortByImportance) {
         return ImportanceDisabled;
-    } else if (sourceModel()->data(idx, RoomlistModel::HasLoudNotification).toBool()) {
+    } else if (keys.has(RoomSortKeys::Mentions)) {
         return NewMentions;
-    } else if (sourceModel()->data(idx, RoomlistModel::NotificationCount).toInt() > 0) {
+    } else if (keys.notificationCount > 0) {
         return NewMessage;
     } else {
         return AllEventsRead;
@@ -769,40 +1050,55 @@ FilteredRoomlistModel::calculateImportance(const QModelIndex &idx) const
 }
 
 bool
-FilteredRoomlistModel::lessThan(const QModelIndex &left, const QModelIndex &right) const
+FilteredRoomlistModel::lessThan(int left, int right) const
 {
-    QModelIndex const left_idx  = sourceModel()->index(left.row(), 0, QModelIndex());
-    QModelIndex const right_idx = sourceModel()->index(right.row(), 0, QModelIndex());
-
     // Sort by "importance" (i.e. invites before mentions before
     // notifs before new events before old events), then secondly
     // by recency.
 
     // Checking importance first
-    const auto a_importance = calculateImportance(left_idx);
-    const auto b_importance = calculateImportance(right_idx);
+    const auto a_importance = calculateImportance(left);
+    const auto b_importance = calculateImportance(right);
     if (a_importance != b_importance) {
         return a_importance > b_importance;
     }
 
     // Now sort by recency
     // Zero if empty, otherwise the time that the event occured
-    uint64_t a_recency = sourceModel()->data(left_idx, RoomlistModel::Timestamp).toULongLong();
-    uint64_t b_recency = sourceModel()->data(right_idx, RoomlistModel::Timestamp).toULongLong();
+    uint64_t a_recency = roomlistmodel->sortKeys[left].timestamp;
+    uint64_t b_recency = roomlistmodel->sortKeys[right].timestamp;
 
+    // The source row breaks ties, so that no two rows compare equal.
     if (a_recency != b_recency)
         return a_recency > b_recency;
     else
-        return left.row() < right.row();
+        return left < right;
 }
 
 FilteredRoomlistModel::FilteredRoomlistModel(RoomlistModel *model, QObject *parent)
-  : QSortFilterProxyModel(parent)
+  : QAbstractProxyModel(parent)
   , roomlistmodel(model)
 {
     this->sortByImportance = UserSettings::instance()->sortByImportance();
     setSourceModel(model);
-    setDynamicSortFilter(true);
+
+    connect(model, &RoomlistModel::dataChanged, this, &FilteredRoomlistModel::sourceDataChanged);
+    connect(model,
+            &RoomlistModel::rowsAboutToBeInserted,
+            this,
+            &FilteredRoomlistModel::sourceRowsAboutToBeInserted);
+    connect(model, &RoomlistModel::rowsInserted, this, &FilteredRoomlistModel::sourceRowsInserted);
+    connect(model,
+            &RoomlistModel::rowsAboutToBeRemoved,
+            this,
+            &FilteredRoomlistModel::sourceRowsAboutToBeRemoved);
+    connect(model, &RoomlistModel::rowsRemoved, this, &FilteredRoomlistModel::sourceRowsRemoved);
+    connect(model, &RoomlistModel::modelAboutToBeReset, this, [this]() { beginResetModel(); });
+    connect(model, &RoomlistModel::modelReset, this, [this]() {
+        rebuild();
+        endResetModel();
+    });
+    connect(model, &RoomlistModel::layoutChanged, this, &FilteredRoomlistModel::invalidate);
 
     QObject::connect(UserSettings::instance().get(),
                      &UserSettings::roomSortingChanged,
@@ -817,7 +1113,297 @@ FilteredRoomlistModel::FilteredRoomlistModel(RoomlistModel *model, QObject *pare
             this,
             &FilteredRoomlistModel::currentRoomChanged);
 
-    sort(0);
+    rebuild();
+}
+
+QModelIndex
+FilteredRoomlistModel::mapFromSource(const QModelIndex &sourceIndex) const
+{
+    if (!sourceIndex.isValid() || sourceIndex.row() >= (int)proxyRows.size())
+        return QModelIndex();
+
+    if (auto row = proxyRows[sourceIndex.row()]; row != -1)
+        return index(row, sourceIndex.column());
+    else
+        return QModelIndex();
+}
+
+QModelIndex
+FilteredRoomlistModel::mapToSource(const QModelIndex &proxyIndex) const
+{
+    if (!proxyIndex.isValid() || proxyIndex.row() >= (int)rows.size())
+        return QModelIndex();
+
+    return roomlistmodel->index(rows[proxyIndex.row()], proxyIndex.column());
+}
+
+QModelIndex
+FilteredRoomlistModel::index(int row, int column, const QModelIndex &parent) const
+{
+    if (parent.isValid() || row < 0 || row >= (int)rows.size() || column != 0)
+        return QModelIndex();
+
+    return createIndex(row, column);
+}
+
+int
+FilteredRoomlistModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : (int)rows.size();
+}
+
+int
+FilteredRoomlistModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : 1;
+}
+
+QHash<int, QByteArray>
+FilteredRoomlistModel::roleNames() const
+{
+    return roomlistmodel->roleNames();
+}
+
+void
+FilteredRoomlistModel::invalidate()
+{
+    beginResetModel();
+    rebuild();
+    endResetModel();
+}
+
+void
+FilteredRoomlistModel::rebuild()
+{
+    pendingRows.clear();
+    rows.clear();
+    proxyRows.assign(roomlistmodel->rowCount(), -1);
+
+    for (int row = 0; row < (int)proxyRows.size(); row++) {
+        if (filterAcceptsRow(row))
+            rows.push_back(row);
+    }
+    std::sort(rows.begin(), rows.end(), [this](int a, int b) { return lessThan(a, b); });
+    updateProxyRows(0, (int)rows.size() - 1);
+}
+
+void
+FilteredRoomlistModel::updateProxyRows(int first, int last)
+{
+    for (int row = first; row <= last; row++)
+        proxyRows[rows[row]] = row;
+}
+
+std::vector<int>::iterator
+FilteredRoomlistModel::insertPosition(int sourceRow)
+{
+    return std::lower_bound(
+      rows.begin(), rows.end(), sourceRow, [this](int a, int b) { return lessThan(a, b); });
+}
+
+void
+FilteredRoomlistModel::sourceDataChanged(const QModelIndex &topLeft,
+                                         const QModelIndex &bottomRight,
+                                         const QVector<int> &roles)
+{
+    // Changes to these roles can't move a room.
+    static const QVector<int> displayOnlyRoles = {
+      RoomlistModel::AvatarUrl,
+      RoomlistModel::RoomName,
+      RoomlistModel::LastMessage,
+      RoomlistModel::Time,
+      RoomlistModel::HasUnreadMessages,
+      RoomlistModel::DirectChatOtherUserId,
+    };
+    const bool mayMove = roles.isEmpty() || std::any_of(roles.begin(), roles.end(), [](int r) {
+                             return !displayOnlyRoles.contains(r);
+                         });
+
+    for (int row = std::max(topLeft.row(), 0);
+         row <= bottomRight.row() && row < (int)proxyRows.size();
+         row++) {
+        if (auto proxyRow = proxyRows[row]; proxyRow != -1)
+            emit dataChanged(index(proxyRow, 0), index(proxyRow, 0), roles);
+
+        if (mayMove) {
+            if (pendingRows.empty())
+                QTimer::singleShot(0, this, &FilteredRoomlistModel::processPendingRows);
+            pendingRows.push_back(row);
+        }
+    }
+}
+
+void
+FilteredRoomlistModel::processPendingRows()
+{
+    if (pendingRows.empty())
+        return;
+
+    auto pending = std::move(pendingRows);
+    pendingRows.clear();
+    std::sort(pending.begin(), pending.end());
+    pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+
+    // First remove the rows, that are now filtered out. Rows, that are now accepted, are added
+    // last, since inserting them needs the other rows to be sorted already.
+    std::vector<int> shown, added;
+    for (int row : pending) {
+        const bool accepted = filterAcceptsRow(row);
+        const int proxyRow  = proxyRows[row];
+
+        if (proxyRow != -1 && !accepted) {
+            beginRemoveRows(QModelIndex(), proxyRow, proxyRow);
+            rows.erase(rows.begin() + proxyRow);
+            proxyRows[row] = -1;
+            updateProxyRows(proxyRow, (int)rows.size() - 1);
+            endRemoveRows();
+        } else if (proxyRow != -1) {
+            shown.push_back(row);
+        } else if (accepted) {
+            added.push_back(row);
+        }
+    }
+
+    if (shown.size() == 1) {
+        moveRow(shown.front());
+    } else if (!shown.empty()) {
+        // Move all changed rows in one layout change, instead of one move per room.
+        emit layoutAboutToBeChanged({}, QAbstractItemModel::VerticalSortHint);
+
+        const auto persistentFrom = persistentIndexList();
+        std::vector<int> persistentRows;
+        persistentRows.reserve(persistentFrom.size());
+        for (const auto &idx : persistentFrom)
+            persistentRows.push_back(rows[idx.row()]);
+
+        if (shown.size() * 8 > rows.size()) {
+            std::sort(rows.begin(), rows.end(), [this](int a, int b) { return lessThan(a, b); });
+        } else {
+            // Without the changed rows, the list is still sorted.
+            auto changed = [&shown](int r) {
+                return std::binary_search(shown.begin(), shown.end(), r);
+            };
+            rows.erase(std::remove_if(rows.begin(), rows.end(), changed), rows.end());
+            for (int row : shown)
+                rows.insert(insertPosition(row), row);
+        }
+        updateProxyRows(0, (int)rows.size() - 1);
+
+        QModelIndexList persistentTo;
+        for (int i = 0; i < persistentFrom.size(); i++)
+            persistentTo.push_back(index(proxyRows[persistentRows[i]], persistentFrom[i].column()));
+        changePersistentIndexList(persistentFrom, persistentTo);
+
+        emit layoutChanged({}, QAbstractItemModel::VerticalSortHint);
+    }
+
+    for (int row : added) {
+        const int proxyRow = (int)(insertPosition(row) - rows.begin());
+        beginInsertRows(QModelIndex(), proxyRow, proxyRow);
+        rows.insert(rows.begin() + proxyRow, row);
+        updateProxyRows(proxyRow, (int)rows.size() - 1);
+        endInsertRows();
+    }
+}
+
+void
+FilteredRoomlistModel::moveRow(int sourceRow)
+{
+    const int from = proxyRows[sourceRow];
+    const int last = (int)rows.size() - 1;
+
+    if ((from == 0 || lessThan(rows[from - 1], sourceRow)) &&
+        (from == last || lessThan(sourceRow, rows[from + 1])))
+        return;
+
+    auto less = [this](int a, int b) { return lessThan(a, b); };
+    if (from > 0 && lessThan(sourceRow, rows[from - 1])) {
+        const int to =
+          (int)(std::lower_bound(rows.begin(), rows.begin() + from, sourceRow, less) -
+                rows.begin());
+        beginMoveRows(QModelIndex(), from, from, QModelIndex(), to);
+        std::rotate(rows.begin() + to, rows.begin() + from, rows.begin() + from + 1);
+        updateProxyRows(to, from);
+        endMoveRows();
+    } else {
+        const int to =
+          (int)(std::lower_bound(rows.begin() + from + 1, rows.end(), sourceRow, less) -
+                rows.begin());
+        beginMoveRows(QModelIndex(), from, from, QModelIndex(), to);
+        std::rotate(rows.begin() + from, rows.begin() + from + 1, rows.begin() + to);
+        updateProxyRows(from, to - 1);
+        endMoveRows();
+    }
+}
+
+void
+FilteredRoomlistModel::sourceRowsAboutToBeInserted(const QModelIndex &, int, int)
+{
+    // Pending rows still refer to the old source rows.
+    processPendingRows();
+}
+
+void
+FilteredRoomlistModel::sourceRowsInserted(const QModelIndex &, int first, int last)
+{
+    const int count = last - first + 1;
+    for (auto &row : rows) {
+        if (row >= first)
+            row += count;
+    }
+    for (auto &row : pendingRows) {
+        if (row >= first)
+            row += count;
+    }
+    proxyRows.insert(proxyRows.begin() + first, count, -1);
+
+    for (int row = first; row <= last; row++) {
+        if (!filterAcceptsRow(row))
+            continue;
+
+        const int proxyRow = (int)(insertPosition(row) - rows.begin());
+        beginInsertRows(QModelIndex(), proxyRow, proxyRow);
+        rows.insert(rows.begin() + proxyRow, row);
+        updateProxyRows(proxyRow, (int)rows.size() - 1);
+        endInsertRows();
+    }
+}
+
+void
+FilteredRoomlistModel::sourceRowsAboutToBeRemoved(const QModelIndex &, int first, int last)
+{
+    processPendingRows();
+
+    for (int row = last; row >= first; row--) {
+        const int proxyRow = proxyRows[row];
+        if (proxyRow == -1)
+            continue;
+
+        beginRemoveRows(QModelIndex(), proxyRow, proxyRow);
+        rows.erase(rows.begin() + proxyRow);
+        proxyRows[row] = -1;
+        updateProxyRows(proxyRow, (int)rows.size() - 1);
+        endRemoveRows();
+    }
+}
+
+void
+FilteredRoomlistModel::sourceRowsRemoved(const QModelIndex &, int first, int last)
+{
+    const int count = last - first + 1;
+    proxyRows.erase(proxyRows.begin() + first, proxyRows.begin() + last + 1);
+    for (auto &row : rows) {
+        if (row > last)
+            row -= count;
+    }
+
+    auto removed = [first, last](int row) { return row >= first && row <= last; };
+    pendingRows.erase(std::remove_if(pendingRows.begin(), pendingRows.end(), removed),
+                      pendingRows.end());
+    for (auto &row : pendingRows) {
+        if (row > last)
+            row -= count;
+    }
 }
 
 void
@@ -828,9 +1414,9 @@ FilteredRoomlistModel::updateHiddenTagsAndSpaces()
     hideDMs = false;
     for (const auto &t : UserSettings::instance()->hiddenTags()) {
         if (t.startsWith("tag:"))
-            hiddenTags.push_back(t.mid(4));
+            hiddenTags.push_back(roomlistmodel->keyId(t.mid(4)));
         else if (t.startsWith("space:"))
-            hiddenSpaces.push_back(t.mid(6));
+            hiddenSpaces.push_back(roomlistmodel->keyId(t.mid(6)));
         else if (t == "dm")
             hideDMs = true;
     }
@@ -838,168 +1424,71 @@ FilteredRoomlistModel::updateHiddenTagsAndSpaces()
     invalidateFilter();
 }
 
+//! Whether the room has a hidden tag or is in a hidden space, ignoring the tag or space `except`.
 bool
-FilteredRoomlistModel::filterAcceptsRow(int sourceRow, const QModelIndex &) const
+FilteredRoomlistModel::isHidden(const RoomSortKeys &keys, std::uint32_t except) const
 {
-    if (filterType == FilterBy::Nothing) {
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsPreview)
-              .toBool()) {
-            return false;
-        }
+    auto anyHidden = [except](const std::vector<std::uint32_t> &ids,
+                              const std::vector<std::uint32_t> &hidden) {
+        for (auto h : hidden)
+            if (h != except && std::binary_search(ids.begin(), ids.end(), h))
+                return true;
+        return false;
+    };
 
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool()) {
-            return false;
-        }
+    return anyHidden(keys.tags, hiddenTags) || anyHidden(keys.parentSpaces, hiddenSpaces);
+}
 
-        if (!hiddenTags.empty()) {
-            auto tags = sourceModel()
-                          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                          .toStringList();
+bool
+FilteredRoomlistModel::filterAcceptsRow(int sourceRow) const
+{
+    if (sourceRow < 0 || sourceRow >= (int)roomlistmodel->sortKeys.size())
+        return false;
 
-            for (const auto &t : tags)
-                if (hiddenTags.contains(t))
-                    return false;
-        }
+    const auto &keys = roomlistmodel->sortKeys[sourceRow];
+    auto contains    = [](const std::vector<std::uint32_t> &ids, std::uint32_t id) {
+        return std::binary_search(ids.begin(), ids.end(), id);
+    };
 
-        if (!hiddenSpaces.empty()) {
-            auto parents = sourceModel()
-                             ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                             .toStringList();
-            for (const auto &t : parents)
-                if (hiddenSpaces.contains(t))
-                    return false;
-        }
+    if (filterType == FilterBy::Nothing) {
+        if (keys.has(RoomSortKeys::Preview) || keys.has(RoomSortKeys::Space))
+            return false;
 
-        if (hideDMs) {
-            return !sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-                      .toBool();
-        }
+        if (isHidden(keys, filterId))
+            return false;
 
-        return true;
+        return !(hideDMs && keys.has(RoomSortKeys::Direct));
     } else if (filterType == FilterBy::DirectChats) {
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsPreview)
-              .toBool()) {
+        if (keys.has(RoomSortKeys::Preview) || keys.has(RoomSortKeys::Space))
             return false;
-        }
 
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool()) {
+        if (isHidden(keys, filterId))
             return false;
-        }
 
-        if (!hiddenTags.empty()) {
-            auto tags = sourceModel()
-                          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                          .toStringList();
-
-            for (const auto &t : tags)
-                if (hiddenTags.contains(t))
-                    return false;
-        }
-
-        if (!hiddenSpaces.empty()) {
-            auto parents = sourceModel()
-                             ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                             .toStringList();
-            for (const auto &t : parents)
-                if (hiddenSpaces.contains(t))
-                    return false;
-        }
-
-        return sourceModel()
-          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-          .toBool();
+        return keys.has(RoomSortKeys::Direct);
     } else if (filterType == FilterBy::Tag) {
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsPreview)
-              .toBool()) {
+        if (keys.has(RoomSortKeys::Preview) || keys.has(RoomSortKeys::Space))
             return false;
-        }
 
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool()) {
+        if (!contains(keys.tags, filterId))
             return false;
-        }
-
-        auto tags = sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                      .toStringList();
 
-        if (!tags.contains(filterStr))
+        // The selected tag or space itself is never hidden.
+        if (isHidden(keys, filterId))
             return false;
 
-        if (!hiddenTags.empty()) {
-            for (const auto &t : tags)
-                if (t != filterStr && hiddenTags.contains(t))
-                    return false;
-        }
-
-        if (!hiddenSpaces.empty()) {
-            auto parents = sourceModel()
-                             ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                             .toStringList();
-            for (const auto &t : parents)
-                if (hiddenSpaces.contains(t))
-                    return false;
-        }
-
-        if (hideDMs) {
-            return !sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-                      .toBool();
-        }
-
-        return true;
+        return !(hideDMs && keys.has(RoomSortKeys::Direct));
     } else if (filterType == FilterBy::Space) {
-        if (filterStr == sourceModel()
-                           ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::RoomId)
-                           .toString())
+        if (filterStr == roomlistmodel->roomids[sourceRow])
             return true;
 
-        auto parents = sourceModel()
-                         ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::ParentSpaces)
-                         .toStringList();
-
-        if (!parents.contains(filterStr))
+        if (!contains(keys.parentSpaces, filterId))
             return false;
 
-        if (!hiddenTags.empty()) {
-            auto tags = sourceModel()
-                          ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::Tags)
-                          .toStringList();
-
-            for (const auto &t : tags)
-                if (hiddenTags.contains(t))
-                    return false;
-        }
-
-        if (!hiddenSpaces.empty()) {
-            for (const auto &t : parents)
-                if (t != filterStr && hiddenSpaces.contains(t))
-                    return false;
-        }
-
-        if (sourceModel()
-              ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsSpace)
-              .toBool() &&
-            !parents.contains(filterStr)) {
+        if (isHidden(keys, filterId))
             return false;
-        }
-
-        if (hideDMs) {
-            return !sourceModel()
-                      ->data(sourceModel()->index(sourceRow, 0), RoomlistModel::IsDirect)
-                      .toBool();
-        }
 
-        return true;
+        return !(hideDMs && keys.has(RoomSortKeys::Direct));
     } else {
         return true;
     }
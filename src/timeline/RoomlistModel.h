@@ -6,10 +6,12 @@
 
 #include <CacheStructs.h>
 #include <QAbstractListModel>
+#include <QAbstractProxyModel>
 #include <QHash>
 #include <QSharedPointer>
-#include <QSortFilterProxyModel>
 #include <QString>
+#include <QStringList>
+#include <cstdint>
 #include <set>
 
 #include <mtx/responses/sync.hpp>
@@ -40,6 +42,43 @@ public:
     bool isInvite_ = false;
 };
 
+//! What the room list shows for a joined room. Loaded for all rooms at once on startup, so that
+//! a TimelineModel only needs to be created, once a room is opened or receives new events.
+struct RoomSummary
+{
+    QString name, avatarUrl;
+    DescInfo lastMessage{};
+    int notificationCount = 0;
+    int highlightCount    = 0;
+    bool isSpace          = false;
+};
+
+//! Everything the room list is sorted and filtered by. Kept up to date by the RoomlistModel, so
+//! that sorting and filtering neither goes through QVariants nor through the cache.
+struct RoomSortKeys
+{
+    enum Flag : std::uint8_t
+    {
+        Space          = 1 << 0,
+        Preview        = 1 << 1,
+        PreviewFetched = 1 << 2,
+        Invite         = 1 << 3,
+        Direct         = 1 << 4,
+        Mentions       = 1 << 5,
+    };
+
+    //! Id, that is never assigned to a tag or space.
+    static constexpr std::uint32_t NoKey = ~std::uint32_t{0};
+
+    bool has(Flag f) const { return flags & f; }
+
+    std::uint64_t timestamp = 0;
+    int notificationCount   = 0;
+    std::uint8_t flags      = 0;
+    //! Sorted ids of the tags and parent spaces, see RoomlistModel::keyId().
+    std::vector<std::uint32_t> tags, parentSpaces;
+};
+
 class RoomlistModel : public QAbstractListModel
 {
     Q_OBJECT
@@ -77,13 +116,10 @@ public:
         return (int)roomids.size();
     }
     QVariant data(const QModelIndex &index, int role) const override;
-    QSharedPointer<TimelineModel> getRoomById(QString id) const
-    {
-        if (models.contains(id))
-            return models.value(id);
-        else
-            return {};
-    }
+    //! Returns the timeline of a joined room, creating it on first use.
+    QSharedPointer<TimelineModel> getRoomById(const QString &id);
+    //! Returns the timeline of a room, if it was created already.
+    QSharedPointer<TimelineModel> existingRoom(const QString &id) const { return models.value(id); }
 
 public slots:
     void initializeRooms();
@@ -121,13 +157,36 @@ signals:
     void fetchedPreview(QString roomid, RoomInfo info);
 
 private:
-    void addRoom(const QString &room_id, bool suppressInsertNotification = false);
+    void addRoom(const QString &room_id,
+                 bool suppressInsertNotification = false,
+                 std::optional<RoomInfo> info    = std::nullopt);
+    void updateSummaryInfo(const QString &room_id, const RoomInfo &info);
+    void updateLastMessage(const QString &room_id);
     void fetchPreview(QString roomid) const;
     std::set<QString> updateDMs(mtx::events::AccountDataEvent<mtx::events::account_data::Direct> e);
 
+    void appendRoomId(QString roomid);
+    void removeRoomId(int idx);
+    //! Updates the sort keys, that are derived from the in memory state of a room.
+    void updateSortKeys(int idx);
+    //! Reads the tags and parent spaces of a room from the cache.
+    void updateTagsAndParents(int idx);
+    void updateParentSpaces(int idx);
+    void setTags(int idx, const std::vector<std::string> &tags);
+    //! Tags and space ids are stored as small integers in the sort keys.
+    std::uint32_t keyId(const QString &key);
+    QStringList keyNames(const std::vector<std::uint32_t> &ids) const;
+
     TimelineViewManager *manager = nullptr;
+    //! roomids and sortKeys are parallel, sortKeys[i] belongs to roomids[i].
     std::vector<QString> roomids;
+    std::vector<RoomSortKeys> sortKeys;
+    QHash<QString, std::uint32_t> keyIds;
+    QStringList keyStrings;
     QHash<QString, RoomInfo> invites;
+    //! All joined rooms.
+    QHash<QString, RoomSummary> summaries;
+    //! The joined rooms, that were opened or received events since the start.
     QHash<QString, QSharedPointer<TimelineModel>> models;
     std::map<QString, bool> roomReadStatus;
     QHash<QString, std::optional<RoomInfo>> previewedRooms;
@@ -140,7 +199,11 @@ private:
     friend class FilteredRoomlistModel;
 };
 
-class FilteredRoomlistModel : public QSortFilterProxyModel
+//! Sorted and filtered view of the RoomlistModel. Instead of resorting everything when a room
+//! changes, like a QSortFilterProxyModel with a dynamic sort filter would, only the changed rows
+//! are moved to their new position. Changes are collected until control returns to the event
+//! loop, so that all rooms updated by one sync are moved in a single layout change.
+class FilteredRoomlistModel : public QAbstractProxyModel
 {
     Q_OBJECT
     Q_PROPERTY(
@@ -149,8 +212,16 @@ class FilteredRoomlistModel : public QSortFilterProxyModel
                  RESET resetCurrentRoom)
 public:
     FilteredRoomlistModel(RoomlistModel *model, QObject *parent = nullptr);
-    bool lessThan(const QModelIndex &left, const QModelIndex &right) const override;
-    bool filterAcceptsRow(int sourceRow, const QModelIndex &) const override;
+
+    QModelIndex mapFromSource(const QModelIndex &sourceIndex) const override;
+    QModelIndex mapToSource(const QModelIndex &proxyIndex) const override;
+    QModelIndex index(int row,
+                      int column,
+                      const QModelIndex &parent = QModelIndex()) const override;
+    QModelIndex parent(const QModelIndex &) const override { return {}; }
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    QHash<int, QByteArray> roleNames() const override;
 
 public slots:
     int roomidToIndex(QString roomid)
@@ -194,6 +265,7 @@ public slots:
             filterType = FilterBy::Nothing;
             filterStr.clear();
         }
+        filterId = filterStr.isEmpty() ? RoomSortKeys::NoKey : roomlistmodel->keyId(filterStr);
 
         invalidateFilter();
     }
@@ -204,8 +276,36 @@ signals:
     void currentRoomChanged();
 
 private:
-    short int calculateImportance(const QModelIndex &idx) const;
+    bool lessThan(int left, int right) const;
+    bool filterAcceptsRow(int sourceRow) const;
+    short int calculateImportance(int sourceRow) const;
+    bool isHidden(const RoomSortKeys &keys, std::uint32_t except) const;
+
+    //! Sorts and filters all rooms again, used when the sort order or filter changes.
+    void invalidate();
+    void invalidateFilter() { invalidate(); }
+    void rebuild();
+    //! Moves the rows, that changed since the last call, to their new position.
+    void processPendingRows();
+    void moveRow(int sourceRow);
+    void updateProxyRows(int first, int last);
+    std::vector<int>::iterator insertPosition(int sourceRow);
+
+    void sourceDataChanged(const QModelIndex &topLeft,
+                           const QModelIndex &bottomRight,
+                           const QVector<int> &roles);
+    void sourceRowsAboutToBeInserted(const QModelIndex &parent, int first, int last);
+    void sourceRowsInserted(const QModelIndex &parent, int first, int last);
+    void sourceRowsAboutToBeRemoved(const QModelIndex &parent, int first, int last);
+    void sourceRowsRemoved(const QModelIndex &parent, int first, int last);
+
     RoomlistModel *roomlistmodel;
+    //! The source rows in the order they are shown.
+    std::vector<int> rows;
+    //! The proxy row of every source row, -1 if it is filtered out.
+    std::vector<int> proxyRows;
+    //! Source rows, that changed and may need to move.
+    std::vector<int> pendingRows;
     bool sortByImportance = true;
 
     enum class FilterBy
@@ -215,8 +315,9 @@ private:
         DirectChats,
         Nothing,
     };
-    QString filterStr   = "";
-    FilterBy filterType = FilterBy::Nothing;
-    QStringList hiddenTags, hiddenSpaces;
+    QString filterStr      = "";
+    std::uint32_t filterId = RoomSortKeys::NoKey;
+    FilterBy filterType    = FilterBy::Nothing;
+    std::vector<std::uint32_t> hiddenTags, hiddenSpaces;
     bool hideDMs = false;
 };
@@ -380,7 +380,13 @@ TimelineModel::TimelineModel(TimelineViewManager *manager, QString room_id, QObj
         nhlog::ui()->debug(
           "data changed {} to {}", events.size() - to - 1, events.size() - from - 1);
         emit dataChanged(index(events.size() - to - 1, 0), index(events.size() - from - 1, 0));
+        if (to == events.size() - 1)
+            updateLastMessage();
     });
+    connect(&events,
+            &EventStore::syncEventDecrypted,
+            this,
+            [this](mtx::events::collections::TimelineEvents e) { handleCallEvent(std::move(e)); });
 
     connect(&events, &EventStore::beginInsertRows, this, [this](int from, int to) {
         int first = events.size() - to;
@@ -849,34 +855,12 @@ TimelineModel::addEvents(const mtx::responses::Timeline &timeline)
 
     using namespace mtx::events;
 
-    for (auto e : timeline.events) {
-        if (auto encryptedEvent = std::get_if<EncryptedEvent<msg::Encrypted>>(&e)) {
-            MegolmSessionIndex index(room_id_.toStdString(), encryptedEvent->content);
-
-            auto result = olm::decryptEvent(index, *encryptedEvent);
-            if (result.event)
-                e = result.event.value();
-        }
+    // Encrypted events are handled by handleCallEvent(), once EventStore decrypted them.
+    for (const auto &e : timeline.events) {
+        if (handleCallEvent(e))
+            continue;
 
-        if (std::holds_alternative<RoomEvent<msg::CallCandidates>>(e) ||
-            std::holds_alternative<RoomEvent<msg::CallInvite>>(e) ||
-            std::holds_alternative<RoomEvent<msg::CallAnswer>>(e) ||
-            std::holds_alternative<RoomEvent<msg::CallHangUp>>(e))
-            std::visit(
-              [this](auto &event) {
-                  event.room_id = room_id_.toStdString();
-                  if constexpr (std::is_same_v<std::decay_t<decltype(event)>,
-                                               RoomEvent<msg::CallAnswer>> ||
-                                std::is_same_v<std::decay_t<decltype(event)>,
-                                               RoomEvent<msg::CallHangUp>>)
-                      emit newCallEvent(event);
-                  else {
-                      if (event.sender != http::client()->user_id().to_string())
-                          emit newCallEvent(event);
-                  }
-              },
-              e);
-        else if (std::holds_alternative<StateEvent<state::Avatar>>(e))
+        if (std::holds_alternative<StateEvent<state::Avatar>>(e))
             emit roomAvatarUrlChanged();
         else if (std::holds_alternative<StateEvent<state::Name>>(e))
             emit roomNameChanged();
@@ -899,6 +883,33 @@ TimelineModel::addEvents(const mtx::responses::Timeline &timeline)
     updateLastMessage();
 }
 
+bool
+TimelineModel::handleCallEvent(mtx::events::collections::TimelineEvents e)
+{
+    using namespace mtx::events;
+
+    if (!std::holds_alternative<RoomEvent<msg::CallCandidates>>(e) &&
+        !std::holds_alternative<RoomEvent<msg::CallInvite>>(e) &&
+        !std::holds_alternative<RoomEvent<msg::CallAnswer>>(e) &&
+        !std::holds_alternative<RoomEvent<msg::CallHangUp>>(e))
+        return false;
+
+    std::visit(
+      [this](auto &event) {
+          event.room_id = room_id_.toStdString();
+          if constexpr (std::is_same_v<std::decay_t<decltype(event)>,
+                                       RoomEvent<msg::CallAnswer>> ||
+                        std::is_same_v<std::decay_t<decltype(event)>, RoomEvent<msg::CallHangUp>>)
+              emit newCallEvent(event);
+          else {
+              if (event.sender != http::client()->user_id().to_string())
+                  emit newCallEvent(event);
+          }
+      },
+      e);
+    return true;
+}
+
 template<typename T>
 auto
 isMessage(const mtx::events::RoomEvent<T> &e)
@@ -952,42 +963,152 @@ isYourJoin(const mtx::events::Event<T> &)
     return false;
 }
 
+//! The description of an event, if it can be shown as the last message of a room.
+std::optional<DescInfo>
+lastMessageDescription(const mtx::events::collections::TimelineEvents &event,
+                       const QString &room_id)
+{
+    if (std::visit([](const auto &e) -> bool { return isYourJoin(e); }, event)) {
+        auto time   = mtx::accessors::origin_server_ts(event);
+        uint64_t ts = time.toMSecsSinceEpoch();
+        return DescInfo{QString::fromStdString(mtx::accessors::event_id(event)),
+                        QString::fromStdString(http::client()->user_id().to_string()),
+                        TimelineModel::tr("You joined this room."),
+                        utils::descriptiveTime(time),
+                        ts,
+                        time};
+    }
+    if (!std::visit([](const auto &e) -> bool { return isMessage(e); }, event))
+        return std::nullopt;
+
+    return utils::getMessageDescription(
+      event,
+      QString::fromStdString(http::client()->user_id().to_string()),
+      cache::displayName(room_id, QString::fromStdString(mtx::accessors::sender(event))));
+}
+
 void
 TimelineModel::updateLastMessage()
 {
+    using namespace mtx::events;
+
     for (auto it = events.size() - 1; it >= 0; --it) {
         auto event = events.get(it, decryptDescription);
         if (!event)
             continue;
 
-        if (std::visit([](const auto &e) -> bool { return isYourJoin(e); }, *event)) {
-            auto time   = mtx::accessors::origin_server_ts(*event);
-            uint64_t ts = time.toMSecsSinceEpoch();
-            auto description =
-              DescInfo{QString::fromStdString(mtx::accessors::event_id(*event)),
-                       QString::fromStdString(http::client()->user_id().to_string()),
-                       tr("You joined this room."),
-                       utils::descriptiveTime(time),
-                       ts,
-                       time};
-            if (description != lastMessage_) {
-                lastMessage_ = description;
+        // Updated again once decrypted, instead of showing the message as encrypted meanwhile.
+        if (decryptDescription && events.isDecrypting(mtx::accessors::event_id(*event)))
+            return;
+
+        if (auto description = lastMessageDescription(*event, room_id_)) {
+            if (*description != lastMessage_) {
+                lastMessage_ = *description;
                 emit lastMessageChanged();
+
+                // The cache only knows the encrypted message, remember the decrypted one for the
+                // next start, if decrypted messages may be stored.
+                if (decryptDescription && UserSettings::instance()->storeDecryptedMessages() &&
+                    !std::holds_alternative<EncryptedEvent<msg::Encrypted>>(*event)) {
+                    auto decrypted = *event;
+                    auto original  = events.get(it, false);
+                    if (original &&
+                        std::holds_alternative<EncryptedEvent<msg::Encrypted>>(*original))
+                        cache::client()->storeLastMessage(room_id_.toStdString(), decrypted, true);
+                }
             }
             return;
         }
-        if (!std::visit([](const auto &e) -> bool { return isMessage(e); }, *event))
+    }
+}
+
+DescInfo
+TimelineModel::lastMessageFromCache(const QString &room_id, bool decrypt)
+{
+    using namespace mtx::events;
+
+    const auto roomid = room_id.toStdString();
+
+    if (auto last = cache::client()->lastMessage(roomid)) {
+        mtx::events::collections::TimelineEvent event;
+        if (last->encrypted && !decrypt) {
+            // Enough to describe an encrypted message, no need to read the original event.
+            EncryptedEvent<msg::Encrypted> encrypted;
+            encrypted.event_id         = last->event_id;
+            encrypted.sender           = last->sender;
+            encrypted.origin_server_ts = last->timestamp;
+            encrypted.room_id          = roomid;
+            event.data                 = std::move(encrypted);
+        } else {
+            try {
+                mtx::events::collections::from_json(last->event, event);
+            } catch (const std::exception &e) {
+                nhlog::db()->warn("failed to parse last message of {}: {}", roomid, e.what());
+            }
+
+            // No decrypted version was stored.
+            if (auto e = std::get_if<EncryptedEvent<msg::Encrypted>>(&event.data); e && decrypt) {
+                MegolmSessionIndex index(roomid, e->content);
+                if (auto result = olm::decryptEvent(index, *e); result.event)
+                    event.data = std::move(*result.event);
+            }
+        }
+
+        if (auto description = lastMessageDescription(event.data, room_id))
+            return *description;
+    }
+
+    // Caches of older versions don't store the last message, search for it once.
+    auto range = cache::client()->getTimelineRange(roomid);
+    if (!range)
+        return {};
+
+    for (auto idx = range->last + 1; idx-- > range->first;) {
+        auto event_id = cache::client()->getTimelineEventId(roomid, idx);
+        if (!event_id)
             continue;
 
-        auto description = utils::getMessageDescription(
-          *event,
-          QString::fromStdString(http::client()->user_id().to_string()),
-          cache::displayName(room_id_, QString::fromStdString(mtx::accessors::sender(*event))));
-        if (description != lastMessage_) {
-            lastMessage_ = description;
-            emit lastMessageChanged();
+        auto event = cache::client()->getEvent(roomid, *event_id);
+        if (!event)
+            continue;
+
+        const bool encrypted =
+          std::holds_alternative<EncryptedEvent<msg::Encrypted>>(event->data);
+        if (encrypted) {
+            // Store the encrypted message first, a decrypted version is only stored next to it.
+            cache::client()->storeLastMessage(roomid, event->data, true);
+
+            if (decrypt) {
+                auto &e = std::get<EncryptedEvent<msg::Encrypted>>(event->data);
+                MegolmSessionIndex index(roomid, e.content);
+                if (auto result = olm::decryptEvent(index, e); result.event) {
+                    event->data = std::move(*result.event);
+                    if (UserSettings::instance()->storeDecryptedMessages())
+                        cache::client()->storeLastMessage(roomid, event->data, true);
+                }
+            }
+
+            if (auto description = lastMessageDescription(event->data, room_id))
+                return *description;
+            continue;
         }
-        return;
+
+        if (auto description = lastMessageDescription(event->data, room_id)) {
+            cache::client()->storeLastMessage(roomid, event->data, false);
+            return *description;
+        }
+    }
+
+    return {};
+}
+
+void
+TimelineModel::setNotificationCounts(int notifications, int highlights)
+{
+    if (notifications != notification_count || highlights != highlight_count) {
+        notification_count = notifications;
+        highlight_count    = highlights;
+        emit notificationsChanged();
     }
 }
 
@@ -2134,46 +2255,30 @@ TimelineModel::resetEdit()
 QString
 TimelineModel::roomName() const
 {
-    auto info = cache::getRoomInfo({room_id_.toStdString()});
-
-    if (!info.count(room_id_))
-        return "";
-    else
-        return utils::replaceEmoji(QString::fromStdString(info[room_id_].name).toHtmlEscaped());
+    auto info = cache::singleRoomInfo(room_id_.toStdString());
+    return utils::replaceEmoji(QString::fromStdString(info.name).toHtmlEscaped());
 }
 
 QString
 TimelineModel::plainRoomName() const
 {
-    auto info = cache::getRoomInfo({room_id_.toStdString()});
-
-    if (!info.count(room_id_))
-        return "";
-    else
-        return QString::fromStdString(info[room_id_].name);
+    auto info = cache::singleRoomInfo(room_id_.toStdString());
+    return QString::fromStdString(info.name);
 }
 
 QString
 TimelineModel::roomAvatarUrl() const
 {
-    auto info = cache::getRoomInfo({room_id_.toStdString()});
-
-    if (!info.count(room_id_))
-        return "";
-    else
-        return QString::fromStdString(info[room_id_].avatar_url);
+    auto info = cache::singleRoomInfo(room_id_.toStdString());
+    return QString::fromStdString(info.avatar_url);
 }
 
 QString
 TimelineModel::roomTopic() const
 {
-    auto info = cache::getRoomInfo({room_id_.toStdString()});
-
-    if (!info.count(room_id_))
-        return "";
-    else
-        return utils::replaceEmoji(
-          utils::linkifyMessage(QString::fromStdString(info[room_id_].topic).toHtmlEscaped()));
+    auto info = cache::singleRoomInfo(room_id_.toStdString());
+    return utils::replaceEmoji(
+      utils::linkifyMessage(QString::fromStdString(info.topic).toHtmlEscaped()));
 }
 
 QStringList
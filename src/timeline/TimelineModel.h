@@ -299,6 +299,9 @@ public:
     RelatedInfo relatedInfo(QString id);
 
     DescInfo lastMessage() const { return lastMessage_; }
+    //! The last message of rooms, that have no model. Uses the message stored by the cache, which
+    //! needs neither a search through the timeline nor decryption.
+    static DescInfo lastMessageFromCache(const QString &room_id, bool decrypt);
     bool isSpace() const { return isSpace_; }
     bool isEncrypted() const { return isEncrypted_; }
     crypto::Trust trustlevel() const;
@@ -369,6 +372,9 @@ public slots:
 
     bool hasMentions() { return highlight_count > 0; }
     int notificationCount() { return notification_count; }
+    int highlightCount() { return highlight_count; }
+    //! Used when the model is created after the counts were received with a sync.
+    void setNotificationCounts(int notifications, int highlights);
 
     QString scrollTarget() const;
 
@@ -417,6 +423,8 @@ private:
     template<typename T>
     void sendEncryptedMessage(mtx::events::RoomEvent<T> msg, mtx::events::EventType eventType);
     void readEvent(const std::string &id);
+    //! Emits newCallEvent for call events, returns false for all other events.
+    bool handleCallEvent(mtx::events::collections::TimelineEvents e);
 
     void setPaginationInProgress(const bool paginationInProgress);
 
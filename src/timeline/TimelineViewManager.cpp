@@ -24,6 +24,7 @@
 #include "Logging.h"
 #include "MainWindow.h"
 #include "MatrixClient.h"
+#include "MessageSearchModel.h"
 #include "MxcImageProvider.h"
 #include "ReadReceiptsModel.h"
 #include "RoomDirectoryModel.h"
@@ -274,6 +275,7 @@ TimelineViewManager::TimelineViewManager(CallManager *callManager, ChatPage *par
       emoji::staticMetaObject, "im.nheko.EmojiModel", 1, 0, "EmojiCategory", "Error: Only enums");
 
     qmlRegisterType<RoomDirectoryModel>("im.nheko", 1, 0, "RoomDirectoryModel");
+    qmlRegisterType<MessageSearchModel>("im.nheko", 1, 0, "MessageSearchModel");
 
 #ifdef USE_QUICK_VIEW
     view      = new QQuickView(parent);
@@ -448,7 +450,8 @@ void
 TimelineViewManager::updateReadReceipts(const QString &room_id,
                                         const std::vector<QString> &event_ids)
 {
-    if (auto room = rooms_->getRoomById(room_id)) {
+    // Rooms without a timeline load their receipts, once it is created.
+    if (auto room = rooms_->existingRoom(room_id)) {
         room->markEventsAsRead(event_ids);
     }
 }
@@ -456,7 +459,7 @@ TimelineViewManager::updateReadReceipts(const QString &room_id,
 void
 TimelineViewManager::receivedSessionKey(const std::string &room_id, const std::string &session_id)
 {
-    if (auto room = rooms_->getRoomById(QString::fromStdString(room_id))) {
+    if (auto room = rooms_->existingRoom(QString::fromStdString(room_id))) {
         room->receivedSessionKey(session_id);
     }
 }